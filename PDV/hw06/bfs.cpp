@@ -1,5 +1,7 @@
 #include "bfs.h"
+#include "search_stats.h"
 #include <atomic>
+#include <limits>
 #include <mutex>
 #include <omp.h>
 
@@ -54,6 +56,8 @@ state_ptr bfs(state_ptr root) {
   std::mutex best_goal_m;
 
   while (!opened.empty()) {
+    STATS_LAYER_BEGIN();
+
     // --- Reduce currently opened layer to goal state with the lowest id, if any ---
 #pragma omp parallel for
     for (size_t i = 0; i < opened.size(); i++) {
@@ -68,22 +72,31 @@ state_ptr bfs(state_ptr root) {
     }
 
     // --- If goal was found, return early ---
-    if (best_goal) return best_goal;
+    if (best_goal) {
+      STATS_LAYER_END();
+      return best_goal;
+    }
 
     // --- No goal in this layer found, expand next layer ---
 #pragma omp parallel
     {
       size_t tid = omp_get_thread_num();
+      STATS_BUSY_BEGIN(busy);
 
-#pragma omp for
+#pragma omp for nowait
       for (size_t i = 0; i < opened.size(); i++) {
         const auto &state = opened[i];
         const auto &neighbors = state->next_states();
+        STATS_ADD(expanded, 1);
+        STATS_ADD(generated, neighbors.size());
 
         for (const auto &neigh : neighbors) {
           if (visited.insert(neigh->id())) local_next_opened[tid].push_back(neigh);
+          else STATS_ADD(duplicates, 1);
         }
       }
+
+      STATS_BUSY_END(busy);
     }
 
     std::vector<state_ptr> next_opened;
@@ -92,7 +105,105 @@ state_ptr bfs(state_ptr root) {
       v.clear();
     }
     opened = std::move(next_opened);
+    STATS_LAYER_END();
+  }
+
+  return nullptr;
+}
+
+// State kept by value: its encoding sits in the layer arena, parent is an index into the previous layer
+struct CompactEntry {
+  uint64_t id;
+  size_t parent;
+};
+
+struct CompactLayer {
+  std::vector<CompactEntry> entries;
+  std::vector<uint8_t> arena; // entries[i] is encoded at i * codec.size
+};
+
+/*
+ * Same result as bfs, but layers hold encoded states instead of shared pointers,
+ * so no refcount is touched across threads and only the goal path is rebuilt as state_ptr
+ */
+state_ptr bfs_compact(state_ptr root, const StateCodec &codec) {
+  size_t max_t = omp_get_max_threads();
+  HashSet visited(1 << 25); // 34M, all must fit!
+  std::vector<std::vector<CompactEntry>> history;
+  std::vector<CompactLayer> local_next(max_t);
+
+  CompactLayer opened;
+  opened.entries.push_back({root->id(), 0});
+  opened.arena.resize(codec.size);
+  codec.encode(*root, opened.arena.data());
+  bool goal_found = root->goal();
+  uint64_t goal_id = root->id();
+
+  while (!opened.entries.empty()) {
+    STATS_LAYER_BEGIN();
+
+    // --- Goals of this layer were checked as it was generated, rebuild the path of the lowest id ---
+    if (goal_found) {
+      size_t idx = 0;
+      while (opened.entries[idx].id != goal_id) idx++;
+      STATS_LAYER_END();
+      std::vector<uint64_t> path(history.size());
+      const std::vector<CompactEntry> *layer = &opened.entries;
+      for (size_t d = history.size(); d > 0; d--) {
+        path[d - 1] = (*layer)[idx].id;
+        idx = (*layer)[idx].parent;
+        layer = &history[d - 1];
+      }
+      return replay_path(root, path);
+    }
+
+    // --- No goal in this layer, expand the next one and check its goals on the way, each state is decoded once ---
+    std::mutex goal_m;
+#pragma omp parallel
+    {
+      size_t tid = omp_get_thread_num();
+      CompactLayer &next = local_next[tid];
+      STATS_BUSY_BEGIN(busy);
+
+#pragma omp for nowait
+      for (size_t i = 0; i < opened.entries.size(); i++) {
+        state_ptr state = codec.decode(&opened.arena[i * codec.size]);
+        const auto &neighbors = state->next_states();
+        STATS_ADD(expanded, 1);
+        STATS_ADD(generated, neighbors.size());
+
+        for (const auto &neigh : neighbors) {
+          if (!visited.insert(neigh->id())) {
+            STATS_ADD(duplicates, 1);
+            continue;
+          }
+          if (neigh->goal()) {
+            std::lock_guard lock(goal_m);
+            if (!goal_found || neigh->id() < goal_id) goal_id = neigh->id();
+            goal_found = true;
+          }
+          next.entries.push_back({neigh->id(), i});
+          next.arena.resize(next.arena.size() + codec.size);
+          codec.encode(*neigh, &next.arena[next.arena.size() - codec.size]);
+        }
+      }
+
+      STATS_BUSY_END(busy);
+    }
+
+    CompactLayer next_opened;
+    for (auto &local : local_next) {
+      next_opened.entries.insert(next_opened.entries.end(), local.entries.begin(), local.entries.end());
+      next_opened.arena.insert(next_opened.arena.end(), local.arena.begin(), local.arena.end());
+      local.entries.clear();
+      local.arena.clear();
+    }
+
+    // --- Only ids and parents of older layers are needed for the path ---
+    history.push_back(std::move(opened.entries));
+    opened = std::move(next_opened);
+    STATS_LAYER_END();
   }
 
   return nullptr;
-}
\ No newline at end of file
+}
@@ -1,5 +1,9 @@
 #pragma once
 
 #include "state.h"
+#include "state_codec.h"
+#include <string>
 
 state_ptr bfs(state_ptr root);
+state_ptr bfs_compact(state_ptr root, const StateCodec &codec);
+state_ptr bfs_external(state_ptr root, const StateCodec &codec, const std::string &dir, size_t memory_limit = 256 << 20);
@@ -0,0 +1,366 @@
+#include "bfs.h"
+#include "search_stats.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <omp.h>
+#include <queue>
+#include <stdexcept>
+#include <vector>
+
+/*
+ * Layers live on disk as records [id | parent id | encoded state] sorted by id.
+ * Duplicates are detected late: children of a layer are sorted into runs, the runs are merged and
+ * everything already in the sorted file of visited ids is dropped while the next layer is written.
+ * Earlier layers are only read again to follow parents back from the goal.
+ */
+
+static constexpr size_t RECORD_HEADER = 2 * sizeof(uint64_t);
+static constexpr size_t READ_BLOCK = 1 << 14; // Most records decoded and expanded at once
+static constexpr size_t ID_SIZE = sizeof(uint64_t); // Records of the visited file are bare ids
+
+static uint64_t record_id(const uint8_t *r) {
+  uint64_t id;
+  memcpy(&id, r, sizeof(id));
+  return id;
+}
+
+static uint64_t record_parent(const uint8_t *r) {
+  uint64_t parent;
+  memcpy(&parent, r + sizeof(uint64_t), sizeof(parent));
+  return parent;
+}
+
+static void write_record(uint8_t *out, const state &s, uint64_t parent, const StateCodec &codec) {
+  uint64_t id = s.id();
+  memcpy(out, &id, sizeof(id));
+  memcpy(out + sizeof(id), &parent, sizeof(parent));
+  codec.encode(s, out + RECORD_HEADER);
+}
+
+struct FileCloser {
+  void operator()(FILE *f) const { fclose(f); }
+};
+using File = std::unique_ptr<FILE, FileCloser>;
+
+static File open_file(const std::string &path, const char *mode) {
+  File f(fopen(path.c_str(), mode));
+  if (!f) throw std::runtime_error("bfs_external: can't open " + path);
+  return f;
+}
+
+class RecordReader {
+  File file;
+  size_t record_size;
+  size_t block;
+  std::vector<uint8_t> buf;
+  size_t pos = 0, count = 0;
+
+public:
+  RecordReader(const std::string &path, size_t record_size, size_t block)
+      : file(open_file(path, "rb")), record_size(record_size), block(block), buf(block * record_size) {}
+
+  // Next block of whole records, 0 at the end
+  size_t read_block(const uint8_t *&records) {
+    count = fread(buf.data(), record_size, block, file.get());
+    if (count == 0 && ferror(file.get())) throw std::runtime_error("bfs_external: read failed");
+    pos = count;
+    records = buf.data();
+    return count;
+  }
+
+  // Single record stream on top of the blocks, nullptr at the end
+  const uint8_t *next() {
+    if (pos == count) {
+      const uint8_t *unused;
+      if (read_block(unused) == 0) return nullptr;
+      pos = 0;
+    }
+    return buf.data() + record_size * pos++;
+  }
+
+  // Binary search in a sorted layer file
+  bool find(uint64_t id, std::vector<uint8_t> &out) {
+    fseek(file.get(), 0, SEEK_END);
+    long lo = 0, hi = ftell(file.get()) / (long)record_size;
+    out.resize(record_size);
+    while (lo < hi) {
+      long mid = lo + (hi - lo) / 2;
+      fseek(file.get(), mid * (long)record_size, SEEK_SET);
+      if (fread(out.data(), record_size, 1, file.get()) != 1) throw std::runtime_error("bfs_external: read failed");
+      uint64_t mid_id = record_id(out.data());
+      if (mid_id == id) return true;
+      if (mid_id < id) lo = mid + 1;
+      else hi = mid;
+    }
+    return false;
+  }
+};
+
+class RecordWriter {
+  File file;
+  size_t record_size;
+
+public:
+  RecordWriter(const std::string &path, size_t record_size) : file(open_file(path, "wb")), record_size(record_size) {}
+
+  void write(const uint8_t *records, size_t count) {
+    if (fwrite(records, record_size, count, file.get()) != count) throw std::runtime_error("bfs_external: write failed");
+  }
+
+  // Flushes the file, before it is renamed or read
+  void close() {
+    if (fclose(file.release()) != 0) throw std::runtime_error("bfs_external: write failed");
+  }
+};
+
+class ExternalBfs {
+  state_ptr root;
+  const StateCodec &codec;
+  std::string dir;
+  size_t memory_limit;
+  size_t record_size;
+  size_t run_capacity;
+  std::vector<uint8_t> run;
+  size_t run_count = 0;
+  std::vector<std::string> runs;
+  size_t layers = 0;          // Layer files written so far
+  bool next_has_goal = false; // Some child written to the runs is a goal, so the next layer holds one
+
+  std::string layer_path(size_t depth) const { return dir + "/layer_" + std::to_string(depth) + ".bin"; }
+  std::string visited_path() const { return dir + "/visited.bin"; }
+  std::string visited_next_path() const { return dir + "/visited_next.bin"; }
+
+  // Records per read when count readers are open at once, together they get the half of memory_limit the run doesn't
+  size_t block_size(size_t count, size_t size) const {
+    return std::clamp<size_t>(memory_limit / 2 / count / size, 1, READ_BLOCK);
+  }
+
+  // Everything written under dir, also when the search throws
+  void remove_files() {
+    for (const auto &path : runs) std::remove(path.c_str());
+    runs.clear();
+    for (size_t d = 0; d < layers; d++) std::remove(layer_path(d).c_str());
+    std::remove(visited_path().c_str());
+    std::remove(visited_next_path().c_str());
+  }
+
+  struct Cleanup {
+    ExternalBfs &bfs;
+    ~Cleanup() { bfs.remove_files(); }
+  };
+
+  // Sorts the in-memory children by id, drops duplicates and writes them as one run
+  void flush_run(size_t depth) {
+    if (run_count == 0) return;
+
+    std::vector<uint32_t> order(run_count);
+    for (size_t i = 0; i < run_count; i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+      return record_id(&run[a * record_size]) < record_id(&run[b * record_size]);
+    });
+
+    std::string path = dir + "/run_" + std::to_string(depth) + "_" + std::to_string(runs.size()) + ".bin";
+    RecordWriter writer(path, record_size);
+    uint64_t last = 0;
+    for (size_t i = 0; i < run_count; i++) {
+      const uint8_t *r = &run[order[i] * record_size];
+      if (i > 0 && record_id(r) == last) {
+        STATS_ADD(duplicates, 1);
+        continue;
+      }
+      last = record_id(r);
+      writer.write(r, 1);
+    }
+
+    runs.push_back(path);
+    run_count = 0;
+  }
+
+  void add_to_run(const std::vector<uint8_t> &records, size_t depth) {
+    size_t count = records.size() / record_size;
+    for (size_t i = 0; i < count; i++) {
+      if (run_count == run_capacity) flush_run(depth);
+      memcpy(&run[run_count++ * record_size], &records[i * record_size], record_size);
+    }
+  }
+
+  /*
+   * Expands one layer into sorted runs, or only finds the lowest-id goal of a layer known to hold one.
+   * Goals are checked as children are generated, so no state of the goal layer is ever expanded
+   */
+  bool expand(size_t depth, std::vector<uint8_t> &goal) {
+    size_t max_t = omp_get_max_threads();
+    std::vector<std::vector<uint8_t>> local_children(max_t);
+    // Children of a block are held until it is done, a reader share per few children each state has
+    RecordReader reader(layer_path(depth), record_size, block_size(4, record_size));
+    bool has_goal = next_has_goal;
+    next_has_goal = false;
+
+    const uint8_t *records;
+    while (size_t count = reader.read_block(records)) {
+      size_t goal_idx = count;
+      bool child_goal = false;
+
+#pragma omp parallel
+      {
+        auto &children = local_children[omp_get_thread_num()];
+        STATS_BUSY_BEGIN(busy);
+
+#pragma omp for reduction(min : goal_idx) reduction(|| : child_goal) nowait
+        for (size_t i = 0; i < count; i++) {
+          const uint8_t *r = records + i * record_size;
+          state_ptr s = codec.decode(r + RECORD_HEADER);
+
+          if (has_goal) {
+            if (s->goal()) goal_idx = std::min(goal_idx, i);
+            continue;
+          }
+          const auto &neighbors = s->next_states();
+          STATS_ADD(expanded, 1);
+          STATS_ADD(generated, neighbors.size());
+
+          for (const auto &neigh : neighbors) {
+            child_goal = child_goal || neigh->goal();
+            children.resize(children.size() + record_size);
+            write_record(&children[children.size() - record_size], *neigh, record_id(r), codec);
+          }
+        }
+
+        STATS_BUSY_END(busy);
+      }
+
+      // Layer is sorted, so the first goal of the first block with one has the lowest id
+      if (goal_idx < count) {
+        goal.assign(records + goal_idx * record_size, records + (goal_idx + 1) * record_size);
+        return true;
+      }
+
+      next_has_goal = next_has_goal || child_goal;
+      for (auto &children : local_children) {
+        add_to_run(children, depth + 1);
+        children.clear();
+      }
+    }
+
+    flush_run(depth + 1);
+    return false;
+  }
+
+  /*
+   * K-way merge of the runs into the next layer without states visited before, the new ids are merged into
+   * the visited file on the way. Duplicates dropped here and in flush_run add up to generated minus written,
+   * what bfs counts at its visited set
+   */
+  size_t merge(size_t depth) {
+    size_t block = block_size(runs.size() + 1, record_size);
+    std::vector<std::unique_ptr<RecordReader>> run_readers;
+    using Head = std::pair<uint64_t, size_t>; // (id, run)
+    std::priority_queue<Head, std::vector<Head>, std::greater<>> heads;
+    std::vector<const uint8_t *> current(runs.size());
+    for (size_t i = 0; i < runs.size(); i++) {
+      run_readers.push_back(std::make_unique<RecordReader>(runs[i], record_size, block));
+      current[i] = run_readers[i]->next();
+      if (current[i]) heads.push({record_id(current[i]), i});
+    }
+
+    RecordReader visited(visited_path(), ID_SIZE, block_size(runs.size() + 1, ID_SIZE));
+    const uint8_t *seen = visited.next();
+    RecordWriter visited_next(visited_next_path(), ID_SIZE);
+    RecordWriter writer(layer_path(depth + 1), record_size);
+    layers = depth + 2;
+    size_t written = 0;
+    bool any = false;
+    uint64_t last = 0;
+
+    while (!heads.empty()) {
+      auto [id, i] = heads.top();
+      heads.pop();
+      const uint8_t *r = current[i];
+
+      if (!any || id != last) {
+        any = true;
+        last = id;
+
+        for (; seen && record_id(seen) < id; seen = visited.next()) visited_next.write(seen, 1);
+        if (!seen || record_id(seen) != id) {
+          writer.write(r, 1);
+          visited_next.write(r, 1); // The id leads the record
+          written++;
+        } else {
+          STATS_ADD(duplicates, 1);
+        }
+      } else {
+        STATS_ADD(duplicates, 1);
+      }
+
+      current[i] = run_readers[i]->next();
+      if (current[i]) heads.push({record_id(current[i]), i});
+    }
+    for (; seen; seen = visited.next()) visited_next.write(seen, 1);
+
+    run_readers.clear();
+    for (const auto &path : runs) std::remove(path.c_str());
+    runs.clear();
+
+    visited_next.close();
+    std::filesystem::rename(visited_next_path(), visited_path());
+
+    return written;
+  }
+
+  // Follows parent ids back through the layer files and replays the path from the root
+  state_ptr reconstruct(size_t depth, const std::vector<uint8_t> &goal) {
+    std::vector<uint64_t> path(depth);
+    std::vector<uint8_t> record = goal;
+    for (size_t d = depth; d > 0; d--) {
+      path[d - 1] = record_id(record.data());
+      RecordReader reader(layer_path(d - 1), record_size, 1);
+      if (!reader.find(record_parent(record.data()), record)) throw std::runtime_error("bfs_external: parent lost");
+    }
+    return replay_path(root, path);
+  }
+
+public:
+  ExternalBfs(state_ptr root, const StateCodec &codec, const std::string &dir, size_t memory_limit)
+      : root(root), codec(codec), dir(dir), memory_limit(memory_limit), record_size(RECORD_HEADER + codec.size),
+        run_capacity(std::max<size_t>(1, memory_limit / 2 / record_size)), run(run_capacity * record_size) {}
+
+  state_ptr run_search() {
+    std::filesystem::create_directories(dir);
+    Cleanup cleanup{*this};
+
+    std::vector<uint8_t> record(record_size);
+    write_record(record.data(), *root, root->id(), codec);
+    layers = 1;
+    RecordWriter(layer_path(0), record_size).write(record.data(), 1);
+    RecordWriter(visited_path(), ID_SIZE).write(record.data(), 1);
+    next_has_goal = root->goal();
+
+    state_ptr result = nullptr;
+    size_t depth = 0;
+    while (true) {
+      STATS_LAYER_BEGIN();
+      std::vector<uint8_t> goal;
+      if (expand(depth, goal)) {
+        STATS_LAYER_END();
+        result = reconstruct(depth, goal);
+        break;
+      }
+      size_t written = merge(depth);
+      STATS_LAYER_END();
+      if (written == 0) break;
+      depth++;
+    }
+    return result;
+  }
+};
+
+/*
+ * Same result as bfs, memory_limit bounds the sorted run and the read buffers, whatever the depth
+ */
+state_ptr bfs_external(state_ptr root, const StateCodec &codec, const std::string &dir, size_t memory_limit) {
+  return ExternalBfs(root, codec, dir, memory_limit).run_search();
+}
@@ -1,44 +1,108 @@
-#include "state.h"
+#include "iddfs.h"
+#include "search_stats.h"
 #include <algorithm>
+#include <atomic>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <omp.h>
+#include <thread>
 #include <vector>
 
-struct alignas(64) Context {
+static constexpr uint64_t NO_COST = std::numeric_limits<uint64_t>::max();
+
+// Unexplored sibling range [next, end) of current's neighbours, thieves move its upper half into a frame of their own
+struct Frame {
+  state_ptr current;
+  std::vector<state_ptr> neighbors; // Moved from next_states, its buffer stays put when the stack grows
+  size_t next;
+  size_t end;
+  uint64_t prune_from; // Best goal cost below this makes the range useless
+};
+
+// Explicit DFS stack of one thread, the lock is only contended by a thief
+struct alignas(64) Worker {
+  std::mutex m;
+  std::vector<Frame> stack;
   state_ptr best_goal = nullptr;
-  uint64_t next_limit = std::numeric_limits<uint64_t>::max();
 };
 
-void iddfs_parallel(state_ptr current, uint64_t limit, Context &ctx, int depth) {
-  // --- Prune if cost is already too high ---
-  if (ctx.best_goal && current->total_cost() >= ctx.best_goal->total_cost()) return;
+struct Context {
+  alignas(64) std::atomic<uint64_t> best_cost{NO_COST};
+  alignas(64) std::atomic<uint64_t> next_limit{NO_COST};
+  alignas(64) std::atomic<size_t> idle{0};
+  size_t active = 0;
+  uint64_t limit;
+  Heuristic heuristic;
+  std::vector<Worker> workers;
 
-  // --- Expand neighbours ---
-  const auto &neighbors = current->next_states();
-  for (size_t i = 0; i < neighbors.size(); i++) {
-    const auto &neigh = neighbors[i];
-    uint64_t n_cost = neigh->total_cost();
+  Context(size_t max_t, uint64_t limit, Heuristic heuristic) : limit(limit), heuristic(heuristic), workers(max_t) {}
+};
+
+static void atomic_min(std::atomic<uint64_t> &target, uint64_t value) {
+  uint64_t cur = target.load(std::memory_order_relaxed);
+  while (value < cur && !target.compare_exchange_weak(cur, value, std::memory_order_relaxed)) {
+  }
+}
+
+static bool better_goal(const state_ptr &a, const state_ptr &b) {
+  if (!b) return true;
+  return a->total_cost() < b->total_cost() || (a->total_cost() == b->total_cost() && a->id() < b->id());
+}
+
+static uint64_t estimate(Heuristic heuristic, const state &s) { return heuristic ? heuristic(s) : 0; }
+
+/*
+ * Without a remaining estimate a node as expensive as the best goal can't lead to a better one,
+ * with it the node may still lead to an equally expensive goal with a lower id
+ */
+static Frame make_frame(const state_ptr &s, uint64_t h) {
+  Frame frame{s, s->next_states(), 0, 0, s->total_cost() + h + (h == 0 ? 1 : 0)};
+  frame.end = frame.neighbors.size();
+  STATS_ADD(expanded, 1);
+  STATS_ADD(generated, frame.end);
+  return frame;
+}
+
+// Runs own stack until it is empty, one lock per neighbour
+static void expand(Context &ctx, Worker &self) {
+  Frame child;
+  bool has_child = false;
+  while (true) {
+    const state *current;
+    const state_ptr *neigh_p;
+    uint64_t prune_from;
+    {
+      std::lock_guard lock(self.m);
+      // --- Frame of the previous neighbour goes on the stack together with taking the next one ---
+      if (has_child) self.stack.push_back(std::move(child));
+      has_child = false;
+      while (!self.stack.empty() && self.stack.back().next == self.stack.back().end) self.stack.pop_back();
+      if (self.stack.empty()) return;
+
+      // Frame (and so both pointees) is popped only by this thread
+      Frame &frame = self.stack.back();
+      current = frame.current.get();
+      neigh_p = &frame.neighbors[frame.next++];
+      prune_from = frame.prune_from;
+    }
+    const state_ptr &neigh = *neigh_p;
+
+    // --- Prune if cost is already too high ---
+    if (ctx.best_cost.load(std::memory_order_relaxed) < prune_from) continue;
 
     // --- Out of bounds, update next limit ---
-    if (n_cost > limit) {
-      if (n_cost < ctx.next_limit) {
-#pragma omp critical(limit_update)
-        {
-          if (n_cost < ctx.next_limit) ctx.next_limit = n_cost;
-        }
-      }
+    uint64_t n_cost = neigh->total_cost();
+    uint64_t n_h = estimate(ctx.heuristic, *neigh);
+    if (n_cost + n_h > ctx.limit) {
+      atomic_min(ctx.next_limit, n_cost + n_h);
       continue;
     }
 
-    // --- Update goal ---
+    // --- Update goal, ties on cost are resolved by id after the iteration ---
     if (neigh->goal()) {
-#pragma omp critical(goal_update)
-      {
-        if (!ctx.best_goal || n_cost < ctx.best_goal->total_cost() || (n_cost == ctx.best_goal->total_cost() && neigh->id() < ctx.best_goal->id())) {
-          ctx.best_goal = neigh;
-        }
-      }
+      if (better_goal(neigh, self.best_goal)) self.best_goal = neigh;
+      atomic_min(ctx.best_cost, n_cost);
       continue;
     }
 
@@ -47,46 +111,101 @@ void iddfs_parallel(state_ptr current, uint64_t limit, Context &ctx, int depth)
     if (parent && parent->id() == neigh->id()) continue;
 
     // --- Further expansion ---
-    if (i < neighbors.size() - 1 && depth < 5 && neighbors.size() > 2) {
-#pragma omp task shared(ctx) untied
-      iddfs_parallel(neigh, limit, ctx, depth + 1);
-    } else {
-      iddfs_parallel(neigh, limit, ctx, depth + 1);
+    child = make_frame(neigh, n_h);
+    has_child = true;
+  }
+}
+
+// Takes upper half of the shallowest unexplored sibling range of some other thread
+static bool steal(Context &ctx, size_t tid) {
+  for (size_t k = 1; k < ctx.active; k++) {
+    Worker &victim = ctx.workers[(tid + k) % ctx.active];
+    Frame stolen;
+    {
+      std::lock_guard lock(victim.m);
+      auto it = std::find_if(victim.stack.begin(), victim.stack.end(), [](const Frame &f) { return f.next < f.end; });
+      if (it == victim.stack.end()) continue;
+
+      // Owner never reads past its new end, so the upper half can be moved out
+      size_t mid = it->next + (it->end - it->next) / 2;
+      auto first = it->neighbors.begin();
+      stolen = Frame{it->current, std::vector<state_ptr>(std::make_move_iterator(first + mid), std::make_move_iterator(first + it->end)),
+                     0, it->end - mid, it->prune_from};
+      it->end = mid;
+      // Victim is busy while we hold its lock, so idle can't reach active in between
+      ctx.idle.fetch_sub(1);
+    }
+
+    Worker &self = ctx.workers[tid];
+    std::lock_guard lock(self.m);
+    self.stack.push_back(std::move(stolen));
+    return true;
+  }
+
+  return false;
+}
+
+static void iddfs_parallel(Context &ctx) {
+  size_t tid = omp_get_thread_num();
+
+  while (true) {
+    STATS_BUSY_BEGIN(busy);
+    expand(ctx, ctx.workers[tid]);
+    STATS_BUSY_END(busy);
+
+    ctx.idle.fetch_add(1);
+    while (!steal(ctx, tid)) {
+      if (ctx.idle.load() == ctx.active) return;
+      std::this_thread::yield();
     }
   }
 }
 
 /*
- * Works with both uniform-cost and weighted graphs
+ * Iterative deepening on total cost plus heuristic, i.e. IDA* (plain IDDFS without heuristic)
  */
-state_ptr iddfs(state_ptr root) {
+static state_ptr deepening(state_ptr root, Heuristic heuristic) {
   if (root->goal()) return root;
 
-  Context ctx;
-  uint64_t limit = root->total_cost();
+  size_t max_t = omp_get_max_threads();
+  uint64_t root_h = estimate(heuristic, *root);
+  uint64_t limit = root->total_cost() + root_h;
 
   while (true) {
-    ctx.next_limit = std::numeric_limits<uint64_t>::max();
-    ctx.best_goal = nullptr;
+    STATS_LAYER_BEGIN();
+    Context ctx(max_t, limit, heuristic);
+    ctx.workers[0].stack.push_back(make_frame(root, root_h));
 
 #pragma omp parallel
     {
 #pragma omp single
-      {
-        // --- Split work from start ---
-        const auto &neighbors = root->next_states();
-        for (const auto &neigh : neighbors) {
-#pragma omp task shared(ctx) untied
-          iddfs_parallel(neigh, limit, ctx, 0);
-        }
-      }
+      ctx.active = omp_get_num_threads();
+
+      iddfs_parallel(ctx);
+    }
+
+    // --- Reduce per-thread goals to the cheapest one with the lowest id ---
+    state_ptr best_goal = nullptr;
+    for (auto &w : ctx.workers) {
+      if (w.best_goal && better_goal(w.best_goal, best_goal)) best_goal = w.best_goal;
     }
+    STATS_LAYER_END();
 
-    if (ctx.best_goal) return ctx.best_goal;
-    if (ctx.next_limit == std::numeric_limits<uint64_t>::max()) break;
+    if (best_goal) return best_goal;
+    if (ctx.next_limit.load() == NO_COST) break;
 
-    limit = ctx.next_limit;
+    limit = ctx.next_limit.load();
   }
 
   return nullptr;
 }
+
+/*
+ * Works with both uniform-cost and weighted graphs
+ */
+state_ptr iddfs(state_ptr root) { return deepening(root, nullptr); }
+
+/*
+ * Same optimal-cost, lowest-id result as iddfs, an inadmissible heuristic breaks optimality
+ */
+state_ptr ida_star(state_ptr root, Heuristic heuristic) { return deepening(root, heuristic); }
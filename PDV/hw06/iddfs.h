@@ -2,4 +2,8 @@
 
 #include "state.h"
 
+// Admissible lower bound on the remaining cost from a state to its closest goal
+using Heuristic = uint64_t (*)(const state &s);
+
 state_ptr iddfs(state_ptr root);
+state_ptr ida_star(state_ptr root, Heuristic heuristic);
@@ -0,0 +1,14 @@
+#include "search.h"
+
+state_ptr search(state_ptr root, Strategy strategy, Heuristic heuristic) {
+  switch (strategy) {
+  case Strategy::BFS:
+    return bfs(root);
+  case Strategy::IDDFS:
+    return iddfs(root);
+  case Strategy::IDA_STAR:
+    return ida_star(root, heuristic);
+  }
+
+  return nullptr;
+}
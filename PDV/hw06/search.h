@@ -0,0 +1,12 @@
+#pragma once
+
+#include "bfs.h"
+#include "iddfs.h"
+
+enum class Strategy {
+  BFS,     // Uniform-cost graphs only
+  IDDFS,   // Heuristic is ignored
+  IDA_STAR // Falls back to IDDFS without heuristic
+};
+
+state_ptr search(state_ptr root, Strategy strategy, Heuristic heuristic = nullptr);
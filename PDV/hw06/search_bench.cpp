@@ -0,0 +1,292 @@
+#include "search.h"
+#include "search_stats.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <omp.h>
+#include <random>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Synthetic instances for comparing the strategies, CSV on stdout.
+ * Each run is forked so that its peak memory is its own. Without SEARCH_STATS only
+ * the expansions counted by the states themselves are reported.
+ * duplicate_rate is the share of generated states that did not enter the next layer
+ * because they were known already, the same for every bfs variant and 0 for iddfs, which keeps no visited set.
+ */
+
+// Expansions counted by the states, one counter per thread on its own cache line, summed after the run
+struct alignas(64) ExpansionCount {
+  uint64_t n = 0;
+};
+static std::vector<ExpansionCount> expansions;
+
+static void count_expansion() { expansions[omp_get_thread_num()].n++; }
+
+static uint64_t total_expansions() {
+  uint64_t sum = 0;
+  for (const auto &e : expansions) sum += e.n;
+  return sum;
+}
+
+// --- 3x3 sliding puzzle, uniform cost, manhattan distance heuristic ---
+class puzzle_state : public state {
+  uint64_t tiles; // 4 bits per cell, 0 is the blank
+
+  static int at(uint64_t t, int i) { return (t >> (4 * i)) & 0xF; }
+  static uint64_t with(uint64_t t, int i, int v) { return (t & ~(0xFULL << (4 * i))) | ((uint64_t)v << (4 * i)); }
+
+public:
+  static constexpr uint64_t GOAL = 0x087654321ULL; // 1..8 then blank
+
+  puzzle_state(state_ptr previous, uint64_t tiles) : state(previous, previous ? 1 : 0), tiles(tiles) {}
+
+  std::vector<state_ptr> next_states() const override {
+    count_expansion();
+    return neighbours(tiles, shared_from_this());
+  }
+
+  static std::vector<state_ptr> neighbours(uint64_t tiles, const state_ptr &self) {
+    int blank = 0;
+    while (at(tiles, blank) != 0) blank++;
+
+    std::vector<state_ptr> next;
+    const int dr[] = {-1, 1, 0, 0}, dc[] = {0, 0, -1, 1};
+    for (int d = 0; d < 4; d++) {
+      int r = blank / 3 + dr[d], c = blank % 3 + dc[d];
+      if (r < 0 || r > 2 || c < 0 || c > 2) continue;
+      int swap = r * 3 + c;
+      next.push_back(std::make_shared<puzzle_state>(self, with(with(tiles, swap, 0), blank, at(tiles, swap))));
+    }
+    return next;
+  }
+
+  static uint64_t scramble(int moves, unsigned seed) {
+    std::mt19937 rng(seed);
+    uint64_t t = GOAL;
+    for (int i = 0; i < moves; i++) {
+      auto next = neighbours(t, nullptr);
+      t = static_cast<const puzzle_state &>(*next[rng() % next.size()]).tiles;
+    }
+    return t;
+  }
+
+  static uint64_t manhattan(const state &s) {
+    uint64_t t = static_cast<const puzzle_state &>(s).tiles, h = 0;
+    for (int i = 0; i < 9; i++) {
+      int v = at(t, i);
+      if (v == 0) continue;
+      h += std::abs(i / 3 - (v - 1) / 3) + std::abs(i % 3 - (v - 1) % 3);
+    }
+    return h;
+  }
+
+  static constexpr StateCodec codec{
+      sizeof(uint64_t), [](const state &s, uint8_t *out) { memcpy(out, &static_cast<const puzzle_state &>(s).tiles, 8); },
+      [](const uint8_t *in) -> state_ptr {
+        uint64_t t;
+        memcpy(&t, in, sizeof(t));
+        return std::make_shared<puzzle_state>(nullptr, t);
+      }};
+
+  bool goal() const override { return tiles == GOAL; }
+  uint64_t id() const override { return tiles; }
+};
+
+// --- Weighted grid, entering a cell costs 1-9, goal in the opposite corner ---
+class terrain_state : public state {
+  static inline int size = 0;
+  static inline std::vector<uint8_t> cost;
+  int cell;
+
+public:
+  terrain_state(state_ptr previous, int cell) : state(previous, previous ? cost[cell] : 0), cell(cell) {}
+
+  static void generate(int n, unsigned seed) {
+    std::mt19937 rng(seed);
+    size = n;
+    cost.resize(n * n);
+    for (auto &c : cost) c = 1 + rng() % 9;
+  }
+
+  std::vector<state_ptr> next_states() const override {
+    count_expansion();
+
+    std::vector<state_ptr> next;
+    int r = cell / size, c = cell % size;
+    if (r > 0) next.push_back(std::make_shared<terrain_state>(shared_from_this(), cell - size));
+    if (r < size - 1) next.push_back(std::make_shared<terrain_state>(shared_from_this(), cell + size));
+    if (c > 0) next.push_back(std::make_shared<terrain_state>(shared_from_this(), cell - 1));
+    if (c < size - 1) next.push_back(std::make_shared<terrain_state>(shared_from_this(), cell + 1));
+    return next;
+  }
+
+  // Every step costs at least 1
+  static uint64_t manhattan(const state &s) {
+    int cell = static_cast<const terrain_state &>(s).cell;
+    return (size - 1 - cell / size) + (size - 1 - cell % size);
+  }
+
+  bool goal() const override { return cell == size * size - 1; }
+  uint64_t id() const override { return cell; }
+};
+
+// --- Random digraph with fixed out-degree, goal is a node at the requested hop distance ---
+class graph_state : public state {
+  struct Edge {
+    int to;
+    uint8_t cost;
+  };
+  static inline std::vector<std::vector<Edge>> adj;
+  static inline int goal_node = -1;
+  int node;
+
+public:
+  graph_state(state_ptr previous, int node, uint64_t cost) : state(previous, cost), node(node) {}
+
+  static void generate(int nodes, int degree, int hops, bool weighted, unsigned seed) {
+    std::mt19937 rng(seed);
+    adj.assign(nodes, {});
+    for (auto &edges : adj) {
+      for (int k = 0; k < degree; k++) edges.push_back({(int)(rng() % nodes), (uint8_t)(weighted ? 1 + rng() % 9 : 1)});
+    }
+
+    // Hop distances from node 0, the goal is the farthest node within hops
+    std::vector<int> dist(nodes, -1), queue{0};
+    dist[0] = 0;
+    goal_node = 0;
+    for (size_t i = 0; i < queue.size(); i++) {
+      int v = queue[i];
+      if (dist[v] <= hops && dist[v] >= dist[goal_node]) goal_node = v;
+      for (auto e : adj[v]) {
+        if (dist[e.to] == -1) {
+          dist[e.to] = dist[v] + 1;
+          queue.push_back(e.to);
+        }
+      }
+    }
+  }
+
+  std::vector<state_ptr> next_states() const override {
+    count_expansion();
+
+    std::vector<state_ptr> next;
+    for (auto e : adj[node]) next.push_back(std::make_shared<graph_state>(shared_from_this(), e.to, e.cost));
+    return next;
+  }
+
+  static constexpr StateCodec codec{
+      sizeof(int), [](const state &s, uint8_t *out) { memcpy(out, &static_cast<const graph_state &>(s).node, sizeof(int)); },
+      [](const uint8_t *in) -> state_ptr {
+        int n;
+        memcpy(&n, in, sizeof(n));
+        return std::make_shared<graph_state>(nullptr, n, 0);
+      }};
+
+  bool goal() const override { return node == goal_node; }
+  uint64_t id() const override { return node; }
+};
+
+struct Instance {
+  std::string name;
+  state_ptr root;
+  bool uniform;
+  Heuristic heuristic;
+  const StateCodec *codec;
+};
+
+static void run(const Instance &inst, const char *strategy, const std::function<state_ptr()> &search_fn) {
+  expansions.assign(omp_get_max_threads(), ExpansionCount{});
+#ifdef SEARCH_STATS
+  search_stats.reset();
+#endif
+
+  auto start = std::chrono::steady_clock::now();
+  state_ptr goal = search_fn();
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  int threads = omp_get_max_threads();
+
+  std::string generated, dup_rate, utilization;
+#ifdef SEARCH_STATS
+  ThreadStats total = search_stats.total();
+  double busy_ms = std::chrono::duration<double, std::milli>(total.busy).count();
+  generated = std::to_string(total.generated);
+  dup_rate = std::to_string(total.generated ? (double)total.duplicates / total.generated : 0.0);
+  utilization = std::to_string(ms > 0 ? busy_ms / (ms * threads) : 0.0);
+
+  for (size_t i = 0; i < search_stats.layers.size(); i++) {
+    const auto &l = search_stats.layers[i];
+    printf("layer,%s,%s,%d,%zu,%.3f,%llu,%llu,,,,,\n", strategy, inst.name.c_str(), threads, i, l.time_ms,
+           (unsigned long long)l.expanded, (unsigned long long)l.generated);
+  }
+#endif
+
+  printf("run,%s,%s,%d,,%.3f,%llu,%s,%s,%s,%ld,%lld,%lld\n", strategy, inst.name.c_str(), threads, ms,
+         (unsigned long long)total_expansions(), generated.c_str(), dup_rate.c_str(), utilization.c_str(), usage.ru_maxrss,
+         goal ? (long long)goal->total_cost() : -1LL, goal ? (long long)goal->id() : -1LL);
+}
+
+// Child process per run keeps peak memory of the runs apart
+static void run_isolated(const Instance &inst, const char *strategy, const std::function<state_ptr()> &search_fn) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    run(inst, strategy, search_fn);
+    fflush(stdout);
+    _exit(0);
+  }
+  if (pid > 0) waitpid(pid, nullptr, 0);
+  else run(inst, strategy, search_fn);
+}
+
+static void bench(const Instance &inst, int repeats, const std::string &tmp_dir) {
+  for (int r = 0; r < repeats; r++) {
+    if (inst.uniform) {
+      run_isolated(inst, "bfs", [&] { return search(inst.root, Strategy::BFS); });
+      run_isolated(inst, "bfs_compact", [&] { return bfs_compact(inst.root, *inst.codec); });
+      run_isolated(inst, "bfs_external", [&] { return bfs_external(inst.root, *inst.codec, tmp_dir, 64 << 20); });
+    }
+    run_isolated(inst, "iddfs", [&] { return search(inst.root, Strategy::IDDFS); });
+    if (inst.heuristic) {
+      run_isolated(inst, "ida_star", [&] { return search(inst.root, Strategy::IDA_STAR, inst.heuristic); });
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int moves = argc > 1 ? atoi(argv[1]) : 20;
+  int grid = argc > 2 ? atoi(argv[2]) : 6;
+  int nodes = argc > 3 ? atoi(argv[3]) : 100000;
+  int repeats = argc > 4 ? atoi(argv[4]) : 1;
+  std::string tmp_dir = argc > 5 ? argv[5] : "search_bench_tmp";
+
+  printf("kind,strategy,instance,threads,index,time_ms,expanded,generated,duplicate_rate,utilization,peak_rss_kb,cost,"
+         "goal_id\n");
+
+  bench({"puzzle" + std::to_string(moves), std::make_shared<puzzle_state>(nullptr, puzzle_state::scramble(moves, 42)),
+         true, puzzle_state::manhattan, &puzzle_state::codec},
+        repeats, tmp_dir);
+
+  terrain_state::generate(grid, 42);
+  bench({"terrain" + std::to_string(grid), std::make_shared<terrain_state>(nullptr, 0), false, terrain_state::manhattan,
+         nullptr},
+        repeats, tmp_dir);
+
+  for (bool weighted : {false, true}) {
+    graph_state::generate(nodes, 3, 10, weighted, 42);
+    bench({(weighted ? "wgraph" : "graph") + std::to_string(nodes), std::make_shared<graph_state>(nullptr, 0, 0),
+           !weighted, nullptr, &graph_state::codec},
+          repeats, tmp_dir);
+  }
+
+  return 0;
+}
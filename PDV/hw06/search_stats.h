@@ -0,0 +1,84 @@
+#pragma once
+
+/*
+ * Counters and per-layer (per-iteration) timing for search_bench,
+ * every hook compiles to nothing unless SEARCH_STATS is defined
+ */
+#ifdef SEARCH_STATS
+
+#include <chrono>
+#include <cstdint>
+#include <omp.h>
+#include <vector>
+
+using stats_clock = std::chrono::steady_clock;
+
+struct alignas(64) ThreadStats {
+  uint64_t expanded = 0;
+  uint64_t generated = 0;
+  uint64_t duplicates = 0; // Generated states that don't enter the next layer, being in it or an earlier one already
+  stats_clock::duration busy{0};
+};
+
+struct LayerStats {
+  double time_ms;
+  uint64_t expanded;
+  uint64_t generated;
+};
+
+struct SearchStats {
+  std::vector<ThreadStats> threads;
+  std::vector<LayerStats> layers;
+  stats_clock::time_point layer_start;
+  ThreadStats layer_base;
+
+  SearchStats() : threads(omp_get_max_threads()) {}
+
+  void reset() {
+    threads.assign(omp_get_max_threads(), ThreadStats{});
+    layers.clear();
+  }
+
+  ThreadStats &local() { return threads[omp_get_thread_num()]; }
+
+  ThreadStats total() const {
+    ThreadStats sum;
+    for (const auto &t : threads) {
+      sum.expanded += t.expanded;
+      sum.generated += t.generated;
+      sum.duplicates += t.duplicates;
+      sum.busy += t.busy;
+    }
+    return sum;
+  }
+
+  // Called outside of parallel regions only
+  void begin_layer() {
+    layer_start = stats_clock::now();
+    layer_base = total();
+  }
+
+  void end_layer() {
+    ThreadStats now = total();
+    double ms = std::chrono::duration<double, std::milli>(stats_clock::now() - layer_start).count();
+    layers.push_back({ms, now.expanded - layer_base.expanded, now.generated - layer_base.generated});
+  }
+};
+
+inline SearchStats search_stats;
+
+#define STATS_ADD(field, n) (search_stats.local().field += (n))
+#define STATS_LAYER_BEGIN() search_stats.begin_layer()
+#define STATS_LAYER_END() search_stats.end_layer()
+#define STATS_BUSY_BEGIN(var) auto var = stats_clock::now()
+#define STATS_BUSY_END(var) (search_stats.local().busy += stats_clock::now() - var)
+
+#else
+
+#define STATS_ADD(field, n) ((void)0)
+#define STATS_LAYER_BEGIN() ((void)0)
+#define STATS_LAYER_END() ((void)0)
+#define STATS_BUSY_BEGIN(var) ((void)0)
+#define STATS_BUSY_END(var) ((void)0)
+
+#endif
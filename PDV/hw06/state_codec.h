@@ -0,0 +1,32 @@
+#pragma once
+
+#include "state.h"
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// Fixed-size serialization of a state, its predecessor chain is not part of the encoding
+struct StateCodec {
+  size_t size; // Bytes per encoded state
+  void (*encode)(const state &s, uint8_t *out);
+  state_ptr (*decode)(const uint8_t *in);
+};
+
+/*
+ * Rebuilds the goal with its real predecessor chain by following ids (root excluded) from the root
+ */
+inline state_ptr replay_path(state_ptr root, const std::vector<uint64_t> &path) {
+  state_ptr current = root;
+  for (uint64_t id : path) {
+    state_ptr next = nullptr;
+    for (const auto &neigh : current->next_states()) {
+      if (neigh->id() == id) {
+        next = neigh;
+        break;
+      }
+    }
+    if (!next) throw std::runtime_error("replay_path: state is not reachable from its parent");
+    current = next;
+  }
+  return current;
+}
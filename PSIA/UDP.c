@@ -1,27 +1,39 @@
-#define WIN32_LEAN_AND_MEAN
-
 #include "UDP.h"
+#include "crc32.h"
 #include "md5.h"
+#include "platform.h"
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
-
-uint32_t crc32_table[256];
 
 int main(int argc, char *argv[]) {
-  if (argc < 5) {
-    printf("Usage: %s <mode> <local_port> <target_port> <target_ip> [filename]\n", argv[0]);
+  // Options may come anywhere, everything else is positional
+  Options options = {WINDOW_DEFAULT_LEN, false, 0, 0, 0, 1, 0, true, PROGRESS_DEFAULT_MS, NULL, true, 0, false};
+  char **args = argv + 1; // Positional arguments are moved to the front
+  int arg_count = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--", 2) == 0) {
+      if (i + 1 >= argc || parseOption(argv[i], argv[i + 1], &options) != 0) {
+        printf("Error: Invalid option %s\n", argv[i]);
+        return ERR_INVALID_ARG;
+      }
+      i++;
+    } else {
+      args[arg_count++] = argv[i];
+    }
+  }
+
+  if (arg_count < 4) {
+    printf("Usage: %s <mode> <local_port> <target_port> <target_ip> [path...] [--window <packets>] [--md5 stream|upfront] [--integrity md5|tree] [--fec <k>] [--mtu <bytes>] [--streams <n>] [--compress <threads>] [--engine uring|poll] [--pacing on|off] [--rate <Mbit/s>] [--progress <seconds>] [--stats <path>|unix:<path>] [--drop <rate>]\n", argv[0]);
     return ERR_INVALID_ARG;
   }
-  int mode = atoi(argv[1]);
-  int local_port = atoi(argv[2]);
-  int target_port = atoi(argv[3]);
-  char *target_ip = argv[4];
+  int mode = atoi(args[0]);
+  int local_port = atoi(args[1]);
+  int target_port = atoi(args[2]);
+  char *target_ip = args[3];
   // Validate mode
   if (mode != MODE_SENDER && mode != MODE_RECEIVER) return ERR_INVALID_ARG;
   // Validate ports
@@ -30,61 +42,68 @@ int main(int argc, char *argv[]) {
     return ERR_INVALID_ARG;
   }
 
-  int init_crc_r = initCRC32Table();
-  if (init_crc_r != 0) return init_crc_r;
+  crc32Init();
+  fecInit();
 
-  int init_ws_r = InitWinsock();
-  if (init_ws_r != 0) return init_ws_r;
+  if (netInit() != 0) return ERR_SOCKET_INIT;
 
-  SOCKET socket_handle = socket(AF_INET, SOCK_DGRAM, 0);
-  if (socket_handle == INVALID_SOCKET) return ERR_SOCKET_CREATE;
+  socket_t socket_handle = socket(AF_INET, SOCK_DGRAM, 0);
+  if (socket_handle == SOCKET_INVALID) return ERR_SOCKET_CREATE;
 
   struct sockaddr_in local;
   local.sin_family = AF_INET;
   local.sin_addr.s_addr = INADDR_ANY;
   local.sin_port = htons(local_port);
   if (bind(socket_handle, (struct sockaddr *)&local, sizeof(local)) != 0) {
-    closesocket(socket_handle);
-    WSACleanup();
+    socketClose(socket_handle);
+    netCleanup();
     return ERR_SOCKET_BIND;
   }
-
-  FileBuffer buffer = {NULL, "", {0}, 0, 0};
-  int fbAlloc_r = allocateFileBuffer(&buffer);
-  if (fbAlloc_r != 0) {
-    closesocket(socket_handle);
-    WSACleanup();
-    return fbAlloc_r;
+  socketSetBufferSize(socket_handle, SOCKET_BUFFER_SIZE); // Room for a large window, best effort
+
+  FileBuffer buffer = {0};
+  Connection conn = {socket_handle, {0}, CHECKSUM_CRC32, options.window, options.md5_upfront, options.fec_k, options.drop_rate,
+                     options.mtu > 0 ? options.mtu - UDP_IP_OVERHEAD : 0, true, options.streams, options.compress, options.uring, NULL,
+                     NULL, 0, options.pacing, options.max_rate, options.tree, false};
+
+  // Telemetry runs alongside either side, a progress line every interval and JSON lines when asked for
+  Stats stats;
+  if (statsOpen(&stats, mode == MODE_SENDER ? "sender" : "receiver", options.progress_ms, options.stats_path) != 0) {
+    printf("Error: Cannot open %s\n", options.stats_path);
+    socketClose(socket_handle);
+    netCleanup();
+    return ERR_INVALID_ARG;
   }
+  conn.stats = &stats;
 
   if (mode == MODE_SENDER) {
-    struct sockaddr_in target;
-    target.sin_family = AF_INET;
-    target.sin_port = htons(target_port);
-    if (InetPton(AF_INET, target_ip, &target.sin_addr.s_addr) != 1) {
-      closesocket(socket_handle);
-      WSACleanup();
+    if (netParseAddress(target_ip, target_port, &conn.peer) != 0) {
+      socketClose(socket_handle);
+      netCleanup();
       return ERR_INVALID_ARG;
     }
 
-    if (argc < 6) return ERR_INVALID_ARG;
-    char *filename = argv[5];
+    if (arg_count < 5) return ERR_INVALID_ARG;
+    // One regular file goes as before, directories and several paths as one session
+    char **paths = args + 4;
+    int path_count = arg_count - 4;
 
-    int fLoad_r = loadFile(filename, &buffer);
-    if (fLoad_r != 0) {
-      free(buffer.data);
-      return fLoad_r;
-    }
+    int fLoad_r = (path_count == 1 && pathType(paths[0]) == PATH_FILE) ? loadFile(paths[0], &buffer)
+                                                                        : loadArchive(paths, path_count, &buffer);
+    if (fLoad_r != 0) return fLoad_r;
 
-    int send_r = sendFile(socket_handle, &buffer, &target);
+    int send_r = sendFile(&conn, &buffer);
+    statsClose(&stats);
+    if (buffer.archive) archiveClose(&buffer.session);
+    else fileUnmap(&buffer.map, false);
+    if (send_r == ERR_FILE_READ) printf("Error: A file of the session went away or changed size while it was sent\n");
     if (send_r != 0) return send_r;
   }
   if (mode == MODE_RECEIVER) {
-    struct sockaddr_in from;
-
-    int receive_r = receiveFile(socket_handle, &from, &buffer);
+    int receive_r = receiveFile(&conn, &buffer);
+    statsClose(&stats);
     if (receive_r != 0) {
-      free(buffer.data);
+      discardOutputFile(&buffer);
       return receive_r;
     }
 
@@ -92,351 +111,2055 @@ int main(int argc, char *argv[]) {
     if (save_r != 0) return save_r;
   }
 
-  if (buffer.data != NULL) free(buffer.data);
-  if (socket_handle != INVALID_SOCKET) closesocket(socket_handle);
-  WSACleanup();
+  if (socket_handle != SOCKET_INVALID) socketClose(socket_handle);
+  netCleanup();
 
   return 0;
 }
 
-int InitWinsock() {
-  WSADATA wsaData;
-  if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) return ERR_SOCKET_INIT;
+int parseOption(const char *name, const char *value, Options *options) {
+  if (name == NULL || value == NULL || options == NULL) return ERR_INVALID_ARG;
+
+  if (strcmp(name, "--window") == 0) {
+    long window = atol(value);
+    if (window < 1 || window > WINDOW_MAX_LEN) return ERR_INVALID_ARG;
+    options->window = (size_t)window;
+  } else if (strcmp(name, "--md5") == 0) {
+    if (strcmp(value, "upfront") == 0) options->md5_upfront = true;
+    else if (strcmp(value, "stream") == 0) options->md5_upfront = false;
+    else return ERR_INVALID_ARG;
+  } else if (strcmp(name, "--integrity") == 0) {
+    if (strcmp(value, "tree") == 0) options->tree = true;
+    else if (strcmp(value, "md5") == 0) options->tree = false;
+    else return ERR_INVALID_ARG;
+  } else if (strcmp(name, "--fec") == 0) {
+    long k = atol(value);
+    if (k < 2 || k > FEC_MAX_DATA) return ERR_INVALID_ARG;
+    options->fec_k = (size_t)k;
+  } else if (strcmp(name, "--drop") == 0) {
+    double rate = atof(value);
+    if (rate < 0 || rate >= 1) return ERR_INVALID_ARG;
+    options->drop_rate = rate;
+  } else if (strcmp(name, "--mtu") == 0) {
+    long mtu = atol(value);
+    if (mtu < MTU_MIN || mtu > MTU_MAX) return ERR_INVALID_ARG;
+    options->mtu = (size_t)mtu;
+  } else if (strcmp(name, "--streams") == 0) {
+    long streams = atol(value);
+    if (streams < 1 || streams > STREAM_MAX) return ERR_INVALID_ARG;
+    options->streams = (size_t)streams;
+  } else if (strcmp(name, "--compress") == 0) {
+    long threads = atol(value);
+    if (threads < 0 || threads > COMPRESS_THREADS_MAX) return ERR_INVALID_ARG;
+    options->compress = (size_t)threads;
+  } else if (strcmp(name, "--engine") == 0) {
+    if (strcmp(value, "uring") == 0) options->uring = true;
+    else if (strcmp(value, "poll") == 0) options->uring = false;
+    else return ERR_INVALID_ARG;
+  } else if (strcmp(name, "--pacing") == 0) {
+    if (strcmp(value, "on") == 0) options->pacing = true;
+    else if (strcmp(value, "off") == 0) options->pacing = false;
+    else return ERR_INVALID_ARG;
+  } else if (strcmp(name, "--rate") == 0) {
+    double mbit = atof(value);
+    if (mbit < 0 || mbit > RATE_MAX_MBIT) return ERR_INVALID_ARG;
+    options->max_rate = mbit * 1e6 / 8;
+  } else if (strcmp(name, "--progress") == 0) {
+    double seconds = atof(value);
+    if (seconds < 0 || seconds > 3600) return ERR_INVALID_ARG;
+    options->progress_ms = (uint32_t)(seconds * 1000);
+  } else if (strcmp(name, "--stats") == 0) {
+    options->stats_path = value;
+  } else {
+    return ERR_INVALID_ARG;
+  }
+
   return 0;
 }
 
-int initCRC32Table() {
-  if (crc32_table == NULL) return ERR_INVALID_ARG;
+int packetChecksum(const PacketHeader *packet, const char *payload, uint32_t *result) {
+  if (packet == NULL || result == NULL) return ERR_INVALID_ARG;
 
-  for (uint32_t i = 0; i < 256; i++) {
-    uint32_t crc = i;
-    for (int j = 0; j < 8; j++) {
-      crc = (crc & 1) ? ((crc >> 1) ^ CRC32_POLYNOMIAL) : (crc >> 1);
-    }
-    crc32_table[i] = crc;
-  }
+  size_t length = ntohs(packet->length);
+  if (length > PACKET_DATA_LEN) return ERR_INVALID_ARG;
+
+  // Fields before crc32 and the valid part of data only, padding is never checksummed
+  ChecksumMode mode = (packet->flags & PACKET_FLAG_CRC32C) ? CHECKSUM_CRC32C : CHECKSUM_CRC32;
+  uint32_t crc = crc32Update(mode, CRC32_INITIAL, (const uint8_t *)packet, offsetof(PacketHeader, crc32));
+  crc = crc32Update(mode, crc, (const uint8_t *)payload, length);
+  *result = ~crc;
 
   return 0;
 }
 
-int computeCRC32(const uint8_t *data, size_t length, uint32_t *result) {
-  if (data == NULL || result == NULL) return ERR_INVALID_ARG;
+bool verifyPacket(const Packet *packet, size_t received) {
+  if (received < offsetof(Packet, data)) return false;
+  if (offsetof(Packet, data) + ntohs(packet->length) > received) return false;
 
-  uint32_t crc = CRC32_INITIAL;
-  for (size_t i = 0; i < length; ++i) {
-    uint8_t index = (uint8_t)((crc ^ data[i]) & 0xFF);
-    crc = (crc >> 8) ^ crc32_table[index];
-  }
-  *result = ~crc;
+  uint32_t calculated_crc;
+  if (packetChecksum(&packet->head, packet->data, &calculated_crc) != 0) return false;
+  return ntohl(packet->crc32) == calculated_crc;
+}
+
+int loadFile(const char *filename, FileBuffer *buffer) {
+  if (filename == NULL || buffer == NULL) return ERR_INVALID_ARG;
+
+  strncpy(buffer->filename, filename, sizeof(buffer->filename) - 1);
+  buffer->filename[sizeof(buffer->filename) - 1] = '\0';
+
+  // Packets are sent straight from the mapping, nothing is copied into memory up front
+  if (fileMapRead(filename, &buffer->map) != 0) return ERR_FILE_NOT_FOUND;
+  buffer->data = buffer->map.data;
+  buffer->length = buffer->map.size;
+  buffer->size = buffer->map.size;
 
   return 0;
 }
 
-int allocateFileBuffer(FileBuffer *buffer) {
-  if (buffer == NULL) return ERR_INVALID_ARG;
+void outputFilename(const FileBuffer *buffer, char *output_filename, size_t size) {
+  // Safely copy filename and append ".out", a session is staged in "<name>.out.archive" until extracted
+  const char *suffix = buffer->archive ? ".out.archive" : ".out";
+  size_t filename_len = strlen(buffer->filename);
+  if (filename_len > size - 13) filename_len = size - 13; // Space for ".out.archive"
+  memcpy(output_filename, buffer->filename, filename_len);
+  strcpy(output_filename + filename_len, suffix);
+}
 
-  buffer->data = (char *)malloc(16 * sizeof(char));
-  if (buffer->data == NULL) return ERR_MEM_ALLOC;
+int loadArchive(char *const *paths, size_t count, FileBuffer *buffer) {
+  if (paths == NULL || buffer == NULL) return ERR_INVALID_ARG;
 
-  buffer->size = 16;
-  buffer->length = 0;
+  // Only the manifest is held, the transfer reads the contents out of each file as it reaches them
+  archiveName(paths, count, buffer->filename, sizeof(buffer->filename));
+  if (archiveOpen(paths, count, &buffer->session) != 0) return ERR_FILE_NOT_FOUND;
+  buffer->data = NULL;
+  buffer->length = (size_t)buffer->session.size;
+  buffer->size = buffer->length;
+  buffer->archive = true;
 
   return 0;
 }
 
-int reallocateFileBuffer(FileBuffer *buffer, int size) {
-  if (buffer == NULL || buffer->data == NULL) return ERR_INVALID_ARG;
+const char *fileBufferRead(const FileBuffer *buffer, ArchiveReader *reader, uint64_t offset, size_t length, char *out) {
+  if (buffer->session.manifest == NULL) return buffer->data + offset;
+  return archiveRead(reader, offset, length, out) == 0 ? out : NULL;
+}
+
+void journalFilename(const FileBuffer *buffer, char *journal_filename, size_t size) {
+  // Next to the output file, "<name>.out.journal"
+  outputFilename(buffer, journal_filename, size - 8);
+  strcat(journal_filename, ".journal");
+}
 
-  size_t new_size = size == -1 ? buffer->size * 2 : (size_t)size;
-  char *new_data = (char *)realloc(buffer->data, new_size * sizeof(char));
-  if (new_data == NULL) return ERR_MEM_ALLOC;
+int createOutputFile(FileBuffer *buffer, size_t size, bool keep) {
+  if (buffer == NULL) return ERR_INVALID_ARG;
 
-  buffer->data = new_data;
-  buffer->size = new_size;
+  // Payloads are written straight into the mapped output file, a resumed one keeps what it holds
+  char output_filename[1024];
+  outputFilename(buffer, output_filename, sizeof(output_filename));
+  if (fileMapCreate(output_filename, size, keep, &buffer->map) != 0) return ERR_FILE_WRITE;
+  buffer->data = buffer->map.data;
+  buffer->length = 0;
+  buffer->size = size;
 
   return 0;
 }
 
-int loadFile(const char *filename, FileBuffer *buffer) {
-  if (filename == NULL || buffer == NULL) return ERR_INVALID_ARG;
+void discardOutputFile(FileBuffer *buffer) {
+  if (buffer == NULL) return;
 
-  strncpy(buffer->filename, filename, sizeof(buffer->filename) - 1);
-  buffer->filename[sizeof(buffer->filename) - 1] = '\0';
+  bool created = buffer->map.size > 0 || buffer->data != NULL;
+  fileUnmap(&buffer->map, false);
+  buffer->data = NULL;
+  if (!created) return;
 
-  FILE *file = fopen(filename, "rb");
-  if (file == NULL) return ERR_FILE_NOT_FOUND;
+  char output_filename[1024];
+  outputFilename(buffer, output_filename, sizeof(output_filename));
+  remove(output_filename);
+}
 
-  // Init MD5
-  MD5Context md5_context;
-  md5Init(&md5_context);
+int keepPartialFile(FileBuffer *buffer, const Journal *journal) {
+  if (buffer == NULL || journal == NULL) return ERR_INVALID_ARG;
+  if (journalEnd(journal) == 0) return ERR_INVALID_ARG; // Nothing worth resuming
 
-  int result = 0;
-  while (true) {
-    if (buffer->length + FILE_READ_CHUNK_SIZE > buffer->size) {
-      int fbAlloc_r = reallocateFileBuffer(buffer, buffer->size + FILE_READ_CHUNK_SIZE);
-      if (fbAlloc_r != 0) {
-        result = fbAlloc_r;
+  // Data reaches the disk before the journal that vouches for it, discardOutputFile leaves the file alone after
+  int unmap_r = fileUnmap(&buffer->map, true);
+  buffer->data = NULL;
+  if (unmap_r != 0) return ERR_FILE_WRITE;
+
+  char journal_filename[1024];
+  journalFilename(buffer, journal_filename, sizeof(journal_filename));
+  return journalSave(journal_filename, journal) == 0 ? 0 : ERR_FILE_WRITE;
+}
+
+int saveFile(FileBuffer *buffer) {
+  if (buffer == NULL) return ERR_INVALID_ARG;
+
+  // Data is already in place, only flush the mapping
+  if (!buffer->archive) {
+    int unmap_r = fileUnmap(&buffer->map, true);
+    buffer->data = NULL;
+    return (unmap_r == 0) ? 0 : ERR_FILE_WRITE;
+  }
+
+  // Session is unpacked into "<name>.out", the staged archive only goes once that worked
+  char output_filename[1024];
+  outputFilename(buffer, output_filename, sizeof(output_filename));
+  char directory[1024];
+  strcpy(directory, output_filename);
+  directory[strlen(directory) - strlen(".archive")] = '\0';
+
+  int extract_r = archiveExtract(&buffer->map, directory);
+  int unmap_r = fileUnmap(&buffer->map, true);
+  buffer->data = NULL;
+  if (extract_r != 0 || unmap_r != 0) return ERR_FILE_WRITE;
+  remove(output_filename);
+
+  return 0;
+}
+
+static bool hashCancelled(HashStream *stream) { return __atomic_load_n(&stream->cancelled, __ATOMIC_RELAXED); }
+
+void hashStreamThread(void *arg) {
+  HashStream *stream = (HashStream *)arg;
+
+  // A session is read a chunk at a time, a file is hashed where it is mapped
+  ArchiveReader reader;
+  archiveReaderInit(&reader, &stream->buffer->session);
+  char *staged = stream->buffer->session.manifest != NULL ? (char *)malloc(TREE_CHUNK_SIZE) : NULL;
+  bool readable = stream->buffer->session.manifest == NULL || staged != NULL;
+
+  size_t hashed = 0;
+  while (hashed < stream->size && stream->tree != NULL && readable && !hashCancelled(stream)) {
+    // Leaves only once their chunk is whole, the last one may be short
+    size_t next = min(hashed + TREE_CHUNK_SIZE, stream->size);
+    size_t ready = progressWait(&stream->ready, next - 1);
+    if (ready < next) break; // Closed before the end
+    size_t end = ready == stream->size ? stream->tree->leaf_count : ready / TREE_CHUNK_SIZE;
+    for (size_t chunk = hashed / TREE_CHUNK_SIZE; chunk < end && readable && !hashCancelled(stream); chunk++) {
+      size_t length = min(TREE_CHUNK_SIZE, stream->size - chunk * TREE_CHUNK_SIZE);
+      const char *data = fileBufferRead(stream->buffer, &reader, (uint64_t)chunk * TREE_CHUNK_SIZE, length, staged);
+      if (data != NULL) treeHashLeaf(stream->tree, chunk, data);
+      else readable = false;
+      hashed = chunk * TREE_CHUNK_SIZE + length;
+    }
+  }
+  while (hashed < stream->size && stream->tree == NULL && readable && !hashCancelled(stream)) {
+    size_t ready = progressWait(&stream->ready, hashed);
+    if (ready <= hashed) break; // Closed before the end
+    while (hashed < ready && !hashCancelled(stream)) {
+      size_t length = min(TREE_CHUNK_SIZE, ready - hashed);
+      const char *data = fileBufferRead(stream->buffer, &reader, hashed, length, staged);
+      if (data == NULL) {
+        readable = false;
         break;
       }
+      md5Update(&stream->context, (uint8_t *)data, length);
+      hashed += length;
     }
+  }
+  archiveReaderClose(&reader);
+  free(staged);
 
-    size_t bytes_read = fread(buffer->data + buffer->length, 1, min(FILE_READ_CHUNK_SIZE, buffer->size - buffer->length), file);
-    if (bytes_read == 0) {
-      if (feof(file)) {
-        break; // Expected EOF
-      } else {
-        result = ERR_FILE_READ;
-        break;
-      }
+  stream->complete = readable && hashed == stream->size;
+  if (stream->complete && stream->tree == NULL) md5Finalize(&stream->context);
+}
+
+int hashStreamStart(HashStream *stream, const FileBuffer *buffer, size_t size, size_t ready, Tree *tree) {
+  if (stream == NULL || buffer == NULL) return ERR_INVALID_ARG;
+
+  stream->buffer = buffer;
+  stream->size = size;
+  stream->tree = tree;
+  stream->complete = false;
+  stream->cancelled = false;
+  md5Init(&stream->context);
+  progressInit(&stream->ready);
+  progressSet(&stream->ready, ready);
+
+  if (threadCreate(&stream->thread, hashStreamThread, stream) != 0) {
+    progressDestroy(&stream->ready);
+    return ERR_MEM_ALLOC;
+  }
+  return 0;
+}
+
+void hashStreamAdvance(HashStream *stream, size_t ready) { progressSet(&stream->ready, ready); }
+
+int hashStreamFinish(HashStream *stream, uint8_t *digest) {
+  if (stream == NULL) return ERR_INVALID_ARG;
+
+  // Anything not ready by now never will be
+  progressClose(&stream->ready);
+  threadJoin(stream->thread);
+  progressDestroy(&stream->ready);
+
+  if (!stream->complete) return ERR_PACKET_MD5;
+  if (digest != NULL && stream->tree != NULL) {
+    // Root fills the front of an MD5-sized digest, so both travel in STOP alike
+    memset(digest, 0, MD5_LEN);
+    treeDigest(stream->tree, digest);
+  } else if (digest != NULL) {
+    memcpy(digest, stream->context.digest, MD5_LEN);
+  }
+  return 0;
+}
+
+void hashStreamCancel(HashStream *stream) {
+  // Whole file is ready on the sender, only the flag stops the thread short of hashing all of it
+  __atomic_store_n(&stream->cancelled, true, __ATOMIC_RELAXED);
+  progressClose(&stream->ready);
+  threadJoin(stream->thread);
+  progressDestroy(&stream->ready);
+}
+
+void compressThread(void *arg) {
+  CompressWorker *worker = (CompressWorker *)arg;
+  Compressor *compressor = worker->compressor;
+  const FileBuffer *buffer = compressor->buffer;
+
+  size_t count = compressor->end_seq - compressor->first_seq;
+  size_t sent = 0;
+  ArchiveReader reader;
+  archiveReaderInit(&reader, &buffer->session);
+  char *staged = buffer->session.manifest != NULL ? (char *)malloc(compressor->data_len) : NULL;
+  bool readable = buffer->session.manifest == NULL || staged != NULL; // Otherwise every packet goes raw
+  bool stopped = false;
+  for (size_t first = worker->index * COMPRESS_GROUP; first < count; first += compressor->thread_count * COMPRESS_GROUP) {
+    size_t end = min(first + COMPRESS_GROUP, count);
+    // Ring slots are reused once the sender is done with the packets a lap behind
+    while (end > sent + COMPRESS_AHEAD && !stopped) {
+      size_t now = progressWait(&compressor->sent, sent);
+      stopped = now <= sent; // Compressor is stopped
+      sent = now;
+    }
+    if (stopped) break;
+
+    // Only a block smaller than the raw payload is kept
+    for (size_t i = first; i < end; i++) {
+      size_t seq = compressor->first_seq + i;
+      size_t length = dataLength(buffer->length, compressor->data_len, seq);
+      size_t slot = i % COMPRESS_AHEAD;
+      uint8_t *out = (uint8_t *)compressor->ring + slot * compressor->data_len;
+      const char *raw = readable ? fileBufferRead(buffer, &reader, (uint64_t)seq * compressor->data_len, length, staged) : NULL;
+      compressor->lengths[slot] = raw != NULL ? (uint16_t)lzCompress((const uint8_t *)raw, length, out, length > 0 ? length - 1 : 0) : 0;
     }
-    md5Update(&md5_context, (unsigned char *)(buffer->data + buffer->length), bytes_read);
-    buffer->length += bytes_read;
+    progressSet(&worker->done, end);
   }
+  archiveReaderClose(&reader);
+  free(staged);
+}
 
-  fclose(file);
+int compressorStart(Compressor *compressor, const FileBuffer *buffer, size_t data_len, size_t first_seq, size_t end_seq, size_t threads) {
+  if (compressor == NULL || buffer == NULL || threads == 0 || threads > COMPRESS_THREADS_MAX) return ERR_INVALID_ARG;
+
+  compressor->buffer = buffer;
+  compressor->data_len = data_len;
+  compressor->first_seq = first_seq;
+  compressor->end_seq = end_seq;
+  compressor->thread_count = 0;
+  compressor->ring = (char *)malloc(COMPRESS_AHEAD * data_len);
+  compressor->lengths = (uint16_t *)calloc(COMPRESS_AHEAD, sizeof(uint16_t));
+  if (compressor->ring == NULL || compressor->lengths == NULL) {
+    free(compressor->ring);
+    free(compressor->lengths);
+    return ERR_MEM_ALLOC;
+  }
+  progressInit(&compressor->sent);
+
+  // Fewer threads than asked for still compress everything, each one covers its own groups
+  for (size_t i = 0; i < threads; i++) {
+    CompressWorker *worker = &compressor->workers[i];
+    worker->compressor = compressor;
+    worker->index = i;
+    progressInit(&worker->done);
+    compressor->thread_count = i + 1;
+    if (threadCreate(&worker->thread, compressThread, worker) != 0) {
+      progressDestroy(&worker->done);
+      compressor->thread_count = i;
+      break;
+    }
+  }
+  if (compressor->thread_count == 0) {
+    compressorStop(compressor);
+    return ERR_MEM_ALLOC;
+  }
+  return 0;
+}
 
-  if (result == 0) {
-    md5Finalize(&md5_context);
-    memcpy(buffer->md5, md5_context.digest, MD5_LEN);
+const char *compressorTake(Compressor *compressor, size_t seq, size_t *length) {
+  size_t i = seq - compressor->first_seq;
+  CompressWorker *worker = &compressor->workers[(i / COMPRESS_GROUP) % compressor->thread_count];
+  size_t done = progressGet(&worker->done);
+  while (done <= i) {
+    size_t now = progressWait(&worker->done, done);
+    if (now <= done) return NULL;
+    done = now;
   }
 
-  return result;
+  size_t slot = i % COMPRESS_AHEAD;
+  if (compressor->lengths[slot] == 0) return NULL;
+  *length = compressor->lengths[slot];
+  return compressor->ring + slot * compressor->data_len;
 }
 
-int saveFile(FileBuffer *buffer) {
-  if (buffer == NULL || buffer->data == NULL) return ERR_INVALID_ARG;
+void compressorRelease(Compressor *compressor, size_t next_seq) { progressSet(&compressor->sent, next_seq - compressor->first_seq); }
 
-  // Safely copy filename and append ".out"
-  char output_filename[1024] = {0};
-  size_t filename_len = strlen(buffer->filename);
-  if (filename_len > sizeof(output_filename) - 5) filename_len = sizeof(output_filename) - 5; // Space for ".out"
-  strncpy(output_filename, buffer->filename, filename_len);
-  output_filename[filename_len] = '\0';
-  strncat(output_filename, ".out", sizeof(output_filename) - filename_len - 1);
+void compressorStop(Compressor *compressor) {
+  // Workers waiting for ring slots give up
+  progressClose(&compressor->sent);
+  for (size_t i = 0; i < compressor->thread_count; i++) {
+    threadJoin(compressor->workers[i].thread);
+    progressDestroy(&compressor->workers[i].done);
+  }
+  progressDestroy(&compressor->sent);
+  free(compressor->ring);
+  free(compressor->lengths);
+  compressor->ring = NULL;
+  compressor->lengths = NULL;
+}
 
-  FILE *file = fopen(output_filename, "wb");
-  if (file == NULL) return ERR_FILE_NOT_FOUND;
+int connSendBatch(Connection *conn, NetMsg *msgs, size_t count) {
+  // Injected loss, the dropped datagrams are simply left out
+  size_t kept = count;
+  if (conn->drop_rate > 0) {
+    kept = 0;
+    for (size_t i = 0; i < count; i++) {
+      if ((double)rand() / RAND_MAX >= conn->drop_rate) msgs[kept++] = msgs[i];
+    }
+  }
+  if (kept == 0) return 0;
+
+  // Segmentation offload is dropped for good the first time the kernel refuses it
+  if (conn->gso && conn->packet_size > 0) {
+    int segments_r = conn->ring != NULL ? uringSend(conn->ring, msgs, kept, conn->packet_size)
+                                        : socketSendSegments(conn->socket, msgs, kept, conn->packet_size);
+    if (segments_r == 0) return 0;
+    conn->gso = false;
+  }
+  return conn->ring != NULL ? uringSend(conn->ring, msgs, kept, 0) : socketSendBatch(conn->socket, msgs, kept);
+}
 
-  size_t write_r = fwrite(buffer->data, 1, buffer->length, file);
-  fclose(file);
+int connReceiveBatch(Connection *conn, int timeout_ms, Packet *packets, NetMsg *msgs, size_t *ready) {
+  // io_uring hands back whichever of the posted buffers got a datagram
+  if (conn->ring != NULL) return uringWait(conn->ring, timeout_ms, ready);
 
-  return (write_r == buffer->length) ? 0 : ERR_FILE_WRITE;
+  if (timeout_ms > 0 && socketWaitReadable(conn->socket, timeout_ms) <= 0) return 0;
+  for (size_t i = 0; i < NET_BATCH_MAX; i++) {
+    packetToMsg(&packets[i], &conn->peer, &msgs[i]);
+    ready[i] = i;
+  }
+  return socketRecvBatch(conn->socket, msgs, NET_BATCH_MAX);
 }
 
-int sendPacket(SOCKET socket, Packet *packet, const struct sockaddr_in *dest) {
-  if (socket == INVALID_SOCKET || packet == NULL || dest == NULL) return ERR_INVALID_ARG;
+int sealPacket(PacketHeader *packet, const char *payload, ChecksumMode mode) {
+  if (packet == NULL) return ERR_INVALID_ARG;
 
   // Calculate CRC
+  packet->flags = mode == CHECKSUM_CRC32C ? (packet->flags | PACKET_FLAG_CRC32C) : (packet->flags & ~PACKET_FLAG_CRC32C);
   uint32_t crc;
-  int crc_r = computeCRC32((uint8_t *)packet->data, sizeof(packet->data), &crc);
+  int crc_r = packetChecksum(packet, payload, &crc);
   if (crc_r != 0) return crc_r;
   packet->crc32 = htonl(crc);
 
-  // Send packet
-  int send_r = sendto(socket, (const char *)packet, sizeof(Packet), 0, (const struct sockaddr *)dest, sizeof(struct sockaddr_in));
-  if (send_r == SOCKET_ERROR) return ERR_SOCKET_SEND;
+  return 0;
+}
+
+void packetToMsg(Packet *packet, const struct sockaddr_in *addr, NetMsg *msg) {
+  msg->bufs[0].base = packet;
+  msg->bufs[0].len = sizeof(Packet);
+  msg->buf_count = 1;
+  msg->addr = *addr;
+  msg->length = 0;
+}
 
-  return (send_r == sizeof(Packet)) ? 0 : WSAGetLastError();
+void payloadToMsg(PacketHeader *packet, const char *payload, const struct sockaddr_in *addr, NetMsg *msg) {
+  // Header from the packet, data gathered from wherever it lives
+  msg->bufs[0].base = packet;
+  msg->bufs[0].len = sizeof(PacketHeader);
+  msg->bufs[1].base = (void *)payload;
+  msg->bufs[1].len = ntohs(packet->length);
+  msg->buf_count = 2;
+  msg->addr = *addr;
+  msg->length = 0;
 }
 
-int sendAndWaitForAck(SOCKET socket, Packet *packet, const struct sockaddr_in *dest) {
-  if (socket == INVALID_SOCKET || packet == NULL || dest == NULL) return ERR_INVALID_ARG;
+int sendPacket(Connection *conn, Packet *packet) {
+  if (conn == NULL || conn->socket == SOCKET_INVALID || packet == NULL) return ERR_INVALID_ARG;
+
+  int seal_r = sealPacket(&packet->head, packet->data, conn->checksum);
+  if (seal_r != 0) return seal_r;
+
+  // Send the header and the valid part of data only
+  int size = (int)(sizeof(PacketHeader) + ntohs(packet->length));
+  int send_r = sendto(conn->socket, (const char *)packet, size, 0, (const struct sockaddr *)&conn->peer, sizeof(struct sockaddr_in));
+  if (send_r < 0) return ERR_SOCKET_SEND;
+
+  return (send_r == size) ? 0 : ERR_SOCKET_SEND;
+}
+
+int sendAndWaitForAck(Connection *conn, Packet *packet, Packet *ack) {
+  if (conn == NULL || conn->socket == SOCKET_INVALID || packet == NULL) return ERR_INVALID_ARG;
 
   int ack_received = 0;
   for (int attempts = 0; attempts < 5 && !ack_received; attempts++) {
     // Send the packet
-    int send_r = sendPacket(socket, packet, dest);
+    if (attempts > 0) statsAdd(conn->stats, STAT_RESEND_CONTROL, 1);
+    int send_r = sendPacket(conn, packet);
     if (send_r != 0) return send_r;
 
     // Set timeout for receive
-    struct timeval tv = {PACKET_TIMEOUT_SAW_S << attempts, 0}; // Exponential timeout
-    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv);
+    socketSetRecvTimeout(conn->socket, (PACKET_TIMEOUT_SAW_S << attempts) * 1000); // Exponential timeout
 
-    // Wait for ACK
+    // Wait for ACK, SACKs and ACKs still on their way from earlier packets are skipped
     Packet response = {0};
-    int destlen = sizeof(*dest);
-    struct sockaddr_in from_addr = *dest;
-    int r = recvfrom(socket, (char *)&response, sizeof(response), 0, (struct sockaddr *)&from_addr, &destlen);
-    if (r > 0 && strcmp(response.header, PACKET_HEADER_ACK) == 0 && response.offset == packet->offset) {
-      ack_received = 1;
-      return 0;
-    }
+    int r;
+    do {
+      socklen_t destlen = sizeof(conn->peer);
+      struct sockaddr_in from_addr = conn->peer;
+      r = recvfrom(conn->socket, (char *)&response, sizeof(response), 0, (struct sockaddr *)&from_addr, &destlen);
+      if (r > 0 && verifyPacket(&response, r) && strcmp(response.header, PACKET_HEADER_ACK) == 0 && response.offset == packet->offset) {
+        ack_received = 1;
+        if (ack != NULL) *ack = response;
+        return 0;
+      }
+    } while (r > 0);
   }
 
   return ERR_SOCKET_RECEIVE; // Too many retries
 }
 
-int sendFileData(SOCKET socket, FileBuffer *buffer, const struct sockaddr_in *dest, size_t *total_packets) {
-  if (socket == INVALID_SOCKET || buffer == NULL || dest == NULL) return ERR_INVALID_ARG;
+size_t probePacketSize(Connection *conn) {
+  static const size_t mtus[] = MTU_PROBES;
+  const size_t probe_count = sizeof(mtus) / sizeof(mtus[0]);
+  size_t best = 0;
+
+  // Probes must arrive whole, a fragmented one would say nothing about the path
+  socketSetDontFragment(conn->socket, true);
+  Packet probe = {0};
+  memcpy(probe.header, PACKET_HEADER_PROBE, sizeof(probe.header) - 1);
+  for (int attempt = 0; attempt < PROBE_ATTEMPTS && best == 0; attempt++) {
+    // All sizes at once, the offset tells the ACKs apart, sizes the local link can't send fail right away
+    uint64_t sent_at = timeNowUs();
+    for (size_t i = 0; i < probe_count; i++) {
+      probe.offset = mtus[i] - UDP_IP_OVERHEAD;
+      probe.length = htons(probe.offset - PACKET_OVERHEAD);
+      sendPacket(conn, &probe);
+    }
+
+    // After the first ACK larger probes get twice its RTT to catch up
+    uint64_t deadline = sent_at + ((uint64_t)PROBE_TIMEOUT_MS << attempt) * 1000;
+    while (best < mtus[0] - UDP_IP_OVERHEAD) {
+      uint64_t now = timeNowUs();
+      if (now >= deadline || socketWaitReadable(conn->socket, (int)((deadline - now + 999) / 1000)) <= 0) break;
+
+      Packet ack;
+      socklen_t fromlen = sizeof(conn->peer);
+      struct sockaddr_in from_addr = conn->peer;
+      int r = recvfrom(conn->socket, (char *)&ack, sizeof(ack), 0, (struct sockaddr *)&from_addr, &fromlen);
+      if (r <= 0 || !verifyPacket(&ack, r) || strcmp(ack.header, PACKET_HEADER_ACK) != 0) continue;
+      if (ack.offset < PACKET_MIN_SIZE || ack.offset > PACKET_MAX_SIZE || ack.offset <= best) continue;
+
+      if (best == 0) {
+        now = timeNowUs();
+        uint64_t rtt = now - sent_at;
+        if (now + 2 * rtt + 5000 < deadline) deadline = now + 2 * rtt + 5000;
+      }
+      best = ack.offset;
+    }
+  }
+  socketSetDontFragment(conn->socket, false);
+
+  return best > 0 ? best : PACKET_DEFAULT_SIZE;
+}
+
+void ccInit(CongestionControl *cc, size_t max_window) {
+  memset(cc, 0, sizeof(*cc));
+  cc->rto_us = (uint64_t)PACKET_TIMEOUT_SR_MS * 1000;
+  cc->max_window = max_window;
+  cc->cwnd = min(CC_INITIAL_WINDOW, max_window);
+  cc->ssthresh = max_window;
+}
+
+void ccOnRttSample(CongestionControl *cc, uint64_t rtt_us) {
+  if (!cc->has_rtt) {
+    cc->srtt_us = rtt_us;
+    cc->rttvar_us = rtt_us / 2;
+    cc->has_rtt = true;
+  } else {
+    uint64_t delta = cc->srtt_us > rtt_us ? cc->srtt_us - rtt_us : rtt_us - cc->srtt_us;
+    cc->rttvar_us = (3 * cc->rttvar_us + delta) / 4;
+    cc->srtt_us = (7 * cc->srtt_us + rtt_us) / 8;
+  }
+
+  // Paced samples barely vary, without a floor on the variance term the RTO fires before SACKs can report a hole
+  uint64_t variance = 4 * cc->rttvar_us;
+  if (variance < cc->srtt_us / RTO_VAR_MIN_DIV) variance = cc->srtt_us / RTO_VAR_MIN_DIV;
+  uint64_t rto = cc->srtt_us + variance;
+  cc->rto_us = rto < RTO_MIN_US ? RTO_MIN_US : (rto > RTO_MAX_US ? RTO_MAX_US : rto);
+}
+
+void ccOnAck(CongestionControl *cc) {
+  // Slow start doubles the window every RTT, then additive increase by one packet per RTT
+  if (cc->cwnd < cc->ssthresh) cc->cwnd += 1;
+  else cc->cwnd += 1 / cc->cwnd;
+  if (cc->cwnd > cc->max_window) cc->cwnd = cc->max_window;
+}
+
+void ccOnLoss(CongestionControl *cc, size_t seq, size_t next_seq) {
+  // Every packet of a lost flight times out, react to the first one only
+  if (seq < cc->recovery_seq) return;
+  cc->recovery_seq = next_seq;
+
+  cc->ssthresh = cc->cwnd / 2 < CC_MIN_WINDOW ? CC_MIN_WINDOW : cc->cwnd / 2;
+  cc->cwnd = cc->ssthresh;
+  cc->rto_us = min(cc->rto_us * 2, RTO_MAX_US); // Back off until a fresh sample
+}
+
+size_t ccWindow(const CongestionControl *cc) {
+  size_t window = (size_t)cc->cwnd;
+  return window < 1 ? 1 : window;
+}
+
+double ccPacingRate(const CongestionControl *cc, size_t packet_size) {
+  // Window spread over one SRTT, with headroom so pacing never is what holds the window back
+  if (!cc->has_rtt || cc->srtt_us == 0) return 0;
+  double gain = cc->cwnd < cc->ssthresh ? PACING_GAIN_SLOW_START : PACING_GAIN;
+  return gain * (double)ccWindow(cc) * (double)packet_size * 1e6 / (double)cc->srtt_us;
+}
+
+void pacerInit(Pacer *pacer, uint64_t now) {
+  memset(pacer, 0, sizeof(*pacer));
+  pacer->last_us = now;
+}
+
+static void pacerRefill(Pacer *pacer, uint64_t now) {
+  if (now > pacer->last_us) pacer->tokens += pacer->rate * (double)(now - pacer->last_us) / 1e6;
+  if (pacer->tokens > pacer->depth) pacer->tokens = pacer->depth;
+  pacer->last_us = now;
+}
+
+void pacerSetRate(Pacer *pacer, double rate, size_t packet_size, uint64_t now) {
+  // Tokens so far accrue at the old rate
+  pacerRefill(pacer, now);
+  pacer->rate = rate;
+  double depth = rate * PACING_BURST_US / 1e6;
+  double depth_min = (double)(PACING_BURST_MIN_PACKETS * packet_size);
+  pacer->depth = depth > depth_min ? depth : depth_min;
+  if (rate == 0) pacer->tokens = 0;
+}
+
+bool pacerTake(Pacer *pacer, uint64_t now, size_t bytes) {
+  if (pacer->rate == 0) return true;
+  pacerRefill(pacer, now);
+  if (pacer->tokens < (double)bytes) return false;
+  pacer->tokens -= (double)bytes;
+  return true;
+}
+
+void pacerCharge(Pacer *pacer, uint64_t now, size_t bytes) {
+  if (pacer->rate == 0) return;
+  pacerRefill(pacer, now);
+  pacer->tokens -= (double)bytes;
+}
+
+uint64_t pacerReadyAt(const Pacer *pacer, size_t bytes) {
+  if (pacer->rate == 0 || pacer->tokens >= (double)bytes) return pacer->last_us;
+  return pacer->last_us + (uint64_t)(((double)bytes - pacer->tokens) * 1e6 / pacer->rate) + 1;
+}
+
+uint64_t applySack(const Packet *sack, WindowSlot *window, size_t window_len, size_t base, size_t next_seq_num, CongestionControl *cc,
+                   uint64_t now, size_t *highest_sacked) {
+  size_t cumulative = sack->offset; // May run past next_seq_num over packets a resumed receiver already held
+
+  // Cumulative part first, then the bitmap of what follows it
+  uint64_t newest_sent = 0;
+  size_t length = ntohs(sack->length);
+  const char *bitmap = sack->data + SACK_BITMAP_OFFSET;
+  size_t bits = length > SACK_BITMAP_OFFSET ? (length - SACK_BITMAP_OFFSET) * 8 : 0;
+  for (size_t seq = base; seq < next_seq_num; seq++) {
+    bool acked = seq < cumulative;
+    if (!acked && seq > cumulative) {
+      size_t bit = seq - cumulative - 1;
+      if (bit >= bits) break;
+      acked = bitmap[bit / 8] & (1 << (bit % 8));
+      if (acked && seq + 1 > *highest_sacked) *highest_sacked = seq + 1;
+    }
+
+    WindowSlot *slot = &window[seq % window_len];
+    if (!acked || slot->ack) continue;
+    slot->ack = true;
+    ccOnAck(cc);
+    if (!slot->retransmitted && slot->timestamp > newest_sent) newest_sent = slot->timestamp;
+  }
+
+  // One sample per SACK, from the latest packet it covers
+  if (newest_sent == 0) return 0;
+  ccOnRttSample(cc, now - newest_sent);
+  return now - newest_sent;
+}
+
+void timerWheelInit(TimerWheel *wheel, uint64_t now) {
+  for (size_t i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+    wheel->heads[i] = SIZE_MAX;
+  }
+  memset(wheel->occupied, 0, sizeof(wheel->occupied));
+  wheel->tick = now / TIMER_TICK_US;
+}
+
+void timerWheelAdd(TimerWheel *wheel, WindowSlot *window, size_t index, uint64_t deadline) {
+  WindowSlot *slot = &window[index];
+  if (slot->timer_queued) return; // Its list comes up no later than it was due, the deadline is checked then
+
+  // Past deadlines come up with the next tick, ones beyond a turn early
+  uint64_t tick = deadline / TIMER_TICK_US;
+  if (tick < wheel->tick) tick = wheel->tick;
+  if (tick >= wheel->tick + TIMER_WHEEL_SLOTS) tick = wheel->tick + TIMER_WHEEL_SLOTS - 1;
+  size_t list = (size_t)(tick % TIMER_WHEEL_SLOTS);
+  slot->timer_next = wheel->heads[list];
+  slot->timer_queued = true;
+  wheel->heads[list] = index;
+  wheel->occupied[list / 64] |= 1ull << (list % 64);
+}
+
+size_t timerWheelExpire(TimerWheel *wheel, WindowSlot *window, uint64_t now, uint64_t rto_us, size_t *due) {
+  // Ticks before the current one are complete, after a long stall one turn covers every list
+  size_t count = 0;
+  uint64_t now_tick = now / TIMER_TICK_US;
+  if (now_tick > wheel->tick + TIMER_WHEEL_SLOTS) wheel->tick = now_tick - TIMER_WHEEL_SLOTS;
+  while (wheel->tick < now_tick) {
+    size_t list = (size_t)(wheel->tick % TIMER_WHEEL_SLOTS);
+    size_t index = wheel->heads[list];
+    wheel->heads[list] = SIZE_MAX;
+    wheel->occupied[list / 64] &= ~(1ull << (list % 64));
+    wheel->tick++;
+
+    // Acknowledged slots just leave, a resend since they were queued moved their deadline
+    while (index != SIZE_MAX) {
+      WindowSlot *slot = &window[index];
+      size_t next = slot->timer_next;
+      slot->timer_queued = false;
+      if (!slot->ack) {
+        if (slot->timestamp + rto_us <= now) due[count++] = index;
+        else timerWheelAdd(wheel, window, index, slot->timestamp + rto_us);
+      }
+      index = next;
+    }
+  }
+  return count;
+}
+
+uint64_t timerWheelNext(const TimerWheel *wheel) {
+  // A list comes up once its tick is over
+  for (size_t i = 0; i < TIMER_WHEEL_SLOTS;) {
+    size_t list = (size_t)((wheel->tick + i) % TIMER_WHEEL_SLOTS);
+    uint64_t word = wheel->occupied[list / 64] >> (list % 64);
+    if (word == 0) {
+      i += 64 - list % 64;
+      continue;
+    }
+    while (!(word & 1)) {
+      word >>= 1;
+      i++;
+    }
+    return (wheel->tick + i + 1) * TIMER_TICK_US;
+  }
+  return UINT64_MAX;
+}
+
+size_t dataLength(size_t size, size_t data_len, size_t seq) { return min(data_len, size - seq * data_len); }
+
+size_t fecParityCount(double loss_rate, size_t k) {
+  // Twice the expected erasures of a block leaves room for bursts, one XOR parity even without loss
+  size_t m = 1 + (size_t)(2 * loss_rate * k + 0.999);
+  return min(m, FEC_MAX_PARITY);
+}
+
+static char *stagedPayload(char *staged, size_t index, size_t data_len) {
+  return staged != NULL ? staged + index * data_len : NULL; // NULL for a file, its payloads are read in place
+}
+
+int sendParity(Connection *conn, const FileBuffer *buffer, ArchiveReader *reader, char *staged, size_t first_seq, size_t block, size_t end_seq,
+               size_t m, Packet *parity) {
+  size_t data_len = conn->packet_size - PACKET_OVERHEAD;
+  size_t first = first_seq + block * conn->fec_k;
+  size_t k = min(conn->fec_k, end_seq - first); // Last block may be short
+  const uint8_t *data[FEC_MAX_DATA];
+  size_t lengths[FEC_MAX_DATA];
+  for (size_t i = 0; i < k; i++) {
+    lengths[i] = dataLength(buffer->length, data_len, first + i);
+    data[i] = (const uint8_t *)fileBufferRead(buffer, reader, (uint64_t)(first + i) * data_len, lengths[i], stagedPayload(staged, i, data_len));
+    if (data[i] == NULL) return ERR_FILE_READ;
+  }
+
+  // Only the last packet of the file is short, so the first one sets the parity length
+  uint8_t *rows[FEC_MAX_PARITY];
+  for (size_t j = 0; j < FEC_MAX_PARITY; j++) {
+    rows[j] = (uint8_t *)parity[j].data;
+  }
+  fecEncode(k, m, data, lengths, rows, lengths[0]);
+
+  // Offset carries the block and the parity row instead of a file position
+  NetMsg batch[FEC_MAX_PARITY];
+  for (size_t j = 0; j < m; j++) {
+    memcpy(parity[j].header, PACKET_HEADER_PARITY, sizeof(parity[j].header) - 1);
+    parity[j].header[PACKET_HEADER_LEN - 1] = '\0';
+    parity[j].offset = block * FEC_MAX_PARITY + j;
+    parity[j].length = htons(lengths[0]);
+    sealPacket(&parity[j].head, parity[j].data, conn->checksum);
+    payloadToMsg(&parity[j].head, parity[j].data, &conn->peer, &batch[j]);
+  }
+  return connSendBatch(conn, batch, m) != 0 ? ERR_SOCKET_SEND : 0;
+}
+
+void buildMeta(const Connection *conn, const FileBuffer *buffer, bool with_digest, Packet *packet) {
+  memset(packet, 0, sizeof(*packet));
+  memcpy(packet->header, PACKET_HEADER_META, sizeof(packet->header) - 1);
+  packet->offset = 0;
+
+  // Fixed fields in network byte order, then the name without its terminator
+  uint8_t *data = (uint8_t *)packet->data;
+  data[0] = META_VERSION;
+  data[1] = (conn->checksum == CHECKSUM_CRC32C ? META_FLAG_CRC32C : 0) | (with_digest ? META_FLAG_DIGEST : 0) | META_FLAG_RESUME |
+            (buffer->archive ? META_FLAG_ARCHIVE : 0) |
+            (conn->compress > 0 ? META_FLAG_COMPRESS : 0) | (conn->tree ? META_FLAG_TREE : 0) |
+            (conn->sequence ? META_FLAG_SEQUENCE : 0);
+  data[2] = (uint8_t)conn->fec_k;
+  data[META_STREAMS_OFFSET] = (uint8_t)conn->streams;
+  uint64_t size = buffer->length;
+  for (int i = 0; i < 8; i++) {
+    data[4 + i] = (uint8_t)(size >> (56 - 8 * i));
+  }
+  uint32_t window = htonl((uint32_t)conn->window);
+  memcpy(data + 12, &window, sizeof(window));
+  uint16_t packet_size = htons((uint16_t)conn->packet_size);
+  memcpy(data + 16, &packet_size, sizeof(packet_size));
+  if (with_digest) memcpy(data + 18, buffer->md5, MD5_LEN);
+
+  size_t name_length = min(strlen(buffer->filename), conn->packet_size - PACKET_OVERHEAD - META_NAME_OFFSET); // META fits a DATA packet
+  memcpy(data + META_NAME_OFFSET, buffer->filename, name_length);
+  packet->length = htons(META_NAME_OFFSET + name_length);
+}
+
+int parseMeta(const Packet *packet, Meta *meta) {
+  size_t length = ntohs(packet->length);
+  if (length < META_NAME_OFFSET || length > PACKET_DATA_LEN) return ERR_INVALID_ARG;
+
+  memset(meta, 0, sizeof(*meta));
+  const uint8_t *data = (const uint8_t *)packet->data;
+  meta->version = data[0];
+  meta->flags = data[1];
+  meta->fec_k = data[2];
+  meta->streams = data[META_STREAMS_OFFSET];
+  for (int i = 0; i < 8; i++) {
+    meta->size = (meta->size << 8) | data[4 + i];
+  }
+  uint32_t window;
+  memcpy(&window, data + 12, sizeof(window));
+  meta->window = ntohl(window);
+  uint16_t packet_size;
+  memcpy(&packet_size, data + 16, sizeof(packet_size));
+  meta->packet_size = ntohs(packet_size);
+  memcpy(meta->md5, data + 18, MD5_LEN);
+  memcpy(meta->name, data + META_NAME_OFFSET, length - META_NAME_OFFSET);
+
+  // Newer versions and parameters this build can't follow are refused
+  if (meta->version != META_VERSION) return ERR_INVALID_ARG;
+  if (meta->packet_size < PACKET_MIN_SIZE || meta->packet_size > PACKET_MAX_SIZE) return ERR_INVALID_ARG;
+  if (meta->fec_k == 1 || meta->fec_k > FEC_MAX_DATA) return ERR_INVALID_ARG;
+  if (meta->streams > STREAM_MAX) return ERR_INVALID_ARG;
+  if (meta->size > UINT32_MAX && !(meta->flags & META_FLAG_SEQUENCE)) return ERR_INVALID_ARG; // Byte offsets are 32-bit
+  if ((meta->size + meta->packet_size - PACKET_OVERHEAD - 1) / (meta->packet_size - PACKET_OVERHEAD) > UINT32_MAX) return ERR_INVALID_ARG;
+  if (meta->name[0] == '\0') return ERR_INVALID_ARG;
+
+  return 0;
+}
+
+size_t resumeChunks(const Packet *ack) {
+  // META ACK of a receiver holding a journal, the version is followed by the size of its chunk table
+  if (ntohs(ack->length) < 1 + sizeof(uint32_t)) return 0;
+  uint32_t chunks;
+  memcpy(&chunks, ack->data + 1, sizeof(chunks));
+  return ntohl(chunks);
+}
+
+int exchangeJournal(Connection *conn, const FileBuffer *buffer, size_t chunks, Journal *journal) {
+  if (journalInit(journal, buffer->length) != 0) return ERR_MEM_ALLOC;
+
+  // A session is read a chunk at a time
+  ArchiveReader reader;
+  archiveReaderInit(&reader, &buffer->session);
+  char *staged = NULL;
+  if (buffer->session.manifest != NULL && (staged = (char *)malloc(JOURNAL_CHUNK_SIZE)) == NULL) return ERR_MEM_ALLOC;
+
+  // Our CRC32C of every chunk up to the receiver's last one, it answers with a bit per chunk it holds and that matches
+  size_t per_packet = (conn->packet_size - PACKET_OVERHEAD) / sizeof(uint32_t);
+  chunks = min(chunks, journal->chunk_count);
+  int result = 0;
+  for (size_t first = 0; first < chunks && result == 0; first += per_packet) {
+    size_t count = min(per_packet, chunks - first);
+    Packet request = {0};
+    memcpy(request.header, PACKET_HEADER_RESUME, sizeof(request.header) - 1);
+    request.offset = first;
+    for (size_t i = 0; i < count; i++) {
+      uint64_t offset = (uint64_t)(first + i) * JOURNAL_CHUNK_SIZE;
+      size_t length = (size_t)min(JOURNAL_CHUNK_SIZE, buffer->length - offset);
+      const char *data = fileBufferRead(buffer, &reader, offset, length, staged);
+      if (data == NULL) {
+        result = ERR_FILE_READ;
+        break;
+      }
+      uint32_t crc = htonl(journalChunkChecksum(data, length));
+      memcpy(request.data + i * sizeof(crc), &crc, sizeof(crc));
+    }
+    request.length = htons(count * sizeof(uint32_t));
+
+    Packet ack;
+    if (result == 0) result = sendAndWaitForAck(conn, &request, &ack);
+    if (result != 0) break;
+    if (ntohs(ack.length) < (count + 7) / 8) continue; // Receiver keeps none of these
+
+    for (size_t i = 0; i < count; i++) {
+      uint32_t crc;
+      memcpy(&crc, request.data + i * sizeof(crc), sizeof(crc));
+      if (ack.data[i / 8] & (1 << (i % 8))) journalMark(journal, first + i, ntohl(crc));
+    }
+  }
+  archiveReaderClose(&reader);
+  free(staged);
+  return result;
+}
+
+bool treeAccepted(const Packet *ack) {
+  // Receivers before the tree answer META with the version and the resume fields only
+  return ntohs(ack->length) > META_ACK_FLAGS_OFFSET && ((uint8_t)ack->data[META_ACK_FLAGS_OFFSET] & META_FLAG_TREE);
+}
+
+int exchangeTree(Connection *conn, Tree *tree, Journal *journal) {
+  if (journalInit(journal, tree->size) != 0) return ERR_MEM_ALLOC;
+
+  // Our leaf of every chunk, the receiver answers with a bit per chunk whose leaf is the same on its side
+  size_t per_packet = (conn->packet_size - PACKET_OVERHEAD) / sizeof(uint64_t);
+  for (size_t first = 0; first < tree->leaf_count; first += per_packet) {
+    size_t count = min(per_packet, tree->leaf_count - first);
+    Packet request = {0};
+    memcpy(request.header, PACKET_HEADER_TREE, sizeof(request.header) - 1);
+    request.offset = first;
+    for (size_t i = 0; i < count; i++) {
+      for (int b = 0; b < 8; b++) {
+        request.data[i * sizeof(uint64_t) + b] = (char)(tree->leaves[first + i] >> (56 - 8 * b));
+      }
+    }
+    request.length = htons(count * sizeof(uint64_t));
+
+    Packet ack;
+    int send_r = sendAndWaitForAck(conn, &request, &ack);
+    if (send_r != 0) return send_r;
+    if (ntohs(ack.length) < (count + 7) / 8) continue; // Every one of these goes again
+
+    for (size_t i = 0; i < count; i++) {
+      if (ack.data[i / 8] & (1 << (i % 8))) journalMark(journal, first + i, 0);
+    }
+  }
+  return 0;
+}
+
+int sendFileData(Connection *conn, FileBuffer *buffer, Packet *meta, Journal *journal, size_t first_seq, size_t end_seq) {
+  if (conn == NULL || conn->socket == SOCKET_INVALID || buffer == NULL || conn->window == 0) return ERR_INVALID_ARG;
 
   // Initialize sliding window
-  WindowSlot window[WINDOW_LEN] = {0};
-  *total_packets = (buffer->length + PACKET_DATA_LEN - 1) / PACKET_DATA_LEN;
-  size_t base = 0;
-  size_t next_seq_num = 0;
+  size_t window_len = conn->window;
+  WindowSlot *window = (WindowSlot *)calloc(window_len, sizeof(WindowSlot));
+  if (window == NULL) return ERR_MEM_ALLOC;
+  NetMsg batch[NET_BATCH_MAX];
+  size_t data_len = conn->packet_size - PACKET_OVERHEAD;
+  size_t base = first_seq;
+  size_t next_seq_num = first_seq;
+
+  CongestionControl cc;
+  ccInit(&cc, window_len);
+  uint64_t check_at = UINT64_MAX; // Earliest retransmission deadline
+  uint64_t last_progress = timeNowUs();
+  size_t highest_sacked = first_seq; // One past the highest SACKed
+
+  // Responses are drained in batches, the buffers hold jumbo packets and stay off the stack
+  Packet *responses = (Packet *)malloc(NET_BATCH_MAX * sizeof(Packet));
+  NetMsg response_msgs[NET_BATCH_MAX];
+  for (size_t i = 0; i < NET_BATCH_MAX && responses != NULL; i++) {
+    packetToMsg(&responses[i], &conn->peer, &response_msgs[i]);
+  }
+
+  // Retransmission deadlines sit on a timer wheel, due lists the slots to resend in one round
+  TimerWheel *wheel = (TimerWheel *)malloc(sizeof(TimerWheel));
+  size_t *due = (size_t *)malloc(window_len * sizeof(size_t));
+
+  // Parity follows every block of fec_k DATA packets, its count tracks the erasures the receiver reports
+  Packet *parity = NULL;
+  if (conn->fec_k > 0) parity = (Packet *)calloc(FEC_MAX_PARITY, sizeof(Packet));
+
+  // A session is read into a payload per window slot, kept until the slot is acknowledged, then one per packet of a FEC block
+  ArchiveReader reader;
+  archiveReaderInit(&reader, &buffer->session);
+  char *staged = NULL;
+  if (buffer->session.manifest != NULL) staged = (char *)malloc((window_len + conn->fec_k) * data_len);
+  if (responses == NULL || wheel == NULL || due == NULL || (conn->fec_k > 0 && parity == NULL) ||
+      (buffer->session.manifest != NULL && staged == NULL)) {
+    free(window);
+    free(responses);
+    free(wheel);
+    free(due);
+    free(parity);
+    free(staged);
+    return ERR_MEM_ALLOC;
+  }
+  char *fec_staged = stagedPayload(staged, window_len, data_len);
+  timerWheelInit(wheel, timeNowUs());
+  double loss_rate = 0;
+  uint32_t erasures = 0;
+  uint32_t erasures_at_block = 0;
+  bool block_sent = false; // Current FEC block has packets not skipped
+
+  // First sends are spread over the RTT at a multiple of cwnd / srtt instead of leaving in window-sized bursts
+  Pacer pacer;
+  pacerInit(&pacer, timeNowUs());
+
+  // Payloads are compressed on worker threads ahead of the window, without them DATA simply goes raw
+  Compressor compressor;
+  bool compress = conn->compress > 0 && compressorStart(&compressor, buffer, data_len, first_seq, end_seq, conn->compress) == 0;
 
   // Set socket to non-blocking mode
-  u_long mode = 1;
-  ioctlsocket(socket, FIONBIO, &mode);
+  socketSetNonBlocking(conn->socket, true);
+  if (conn->max_rate > 0) socketSetPacingRate(conn->socket, (uint64_t)conn->max_rate); // Kernel enforces the cap too under fq, best effort
 
-  while (base < *total_packets) {
-    while (next_seq_num < base + WINDOW_LEN && next_seq_num < *total_packets) {
-      size_t window_idx = next_seq_num % WINDOW_LEN;
-      size_t offset = next_seq_num * PACKET_DATA_LEN;
-      size_t chunk_size = min(PACKET_DATA_LEN, buffer->length - offset);
+  // On io_uring the response buffers stay posted and each wait is one call, otherwise poll and recvmmsg
+  Uring ring;
+  conn->ring = conn->uring && uringInit(&ring, conn->socket, response_msgs, NET_BATCH_MAX) == 0 ? &ring : NULL;
 
-      memcpy(window[window_idx].packet.header, PACKET_HEADER_DATA, sizeof(window[window_idx].packet.header) - 1);
-      window[window_idx].packet.offset = offset;
-      memcpy(window[window_idx].packet.data, buffer->data + offset, chunk_size);
+  // META goes out with the first window instead of a round trip ahead of it, until acknowledged it is resent on RTO
+  int result = 0;
+  bool meta_acked = meta == NULL;
+  uint64_t meta_sent_at = timeNowUs();
+  if (meta != NULL) {
+    result = sendPacket(conn, meta);
+    check_at = meta_sent_at + cc.rto_us;
+  }
+
+  while ((base < end_seq || !meta_acked) && result == 0) {
+    // Fill the congestion window, flushed in batches
+    size_t batch_len = 0;
+    uint64_t now = timeNowUs();
+    size_t limit = base + ccWindow(&cc);
+    uint64_t paced_at = UINT64_MAX; // Bucket ran dry, the fill goes on once it holds the next packet
+    double rate = conn->pacing ? ccPacingRate(&cc, conn->packet_size) : 0;
+    if (conn->max_rate > 0 && (rate == 0 || rate > conn->max_rate)) rate = conn->max_rate;
+    pacerSetRate(&pacer, rate, conn->packet_size, now);
+    while (next_seq_num < limit && next_seq_num < end_seq) {
+      WindowSlot *slot = &window[next_seq_num % window_len];
+      size_t offset = next_seq_num * data_len;
+      size_t chunk_size = dataLength(buffer->length, data_len, next_seq_num);
+
+      if (journal != NULL && journal->bitmap != NULL && journalCovers(journal, offset, chunk_size)) {
+        // Receiver holds it from an earlier attempt, the slot counts as acknowledged
+        slot->ack = true;
+        if (base == next_seq_num) {
+          base++;
+          limit++;
+          statsAdd(conn->stats, STAT_BYTES_DONE, chunk_size);
+        }
+      } else {
+        size_t wire_len = PACKET_OVERHEAD + chunk_size;
+        if (!pacerTake(&pacer, now, wire_len)) {
+          paced_at = pacerReadyAt(&pacer, wire_len);
+          break;
+        }
+        memcpy(slot->packet.header, PACKET_HEADER_DATA, sizeof(slot->packet.header) - 1);
+        slot->packet.offset = conn->sequence ? next_seq_num : offset;
+        slot->packet.length = htons(chunk_size);
+        slot->packet.flags = 0;
+        size_t compressed_len;
+        const char *compressed = compress ? compressorTake(&compressor, next_seq_num, &compressed_len) : NULL;
+        if (compressed != NULL) {
+          slot->packet.length = htons(compressed_len);
+          slot->packet.flags = PACKET_FLAG_COMPRESSED;
+          slot->payload = compressed;
+        } else {
+          slot->payload = fileBufferRead(buffer, &reader, offset, chunk_size, stagedPayload(staged, next_seq_num % window_len, data_len));
+          if (slot->payload == NULL) {
+            result = ERR_FILE_READ;
+            break;
+          }
+        }
 
-      // Send DATA packet
-      sendPacket(socket, &window[window_idx].packet, dest);
-      window[window_idx].timestamp = (uint64_t)time(NULL);
-      window[window_idx].ack = false;
+        // Queue DATA packet, payload stays in the mapped file, the session's slot or the compressor's ring
+        sealPacket(&slot->packet, slot->payload, conn->checksum);
+        payloadToMsg(&slot->packet, slot->payload, &conn->peer, &batch[batch_len++]);
+        slot->timestamp = now;
+        slot->seq = next_seq_num;
+        slot->ack = false;
+        slot->retransmitted = false;
+        timerWheelAdd(wheel, window, next_seq_num % window_len, now + cc.rto_us);
+        if (now + cc.rto_us < check_at) check_at = now + cc.rto_us;
+        block_sent = true;
+        statsAdd(conn->stats, STAT_DATA_SENT, 1);
+        statsAdd(conn->stats, STAT_BYTES_SENT, ntohs(slot->packet.length));
+      }
 
       next_seq_num++;
-    }
+      bool block_end = parity != NULL && ((next_seq_num - first_seq) % conn->fec_k == 0 || next_seq_num == end_seq);
+      if (batch_len == NET_BATCH_MAX || block_end) {
+        if (connSendBatch(conn, batch, batch_len) != 0) result = ERR_SOCKET_SEND;
+        batch_len = 0;
+        if (compress) compressorRelease(&compressor, next_seq_num);
+      }
 
-    // Wait for ACKs
-    uint64_t current_time = (uint64_t)time(NULL);
-    struct timeval tv = {0, PACKET_TIMEOUT_SR_MS};
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(socket, &readfds);
-    int fromlen = sizeof(*dest);
-    struct sockaddr_in from_addr = *dest;
-
-    int select_result = select(socket + 1, &readfds, NULL, NULL, &tv);
-    if (select_result > 0) {
-      Packet response = {0};
-      int r = recvfrom(socket, (char *)&response, sizeof(response), 0, (struct sockaddr *)&from_addr, &fromlen);
-      if (r > 0 && strcmp(response.header, PACKET_HEADER_ACK) == 0) {
-        size_t acked_seq = response.offset / PACKET_DATA_LEN;
-        if (acked_seq >= base && acked_seq < next_seq_num) {
-          window[acked_seq % WINDOW_LEN].ack = true;
-          while (base < next_seq_num && window[base % WINDOW_LEN].ack) {
-            base++;
+      // Block is out, follow it with parity sized by the recent loss, unless all of it was skipped
+      if (block_end && block_sent) {
+        double sample = (double)(erasures - erasures_at_block) / conn->fec_k;
+        loss_rate = 0.75 * loss_rate + 0.25 * min(sample, 1.0);
+        erasures_at_block = erasures;
+        size_t block = (next_seq_num - 1 - first_seq) / conn->fec_k;
+        size_t m = fecParityCount(loss_rate, conn->fec_k);
+        int parity_r = sendParity(conn, buffer, &reader, fec_staged, first_seq, block, end_seq, m, parity);
+        if (parity_r != 0) result = parity_r;
+        pacerCharge(&pacer, now, m * conn->packet_size);
+        statsAdd(conn->stats, STAT_PARITY_SENT, m);
+      }
+      if (block_end) block_sent = false;
+    }
+    if (batch_len > 0 && connSendBatch(conn, batch, batch_len) != 0) result = ERR_SOCKET_SEND;
+    if (compress) compressorRelease(&compressor, next_seq_num);
+
+    // Window is full (or everything is out), wait for ACKs until the next retransmission or paced send is due
+    now = timeNowUs();
+    uint64_t wake_at = min(check_at, paced_at);
+    uint64_t wait_us = wake_at > now ? min(wake_at - now, RTO_MAX_US) : 0;
+    int wait_ms = (int)((wait_us + 999) / 1000);
+    bool sack_received = false;
+    bool ring_restart = false;
+    int received;
+    do {
+      size_t ready[NET_BATCH_MAX];
+      received = connReceiveBatch(conn, wait_ms, responses, response_msgs, ready);
+      wait_ms = 0; // Rest of the backlog is drained without waiting
+      now = timeNowUs();
+
+      for (int i = 0; i < received; i++) {
+        Packet *response = &responses[ready[i]];
+        if (!verifyPacket(response, response_msgs[ready[i]].length)) continue;
+
+        // Receiver answers META with the version it accepted, 0 when it refused the transfer
+        if (meta != NULL && strcmp(response->header, PACKET_HEADER_ACK) == 0 && response->offset == meta->offset) {
+          if (ntohs(response->length) < 1 || (uint8_t)response->data[0] != META_VERSION) result = ERR_INVALID_ARG;
+          if (!meta_acked && result == 0 && journal != NULL && resumeChunks(response) > 0) {
+            // Receiver resumes, the rest of the range skips what it holds, the first window may go twice.
+            // The exchange reads the socket directly, posted receives would take its ACKs
+            if (conn->ring != NULL) {
+              uringFree(conn->ring);
+              conn->ring = NULL;
+              ring_restart = true;
+            }
+            socketSetNonBlocking(conn->socket, false);
+            result = exchangeJournal(conn, buffer, resumeChunks(response), journal);
+            socketSetNonBlocking(conn->socket, true);
+            now = timeNowUs();
           }
+          if (!meta_acked) last_progress = now;
+          meta_acked = true;
+          continue;
         }
+        if (strcmp(response->header, PACKET_HEADER_SACK) != 0) continue;
+        meta_acked = true; // Receiver only SACKs after META
+        uint64_t rtt = applySack(response, window, window_len, base, next_seq_num, &cc, now, &highest_sacked);
+        if (rtt > 0) statsRtt(conn->stats, rtt);
+        statsAdd(conn->stats, STAT_SACKS_RECEIVED, 1);
+
+        // Erasure count only grows, SACKs may arrive out of order
+        uint32_t reported;
+        memcpy(&reported, response->data, sizeof(reported));
+        if (ntohs(response->length) >= SACK_BITMAP_OFFSET && ntohl(reported) > erasures) erasures = ntohl(reported);
+        sack_received = true;
       }
+    } while (received == NET_BATCH_MAX);
+    if (ring_restart && uringInit(&ring, conn->socket, response_msgs, NET_BATCH_MAX) == 0) conn->ring = &ring;
+
+    while (base < next_seq_num && window[base % window_len].ack) {
+      statsAdd(conn->stats, STAT_BYTES_DONE, dataLength(buffer->length, data_len, base));
+      base++;
+      last_progress = now;
     }
+    statsSet(conn->stats, conn->index, GAUGE_CWND, ccWindow(&cc));
+    statsSet(conn->stats, conn->index, GAUGE_IN_FLIGHT, next_seq_num - base);
+    statsSet(conn->stats, conn->index, GAUGE_SRTT_US, cc.srtt_us);
+    statsSet(conn->stats, conn->index, GAUGE_RTO_US, cc.rto_us);
+    statsSet(conn->stats, conn->index, GAUGE_PACING_BPS, (uint64_t)rate);
+
+    // Resend packets whose RTO expired and holes the SACKs skipped over
+    now = timeNowUs();
+    if (now >= check_at || sack_received) {
+      if (now - last_progress > (uint64_t)RECEIVE_IDLE_TIMEOUT_MS * 1000) result = ERR_SOCKET_RECEIVE; // Receiver is gone
+
+      check_at = UINT64_MAX;
+      if (!meta_acked && result == 0) {
+        if (now - meta_sent_at >= cc.rto_us) {
+          result = sendPacket(conn, meta);
+          meta_sent_at = now;
+          statsAdd(conn->stats, STAT_RESEND_META, 1);
+        }
+        check_at = meta_sent_at + cc.rto_us;
+      }
 
-    // Timeout and resend packets
-    for (size_t i = base; i < next_seq_num; i++) {
-      size_t window_idx = i % WINDOW_LEN;
-      if (!window[window_idx].ack && (current_time - window[window_idx].timestamp >= PACKET_TIMEOUT_SR_MS)) {
-        sendPacket(socket, &window[window_idx].packet, dest);
-        window[window_idx].timestamp = current_time;
+      // Expired slots come off the wheel, only the SACKed range is scanned for holes.
+      // A hole is lost once enough later packets got through, but its last resend gets an RTT
+      size_t expired_count = timerWheelExpire(wheel, window, now, cc.rto_us, due);
+      size_t due_count = expired_count;
+      for (size_t i = base; i < next_seq_num && i + SACK_DUP_THRESH < highest_sacked; i++) {
+        WindowSlot *slot = &window[i % window_len];
+        uint64_t age = now - slot->timestamp;
+        if (!slot->ack && age < cc.rto_us && age >= (cc.has_rtt ? cc.srtt_us : cc.rto_us)) due[due_count++] = i % window_len;
       }
+
+      batch_len = 0;
+      bool timed_out = false;
+      for (size_t i = 0; i < due_count && result == 0; i++) {
+        WindowSlot *slot = &window[due[i]];
+        if (i < expired_count && now - slot->timestamp < cc.rto_us) {
+          // RTO backed off at the first loss of this round, the rest of the flight gets the longer one
+          timerWheelAdd(wheel, window, due[i], slot->timestamp + cc.rto_us);
+          continue;
+        }
+        if (i < expired_count && !timed_out) statsAdd(conn->stats, STAT_RTO_EVENTS, 1);
+        timed_out = timed_out || i < expired_count;
+        statsAdd(conn->stats, i < expired_count ? STAT_RESEND_TIMEOUT : STAT_RESEND_HOLE, 1);
+        ccOnLoss(&cc, slot->seq, next_seq_num);
+        if (slot->packet.flags & PACKET_FLAG_COMPRESSED) {
+          // Ring slot may hold a later packet by now, the resend goes raw
+          slot->packet.flags = 0;
+          slot->packet.length = htons(dataLength(buffer->length, data_len, slot->seq));
+          slot->payload = fileBufferRead(buffer, &reader, (uint64_t)slot->seq * data_len, ntohs(slot->packet.length), stagedPayload(staged, due[i], data_len));
+          if (slot->payload == NULL) {
+            result = ERR_FILE_READ;
+            break;
+          }
+          sealPacket(&slot->packet, slot->payload, conn->checksum);
+        }
+        payloadToMsg(&slot->packet, slot->payload, &conn->peer, &batch[batch_len++]);
+        pacerCharge(&pacer, now, PACKET_OVERHEAD + ntohs(slot->packet.length)); // Loss repair goes out at once, later first sends wait for it
+        slot->timestamp = now;
+        slot->retransmitted = true;
+        timerWheelAdd(wheel, window, due[i], now + cc.rto_us);
+
+        if (batch_len == NET_BATCH_MAX) {
+          if (connSendBatch(conn, batch, batch_len) != 0) result = ERR_SOCKET_SEND;
+          batch_len = 0;
+        }
+      }
+      if (batch_len > 0 && connSendBatch(conn, batch, batch_len) != 0) result = ERR_SOCKET_SEND;
+      check_at = min(check_at, timerWheelNext(wheel));
     }
   }
 
   // Reset socket to blocking mode
-  mode = 0;
-  ioctlsocket(socket, FIONBIO, &mode);
+  if (conn->ring != NULL) uringFree(conn->ring);
+  conn->ring = NULL;
+  socketSetNonBlocking(conn->socket, false);
+  if (compress) compressorStop(&compressor);
+  archiveReaderClose(&reader);
+  free(window);
+  free(responses);
+  free(wheel);
+  free(due);
+  free(parity);
+  free(staged);
+
+  return result;
+}
+
+int openStream(const Connection *conn, size_t index, Connection *stream) {
+  *stream = *conn;
+  stream->index = index;
+  stream->max_rate = conn->max_rate / (conn->streams > 0 ? conn->streams : 1); // Each stream gets its share of the cap
+  if (index == 0) return 0; // Stream 0 is the handshake socket itself
 
+  // Stream i uses the local and the peer port + i
+  struct sockaddr_in local;
+  socklen_t local_len = sizeof(local);
+  if (getsockname(conn->socket, (struct sockaddr *)&local, &local_len) != 0) return ERR_SOCKET_BIND;
+  size_t local_port = ntohs(local.sin_port) + index;
+  size_t peer_port = ntohs(conn->peer.sin_port) + index;
+  if (local_port > 65535 || peer_port > 65535) return ERR_INVALID_ARG;
+  local.sin_port = htons((uint16_t)local_port);
+  stream->peer.sin_port = htons((uint16_t)peer_port);
+
+  stream->socket = socket(AF_INET, SOCK_DGRAM, 0);
+  if (stream->socket == SOCKET_INVALID) return ERR_SOCKET_CREATE;
+  if (bind(stream->socket, (struct sockaddr *)&local, sizeof(local)) != 0) {
+    socketClose(stream->socket);
+    stream->socket = SOCKET_INVALID;
+    return ERR_SOCKET_BIND;
+  }
+  socketSetBufferSize(stream->socket, SOCKET_BUFFER_SIZE);
   return 0;
 }
 
-int sendFile(SOCKET socket, FileBuffer *buffer, const struct sockaddr_in *dest) {
-  if (socket == INVALID_SOCKET || buffer == NULL || dest == NULL) return ERR_INVALID_ARG;
+int streamsInit(const Connection *conn, FileBuffer *buffer, size_t total_packets, Stream *streams) {
+  size_t count = conn->streams > 0 ? conn->streams : 1;
+  if (count > STREAM_MAX) return ERR_INVALID_ARG;
+
+  // Equal contiguous ranges, so every stream writes its own part of the mapping
+  for (size_t i = 0; i < count; i++) {
+    memset(&streams[i], 0, sizeof(streams[i]));
+    int open_r = openStream(conn, i, &streams[i].conn);
+    if (open_r != 0) {
+      streamsClose(streams, i);
+      return open_r;
+    }
+    streams[i].buffer = buffer;
+    streams[i].first_seq = total_packets * i / count;
+    streams[i].end_seq = total_packets * (i + 1) / count;
+    streams[i].all = streams;
+    streams[i].count = count;
+  }
+  return 0;
+}
 
-  // Send NAME packet
-  Packet packet_name = {0};
-  strncpy(packet_name.header, PACKET_HEADER_NAME, PACKET_HEADER_LEN - 1);
-  packet_name.header[PACKET_HEADER_LEN - 1] = '\0';
-  sprintf(packet_name.data, "%s", buffer->filename);
-  packet_name.offset = 0;
-  int send_r = sendAndWaitForAck(socket, &packet_name, dest);
-  if (send_r != 0) return send_r;
+void streamsClose(Stream *streams, size_t count) {
+  for (size_t i = 1; i < count; i++) {
+    if (streams[i].conn.socket != SOCKET_INVALID) socketClose(streams[i].conn.socket);
+    streams[i].conn.socket = SOCKET_INVALID;
+  }
+}
 
-  // Send SIZE packet
-  Packet packet_size = {0};
-  strncpy(packet_size.header, PACKET_HEADER_SIZE, PACKET_HEADER_LEN - 1);
-  packet_size.header[PACKET_HEADER_LEN - 1] = '\0';
-  sprintf(packet_size.data, "%zu", buffer->length);
-  packet_size.offset = 1;
-  send_r = sendAndWaitForAck(socket, &packet_size, dest);
-  if (send_r != 0) return send_r;
+int sendStop(Connection *conn, size_t offset, const uint8_t *digest) {
+  Packet packet_stop = {0};
+  strncpy(packet_stop.header, PACKET_HEADER_STOP, PACKET_HEADER_LEN - 1);
+  packet_stop.header[PACKET_HEADER_LEN - 1] = '\0';
+  packet_stop.offset = offset;
+  if (digest != NULL) {
+    memcpy(packet_stop.data, digest, MD5_LEN);
+    packet_stop.length = htons(MD5_LEN);
+  }
+  return sendAndWaitForAck(conn, &packet_stop, NULL);
+}
 
-  // Send HASH packets
-  for (size_t i = 0; i < MD5_LEN; i++) {
-    Packet packet_hash = {0};
-    strncpy(packet_hash.header, PACKET_HEADER_HASH, PACKET_HEADER_LEN - 1);
-    packet_hash.header[PACKET_HEADER_LEN - 1] = '\0';
-    sprintf(packet_hash.data, "%d", buffer->md5[i]);
-    packet_hash.offset = 2 + i;
-    send_r = sendAndWaitForAck(socket, &packet_hash, dest);
+int verifyTree(Connection *conn, FileBuffer *buffer, Tree *tree, size_t total_packets) {
+  // Receiver answers VRFY once its root is in, a mismatch is narrowed down to chunks and only those go again.
+  // Offsets count down from the top, below them are chunk numbers and the STOP of every round
+  for (size_t round = 0;; round++) {
+    Packet request = {0};
+    memcpy(request.header, PACKET_HEADER_VERIFY, sizeof(request.header) - 1);
+    request.offset = UINT32_MAX - round;
+    Packet ack;
+    int send_r = sendAndWaitForAck(conn, &request, &ack);
+    if (send_r != 0) return send_r;
+    if (ntohs(ack.length) >= 1 && ack.data[0] == 1) return 0;
+    if (round == TREE_REPAIR_ROUNDS) return ERR_PACKET_MD5;
+
+    Journal journal = {0}; // Chunks the receiver holds as we do, skipped like resumed ones
+    send_r = exchangeTree(conn, tree, &journal);
+    if (send_r == 0) send_r = sendFileData(conn, buffer, NULL, &journal, 0, total_packets);
+    journalFree(&journal);
+    if (send_r == 0) send_r = sendStop(conn, 2 + MD5_LEN + 1 + total_packets + 1 + round, buffer->md5);
     if (send_r != 0) return send_r;
   }
+}
 
-  // Send START packet
-  Packet packet_start = {0};
-  strncpy(packet_start.header, PACKET_HEADER_START, PACKET_HEADER_LEN - 1);
-  packet_start.header[PACKET_HEADER_LEN - 1] = '\0';
-  packet_start.offset = 2 + MD5_LEN;
-  send_r = sendAndWaitForAck(socket, &packet_start, dest);
-  if (send_r != 0) return send_r;
+void sendStreamThread(void *arg) {
+  Stream *stream = (Stream *)arg;
+  stream->result = sendFileData(&stream->conn, stream->buffer, NULL, stream->journal, stream->first_seq, stream->end_seq);
+  if (stream->result == 0) stream->result = sendStop(&stream->conn, 2 + MD5_LEN + 1 + stream->end_seq, NULL); // Ends this range only
+}
 
-  // Send DATA packets
-  size_t total_data_packets;
-  send_r = sendFileData(socket, buffer, dest, &total_data_packets);
-  if (send_r != 0) return send_r;
+int sendFile(Connection *conn, FileBuffer *buffer) {
+  if (conn == NULL || conn->socket == SOCKET_INVALID || buffer == NULL) return ERR_INVALID_ARG;
 
-  // Send STOP packet
-  Packet packet_stop = {0};
-  strncpy(packet_stop.header, PACKET_HEADER_STOP, PACKET_HEADER_LEN - 1);
-  packet_stop.header[PACKET_HEADER_LEN - 1] = '\0';
-  packet_stop.offset = 2 + MD5_LEN + 1 + total_data_packets;
-  send_r = sendAndWaitForAck(socket, &packet_stop, dest);
+  // Every parameter goes in one META packet, the receiver takes our checksum and FEC block size as they are
+  conn->checksum = crc32Hardware() ? CHECKSUM_CRC32C : CHECKSUM_CRC32;
+  statsSetTotal(conn->stats, buffer->length);
+  if (conn->packet_size == 0) conn->packet_size = probePacketSize(conn); // Without --mtu
+
+  // Byte offsets keep older receivers working, beyond 4 GiB DATA is numbered by packet. Refused before any hashing
+  size_t data_len = conn->packet_size - PACKET_OVERHEAD;
+  size_t total_data_packets = (buffer->length + data_len - 1) / data_len;
+  if (total_data_packets > UINT32_MAX) {
+    printf("Error: %s needs more than 2^32 packets of %zu bytes\n", buffer->filename, data_len);
+    return ERR_INVALID_ARG;
+  }
+  conn->sequence = buffer->length > UINT32_MAX;
+
+  // MD5 or the tree leaves run on their own thread, the file or session is readable as a whole right away
+  Tree tree = {0};
+  if (conn->tree && treeInit(&tree, buffer->length) != 0) return ERR_MEM_ALLOC;
+  HashStream hash;
+  int hash_r = hashStreamStart(&hash, buffer, buffer->length, buffer->length, conn->tree ? &tree : NULL);
+  if (hash_r != 0) {
+    treeFree(&tree);
+    return hash_r;
+  }
+
+  // Upfront mode waits for the digest and puts it in META, otherwise it rides in STOP. A root always does, the
+  // receiver may still turn the tree down
+  bool upfront = conn->md5_upfront && !conn->tree;
+  if (upfront) {
+    hash_r = hashStreamFinish(&hash, buffer->md5);
+    if (hash_r != 0) return hash_r;
+  }
+  Packet packet_meta;
+  buildMeta(conn, buffer, upfront, &packet_meta);
+
+  // File is split into one contiguous range per stream
+  Stream streams[STREAM_MAX];
+  Journal journal = {0}; // Chunks the receiver kept from an earlier attempt, filled once META is acknowledged
+  bool meta_first = conn->streams > 1 || conn->tree;
+  int send_r = streamsInit(conn, buffer, total_data_packets, streams);
+  if (send_r == 0 && meta_first) {
+    // Other streams need the receiver's sockets bound and the tree needs its consent, META is acknowledged first
+    Packet ack;
+    send_r = sendAndWaitForAck(conn, &packet_meta, &ack);
+    if (send_r == 0 && (ntohs(ack.length) < 1 || (uint8_t)ack.data[0] != META_VERSION)) send_r = ERR_INVALID_ARG; // Refused
+    if (send_r == 0 && resumeChunks(&ack) > 0) send_r = exchangeJournal(conn, buffer, resumeChunks(&ack), &journal);
+    if (send_r == 0 && conn->tree && !treeAccepted(&ack)) {
+      // Receiver predates the tree and checks MD5 over the file as before
+      conn->tree = false;
+      hashStreamCancel(&hash);
+      send_r = hashStreamStart(&hash, buffer, buffer->length, buffer->length, NULL);
+      if (send_r != 0) upfront = true; // Nothing left to join
+    }
+    if (send_r != 0) streamsClose(streams, conn->streams);
+  }
+  if (send_r != 0) {
+    if (!upfront) hashStreamFinish(&hash, buffer->md5);
+    journalFree(&journal);
+    treeFree(&tree);
+    return send_r;
+  }
+  for (size_t i = 0; i < conn->streams; i++) {
+    streams[i].journal = &journal;
+  }
+
+  // Stream 0 runs on this thread, with META pipelined in front of its first window when it is the only one
+  size_t started = 1;
+  for (; started < conn->streams; started++) {
+    if (threadCreate(&streams[started].thread, sendStreamThread, &streams[started]) != 0) {
+      send_r = ERR_MEM_ALLOC;
+      break;
+    }
+  }
+  if (send_r == 0) send_r = sendFileData(&streams[0].conn, buffer, meta_first ? NULL : &packet_meta, &journal, streams[0].first_seq, streams[0].end_seq);
+  for (size_t i = 1; i < started; i++) {
+    threadJoin(streams[i].thread);
+    if (send_r == 0) send_r = streams[i].result;
+  }
+  streamsClose(streams, conn->streams);
+  journalFree(&journal);
+
+  // Hashing overlapped with the whole transfer so far
+  if (!upfront) hash_r = hashStreamFinish(&hash, buffer->md5);
+  if (send_r == 0) send_r = hash_r;
+
+  // STOP on the handshake socket ends the transfer and carries the digest, the receiver checks a root on VRFY
+  if (send_r == 0) send_r = sendStop(conn, 2 + MD5_LEN + 1 + total_data_packets, buffer->md5);
+  if (send_r == 0 && conn->tree) send_r = verifyTree(conn, buffer, &tree, total_data_packets);
+  treeFree(&tree);
   if (send_r != 0) return send_r;
 
   return 0;
 }
 
-int receiveFile(SOCKET socket, struct sockaddr_in *from, FileBuffer *buffer) {
-  if (socket == INVALID_SOCKET || buffer == NULL || from == NULL) return ERR_INVALID_ARG;
+void buildAck(const Connection *conn, const Packet *packet, Packet *ack) {
+  memset(ack, 0, sizeof(*ack));
+  strncpy(ack->header, PACKET_HEADER_ACK, sizeof(ack->header) - 1);
+  ack->offset = packet->offset;
+
+  // META is answered with the accepted protocol version, 0 when refused
+  if (strcmp(packet->header, PACKET_HEADER_META) == 0) {
+    Meta meta;
+    ack->data[0] = parseMeta(packet, &meta) == 0 ? META_VERSION : 0;
+    ack->length = htons(1);
+  }
+
+  // START offers a checksum and an FEC block size for the rest of the transfer, answer with the accepted ones
+  if (strcmp(packet->header, PACKET_HEADER_START) == 0) {
+    bool offered = ntohs(packet->length) >= 1 && packet->data[0] == CHECKSUM_CRC32C;
+    ack->data[0] = (conn->checksum == CHECKSUM_CRC32C || offered) ? CHECKSUM_CRC32C : CHECKSUM_CRC32;
+    uint8_t fec_k = ntohs(packet->length) >= 3 ? (uint8_t)packet->data[2] : 0;
+    ack->data[1] = (fec_k >= 2 && fec_k <= FEC_MAX_DATA) ? fec_k : 0;
+    ack->length = htons(2);
+  }
+}
+
+void buildResumeAck(Journal *journal, const Packet *packet, Packet *ack) {
+  memset(ack, 0, sizeof(*ack));
+  strncpy(ack->header, PACKET_HEADER_ACK, sizeof(ack->header) - 1);
+  ack->offset = packet->offset;
+  if (journal == NULL) return; // Empty answer, the sender skips nothing
+
+  // Chunk the sender's file no longer matches is dropped for good, a resent RSUM gets the same answer
+  size_t count = ntohs(packet->length) / sizeof(uint32_t);
+  for (size_t i = 0; i < count; i++) {
+    size_t chunk = packet->offset + i;
+    uint32_t crc;
+    memcpy(&crc, packet->data + i * sizeof(crc), sizeof(crc));
+    if (journalHas(journal, chunk) && journal->crc[chunk] != ntohl(crc)) journalClear(journal, chunk);
+    if (journalHas(journal, chunk)) ack->data[i / 8] |= 1 << (i % 8);
+  }
+  ack->length = htons((count + 7) / 8);
+}
+
+int receiveResume(Connection *conn, Journal *journal, size_t chunks, const Packet *meta_ack) {
+  // Data phase waits until the sender has checked every chunk, DATA of its first window is dropped and resent
+  size_t checked = 0;
+  Packet packet;
+  Packet response;
+  while (checked < chunks) {
+    if (socketWaitReadable(conn->socket, RECEIVE_IDLE_TIMEOUT_MS) <= 0) return ERR_SOCKET_RECEIVE;
+    socklen_t fromlen = sizeof(conn->peer);
+    int received = recvfrom(conn->socket, (char *)&packet, sizeof(packet), 0, (struct sockaddr *)&conn->peer, &fromlen);
+    if (received < 0) {
+      if (socketWouldBlock()) continue;
+      return ERR_SOCKET_RECEIVE;
+    }
+    if (!verifyPacket(&packet, received)) continue;
+
+    if (strcmp(packet.header, PACKET_HEADER_RESUME) == 0) {
+      buildResumeAck(journal, &packet, &response);
+      size_t end = packet.offset + ntohs(packet.length) / sizeof(uint32_t);
+      if (end > checked) checked = end;
+      sendPacket(conn, &response);
+    } else if (strcmp(packet.header, PACKET_HEADER_META) == 0) {
+      response = *meta_ack;
+      sendPacket(conn, &response);
+    }
+  }
+  return 0;
+}
+
+void buildTreeAck(const Tree *tree, Journal *journal, const Packet *packet, Packet *ack) {
+  memset(ack, 0, sizeof(*ack));
+  strncpy(ack->header, PACKET_HEADER_ACK, sizeof(ack->header) - 1);
+  ack->offset = packet->offset;
+
+  // Chunk whose leaf differs is left out of the journal and comes again, a resent TREE gets the same answer
+  size_t count = ntohs(packet->length) / sizeof(uint64_t);
+  for (size_t i = 0; i < count && packet->offset + i < tree->leaf_count; i++) {
+    size_t chunk = packet->offset + i;
+    uint64_t leaf = 0;
+    for (int b = 0; b < 8; b++) {
+      leaf = leaf << 8 | (uint8_t)packet->data[i * sizeof(uint64_t) + b];
+    }
+    if (leaf == tree->leaves[chunk]) journalMark(journal, chunk, 0);
+    else journalClear(journal, chunk);
+    if (journalHas(journal, chunk)) ack->data[i / 8] |= 1 << (i % 8);
+  }
+  ack->length = htons((count + 7) / 8);
+}
+
+int receiveRepair(Connection *conn, FileBuffer *buffer, Tree *tree, Journal *good) {
+  // Whole file as one range on the handshake socket, the good chunks count as received like resumed ones
+  size_t data_len = conn->packet_size - PACKET_OVERHEAD;
+  Stream repair;
+  memset(&repair, 0, sizeof(repair));
+  repair.conn = *conn;
+  repair.buffer = buffer;
+  repair.end_seq = (buffer->size + data_len - 1) / data_len;
+  repair.all = &repair;
+  repair.count = 1;
+  repair.journal = good;
+  repair.tree = tree;
+  progressInit(&repair.contiguous);
+  int result = receiveStreamData(&repair);
+  progressDestroy(&repair.contiguous);
+  receiveStateFree(&repair.state);
+  if (result != 0) return result;
+
+  // Leaves of the resent chunks again, the next VRFY compares the new root
+  for (size_t chunk = 0; chunk < tree->leaf_count; chunk++) {
+    if (!journalHas(good, chunk)) treeHashLeaves(tree, buffer->data, chunk, chunk + 1);
+  }
+  return 0;
+}
+
+int checkTree(Connection *conn, FileBuffer *buffer, Tree *tree, uint8_t *digest) {
+  uint8_t root[MD5_LEN] = {0};
+  treeDigest(tree, root);
+  bool match = memcmp(root, digest, MD5_LEN) == 0;
+
+  // Sender asks for the verdict with VRFY, on a mismatch it sends its leaves in TREE and then the chunks that differ
+  Journal good = {0};
+  size_t checked = 0;
+  size_t round = 0;
+  int result = 0;
+  bool answered = false; // Match sent, a lost ACK brings the VRFY again
+  Packet packet;
+  Packet response;
+  while (result == 0) {
+    if (socketWaitReadable(conn->socket, answered ? TREE_LINGER_MS : RECEIVE_IDLE_TIMEOUT_MS) <= 0) {
+      if (!answered) result = ERR_SOCKET_RECEIVE;
+      break;
+    }
+    socklen_t fromlen = sizeof(conn->peer);
+    int received = recvfrom(conn->socket, (char *)&packet, sizeof(packet), 0, (struct sockaddr *)&conn->peer, &fromlen);
+    if (received < 0) {
+      if (socketWouldBlock()) continue;
+      result = ERR_SOCKET_RECEIVE;
+      break;
+    }
+    if (!verifyPacket(&packet, received)) continue;
+
+    if (strcmp(packet.header, PACKET_HEADER_VERIFY) == 0) {
+      buildAck(conn, &packet, &response);
+      response.data[0] = match ? 1 : 0;
+      response.length = htons(1);
+      sendPacket(conn, &response);
+      answered = match;
+      if (match) continue;
+
+      // Each round has its own offset, a resent VRFY changes nothing
+      size_t request_round = UINT32_MAX - packet.offset;
+      if (request_round >= TREE_REPAIR_ROUNDS) result = ERR_PACKET_MD5; // Sender gives up as well
+      else if (request_round != round || good.bitmap == NULL) {
+        round = request_round;
+        checked = 0;
+        journalFree(&good);
+        if (journalInit(&good, buffer->size) != 0) result = ERR_MEM_ALLOC;
+      }
+    } else if (strcmp(packet.header, PACKET_HEADER_TREE) == 0 && good.bitmap != NULL) {
+      buildTreeAck(tree, &good, &packet, &response);
+      sendPacket(conn, &response);
+      size_t end = packet.offset + ntohs(packet.length) / sizeof(uint64_t);
+      if (end > checked) checked = end;
+      if (checked < tree->leaf_count) continue;
+
+      // Every leaf compared, the chunks that differ follow right away
+      result = receiveRepair(conn, buffer, tree, &good);
+      treeDigest(tree, root);
+      match = memcmp(root, digest, MD5_LEN) == 0;
+      checked = 0;
+    } else if (strcmp(packet.header, PACKET_HEADER_STOP) == 0) {
+      buildAck(conn, &packet, &response); // Its ACK got lost
+      sendPacket(conn, &response);
+    }
+  }
+  journalFree(&good);
+  return result;
+}
+
+int receiveStateInit(ReceiveState *state, FileBuffer *buffer, size_t data_len, size_t fec_k, size_t first_seq, size_t end_seq) {
+  memset(state, 0, sizeof(*state));
+  state->buffer = buffer;
+  state->data_len = data_len;
+  state->first_seq = first_seq;
+  state->end_seq = end_seq;
+  state->total_packets = end_seq - first_seq;
+  state->expected_seq_num = first_seq;
+  state->highest_seq = first_seq;
+  state->fec_k = fec_k;
+  state->received_map = (uint8_t *)calloc(state->total_packets / 8 + 1, 1);
+  if (state->received_map == NULL) return ERR_MEM_ALLOC;
+
+  if (fec_k > 0) {
+    size_t blocks = (state->total_packets + fec_k - 1) / fec_k;
+    state->block_count = (uint16_t *)calloc(blocks + 1, sizeof(uint16_t));
+    state->fec_blocks = (FecBlock **)calloc(blocks + 1, sizeof(FecBlock *));
+    if (state->block_count == NULL || state->fec_blocks == NULL) {
+      receiveStateFree(state);
+      return ERR_MEM_ALLOC;
+    }
+  }
+  return 0;
+}
+
+void receiveStateFree(ReceiveState *state) {
+  if (state->fec_blocks != NULL) {
+    size_t blocks = (state->total_packets + state->fec_k - 1) / state->fec_k;
+    for (size_t i = 0; i < blocks; i++) {
+      free(state->fec_blocks[i]);
+    }
+  }
+  free(state->fec_blocks);
+  free(state->block_count);
+  free(state->received_map);
+  state->fec_blocks = NULL;
+  state->block_count = NULL;
+  state->received_map = NULL;
+}
+
+bool isReceived(const ReceiveState *state, size_t seq) {
+  size_t index = seq - state->first_seq;
+  return state->received_map[index / 8] & (1 << (index % 8));
+}
+
+void markReceived(ReceiveState *state, size_t seq) {
+  size_t index = seq - state->first_seq;
+  state->received_map[index / 8] |= 1 << (index % 8);
+  state->received_packets++;
+  if (state->block_count != NULL) state->block_count[index / state->fec_k]++;
+
+  if (seq + 1 > state->highest_seq) state->highest_seq = seq + 1;
+  while (state->expected_seq_num < state->end_seq && isReceived(state, state->expected_seq_num)) {
+    state->expected_seq_num++;
+  }
+}
+
+void storeData(ReceiveState *state, size_t seq, const char *payload, size_t length, bool compressed) {
+  if (seq < state->first_seq || seq >= state->end_seq || isReceived(state, seq)) return;
+
+  // Compressed payload is decoded straight into the output file, one that doesn't fill its share is left for a resend
+  size_t offset = seq * state->data_len;
+  size_t size = dataLength(state->buffer->size, state->data_len, seq);
+  if (compressed) {
+    if (lzDecompress((const uint8_t *)payload, length, (uint8_t *)state->buffer->data + offset, size) != 0) return;
+  } else {
+    memcpy(state->buffer->data + offset, payload, min(length, size));
+  }
+  markReceived(state, seq);
+  if (state->fec_blocks != NULL) fecRecover(state, (seq - state->first_seq) / state->fec_k);
+}
+
+void storeParity(ReceiveState *state, const Packet *packet) {
+  if (state->fec_blocks == NULL) return;
+  size_t block = packet->offset / FEC_MAX_PARITY;
+  size_t row = packet->offset % FEC_MAX_PARITY;
+  size_t first = state->first_seq + block * state->fec_k; // Blocks count from the start of the range
+  if (first >= state->end_seq) return;
+  size_t k = min(state->fec_k, state->end_seq - first);
+  if (state->block_count[block] >= k) return; // Nothing left to rebuild
+
+  // First parity of the block tells how many of its data packets were lost
+  FecBlock *fec = state->fec_blocks[block];
+  if (fec == NULL) {
+    fec = (FecBlock *)calloc(1, sizeof(FecBlock));
+    if (fec == NULL) return; // Retransmission still covers the block
+    state->fec_blocks[block] = fec;
+    state->erasures += k - state->block_count[block];
+  }
+  for (size_t i = 0; i < fec->count; i++) {
+    if (fec->rows[i] == row) return;
+  }
+  if (fec->count == FEC_MAX_PARITY) return;
+
+  fec->length = min(ntohs(packet->length), state->data_len);
+  fec->rows[fec->count] = (uint8_t)row;
+  memcpy(fec->parity[fec->count], packet->data, fec->length);
+  fec->count++;
+  fecRecover(state, block);
+}
+
+void fecRecover(ReceiveState *state, size_t block) {
+  FecBlock *fec = state->fec_blocks[block];
+  if (fec == NULL) return;
+  size_t first = state->first_seq + block * state->fec_k;
+  size_t k = min(state->fec_k, state->end_seq - first);
+  if (state->block_count[block] + fec->count < k) return; // Too many still missing
+
+  if (state->block_count[block] < k) {
+    uint8_t *data[FEC_MAX_DATA];
+    size_t lengths[FEC_MAX_DATA];
+    bool present[FEC_MAX_DATA];
+    uint8_t *parity[FEC_MAX_PARITY];
+    for (size_t i = 0; i < k; i++) {
+      data[i] = (uint8_t *)state->buffer->data + (first + i) * state->data_len;
+      lengths[i] = dataLength(state->buffer->size, state->data_len, first + i);
+      present[i] = isReceived(state, first + i);
+    }
+    for (size_t j = 0; j < fec->count; j++) {
+      parity[j] = (uint8_t *)fec->parity[j];
+    }
+
+    // Missing packets are written straight into the output file
+    if (fecDecode(k, data, lengths, present, parity, fec->rows, fec->count, fec->length) == 0) {
+      for (size_t i = 0; i < k; i++) {
+        if (!present[i]) markReceived(state, first + i);
+      }
+    }
+  }
+
+  // Block is complete either way, its parity is no longer needed
+  free(fec);
+  state->fec_blocks[block] = NULL;
+}
+
+void buildSack(const ReceiveState *state, Packet *sack) {
+  memset(sack, 0, sizeof(*sack));
+  memcpy(sack->header, PACKET_HEADER_SACK, sizeof(sack->header) - 1);
+  sack->offset = state->expected_seq_num; // Every sequence number below is received
+
+  // Erasure count for the sender's parity rate, then bit i says whether cumulative + 1 + i is received
+  uint32_t erasures = htonl(state->erasures);
+  memcpy(sack->data, &erasures, sizeof(erasures));
+  char *bitmap = sack->data + SACK_BITMAP_OFFSET;
+  size_t cumulative = state->expected_seq_num;
+  size_t highest = state->highest_seq;
+  size_t bits = highest > cumulative + 1 ? min(highest - cumulative - 1, (state->data_len - SACK_BITMAP_OFFSET) * 8) : 0;
+  for (size_t i = 0; i < bits; i++) {
+    if (isReceived(state, cumulative + 1 + i)) bitmap[i / 8] |= 1 << (i % 8);
+  }
+  sack->length = htons(SACK_BITMAP_OFFSET + (bits + 7) / 8);
+}
+
+size_t contiguousPrefix(Stream *streams, size_t count) {
+  // Ranges are back to back, the prefix ends inside the first one still missing packets
+  size_t prefix = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t data_len = streams[i].conn.packet_size - PACKET_OVERHEAD;
+    size_t start = min(streams[i].first_seq * data_len, streams[i].buffer->size);
+    size_t end = min(streams[i].end_seq * data_len, streams[i].buffer->size);
+    prefix = start + progressGet(&streams[i].contiguous);
+    if (prefix < end) break;
+  }
+  return prefix;
+}
+
+int receiveStreamData(Stream *stream) {
+  Connection *conn = &stream->conn;
+  FileBuffer *buffer = stream->buffer;
+
+  // Received DATA of this range by sequence number, with the parity of incomplete FEC blocks
+  ReceiveState *state = &stream->state;
+  int state_r = receiveStateInit(state, buffer, conn->packet_size - PACKET_OVERHEAD, conn->fec_k, stream->first_seq, stream->end_seq);
+  if (state_r != 0) return state_r;
+
+  // Packets a resumed transfer already holds count as received, the first SACK tells the sender
+  if (stream->journal != NULL) {
+    for (size_t seq = state->first_seq; seq < state->end_seq; seq++) {
+      if (journalCovers(stream->journal, seq * state->data_len, dataLength(buffer->size, state->data_len, seq))) markReceived(state, seq);
+    }
+  }
+  statsAdd(conn->stats, STAT_BYTES_DONE, state->received_packets * state->data_len);
+
+  // Packets are drained and acknowledged in batches, the buffers hold jumbo packets and stay off the stack
+  Packet *packets = (Packet *)malloc(NET_BATCH_MAX * sizeof(Packet));
+  Packet *responses = (Packet *)malloc(NET_BATCH_MAX * sizeof(Packet));
+  NetMsg msgs[NET_BATCH_MAX];
+  NetMsg response_msgs[NET_BATCH_MAX];
+  if (packets == NULL || responses == NULL) {
+    free(packets);
+    free(responses);
+    return ERR_MEM_ALLOC;
+  }
+
+  // Set socket to non-blocking
+  socketSetNonBlocking(conn->socket, true);
+
+  // Process DATA packets
+  int result = 0;
+  bool got_stop = false;
+  while (!got_stop) {
+    // Block in poll instead of spinning on an empty socket
+    if (socketWaitReadable(conn->socket, RECEIVE_IDLE_TIMEOUT_MS) <= 0) {
+      result = ERR_SOCKET_RECEIVE;
+      break;
+    }
+
+    for (size_t i = 0; i < NET_BATCH_MAX; i++) {
+      packetToMsg(&packets[i], &conn->peer, &msgs[i]);
+    }
+    int received = socketRecvBatch(conn->socket, msgs, NET_BATCH_MAX);
+    if (received < 0) {
+      result = ERR_SOCKET_RECEIVE;
+      break;
+    }
+
+    size_t response_count = 0;
+    size_t unacked = 0; // DATA and PRTY since the last SACK
+    for (int i = 0; i < received && !got_stop; i++) {
+      Packet *packet = &packets[i];
+      conn->peer = msgs[i].addr;
+
+      // Corrupted packet is dropped, the gap in the next SACK gets it resent
+      if (!verifyPacket(packet, msgs[i].length)) {
+        statsAdd(conn->stats, STAT_CRC_ERRORS, 1);
+        continue;
+      }
+
+      bool is_data = strcmp(packet->header, PACKET_HEADER_DATA) == 0;
+      if (is_data || strcmp(packet->header, PACKET_HEADER_PARITY) == 0) {
+        // Stored by offset in any order, duplicates only count towards the next SACK
+        bool compressed = conn->compress > 0 && (packet->flags & PACKET_FLAG_COMPRESSED);
+        size_t received_before = state->received_packets;
+        size_t seq = conn->sequence ? packet->offset : packet->offset / state->data_len;
+        if (is_data) storeData(state, seq, packet->data, ntohs(packet->length), compressed);
+        else storeParity(state, packet);
+
+        // Whatever arrived beyond the packet itself was rebuilt from parity
+        size_t stored = state->received_packets - received_before;
+        statsAdd(conn->stats, is_data ? STAT_DATA_RECEIVED : STAT_PARITY_RECEIVED, 1);
+        statsAdd(conn->stats, STAT_BYTES_DONE, stored * state->data_len);
+        if (is_data && stored == 0) statsAdd(conn->stats, STAT_DUPLICATES, 1);
+        statsAdd(conn->stats, STAT_FEC_RECOVERED, is_data ? (stored > 0 ? stored - 1 : 0) : stored);
+
+        if (++unacked < SACK_EVERY) continue;
+        buildSack(state, &responses[response_count]);
+        statsAdd(conn->stats, STAT_SACKS_SENT, 1);
+        unacked = 0;
+      } else {
+        // Handshake packets are still acknowledged one by one, a resent META gets the answer the handshake got
+        if (strcmp(packet->header, PACKET_HEADER_RESUME) == 0) buildResumeAck(stream->journal, packet, &responses[response_count]);
+        else if (strcmp(packet->header, PACKET_HEADER_TREE) == 0 && stream->tree != NULL) buildTreeAck(stream->tree, stream->journal, packet, &responses[response_count]);
+        else if (strcmp(packet->header, PACKET_HEADER_META) == 0 && stream->meta_ack != NULL) responses[response_count] = *stream->meta_ack;
+        else buildAck(conn, packet, &responses[response_count]);
+        if (strcmp(packet->header, PACKET_HEADER_STOP) == 0) {
+          got_stop = true;
+          if (ntohs(packet->length) >= MD5_LEN) memcpy(stream->digest, packet->data, MD5_LEN);
+        }
+      }
+
+      sealPacket(&responses[response_count].head, responses[response_count].data, conn->checksum);
+      payloadToMsg(&responses[response_count].head, responses[response_count].data, &conn->peer, &response_msgs[response_count]);
+      response_count++;
+    }
+
+    // Rest of the batch is covered by one more SACK
+    if (unacked > 0) {
+      buildSack(state, &responses[response_count]);
+      statsAdd(conn->stats, STAT_SACKS_SENT, 1);
+      sealPacket(&responses[response_count].head, responses[response_count].data, conn->checksum);
+      payloadToMsg(&responses[response_count].head, responses[response_count].data, &conn->peer, &response_msgs[response_count]);
+      response_count++;
+    }
+
+    if (response_count > 0 && socketSendBatch(conn->socket, response_msgs, response_count) != 0) {
+      result = ERR_SOCKET_SEND;
+      break;
+    }
+
+    // Hand what became contiguous across all streams over to the hashing thread
+    size_t range_start = min(state->first_seq * state->data_len, buffer->size);
+    progressSet(&stream->contiguous, min(state->expected_seq_num * state->data_len, buffer->size) - range_start);
+    if (stream->hash != NULL) hashStreamAdvance(stream->hash, contiguousPrefix(stream->all, stream->count));
+  }
+
+  // Reset socket to blocking mode
+  socketSetNonBlocking(conn->socket, false);
+  bool complete = state->received_packets == state->total_packets;
+  free(packets);
+  free(responses);
+  if (result == 0 && !complete) result = ERR_SOCKET_RECEIVE; // STOP before all packets of the range
+
+  return result;
+}
+
+void receiveStreamThread(void *arg) {
+  Stream *stream = (Stream *)arg;
+  stream->result = receiveStreamData(stream);
+}
+
+void recordJournal(Journal *journal, const FileBuffer *buffer, Stream *streams, size_t count) {
+  // Chunk is in place once every packet under it is received, in whichever stream's range the packet falls
+  size_t data_len = streams[0].conn.packet_size - PACKET_OVERHEAD;
+  size_t stream = 0;
+  for (size_t chunk = 0; chunk < journal->chunk_count; chunk++) {
+    if (journalHas(journal, chunk)) continue;
+    uint64_t start = (uint64_t)chunk * JOURNAL_CHUNK_SIZE;
+    uint64_t end = min(start + JOURNAL_CHUNK_SIZE, journal->size);
+    bool complete = true;
+    for (size_t seq = start / data_len; seq <= (end - 1) / data_len && complete; seq++) {
+      while (stream + 1 < count && seq >= streams[stream].end_seq) stream++;
+      const ReceiveState *state = &streams[stream].state;
+      complete = state->received_map != NULL && seq >= state->first_seq && seq < state->end_seq && isReceived(state, seq);
+    }
+    if (complete) journalMark(journal, chunk, journalChecksum(journal, buffer->data, chunk));
+  }
+}
+
+void checkpointSave(Checkpoint *checkpoint) {
+  // Ranges are back to back, one complete up to its end joins the next so a chunk across both counts
+  const FileBuffer *buffer = checkpoint->streams[0].buffer;
+  Journal *journal = &checkpoint->journal;
+  bool grew = false;
+  bool joined = false;
+  uint64_t run_start = 0;
+  for (size_t i = 0; i < checkpoint->count; i++) {
+    Stream *stream = &checkpoint->streams[i];
+    size_t data_len = stream->conn.packet_size - PACKET_OVERHEAD;
+    uint64_t start = min((uint64_t)stream->first_seq * data_len, buffer->size);
+    uint64_t end = min((uint64_t)stream->end_seq * data_len, buffer->size);
+    uint64_t done = start + progressGet(&stream->contiguous);
+    if (!joined) run_start = start;
+    joined = done == end;
+
+    // Whole chunks of the run only, the last one of the file may be short. Data is on disk before the journal names it
+    size_t first = (size_t)((run_start + JOURNAL_CHUNK_SIZE - 1) / JOURNAL_CHUNK_SIZE);
+    size_t last = done == buffer->size ? journal->chunk_count : (size_t)(done / JOURNAL_CHUNK_SIZE);
+    size_t flush_from = last;
+    for (size_t chunk = first; chunk < last; chunk++) {
+      if (journalHas(journal, chunk)) continue;
+      journalMark(journal, chunk, journalChecksum(journal, buffer->data, chunk));
+      flush_from = min(flush_from, chunk);
+    }
+    if (flush_from == last) continue;
+    uint64_t offset = (uint64_t)flush_from * JOURNAL_CHUNK_SIZE;
+    if (fileFlush(&buffer->map, offset, min((uint64_t)last * JOURNAL_CHUNK_SIZE, buffer->size) - offset) != 0) return;
+    grew = true;
+  }
+  if (grew) journalSave(checkpoint->path, journal);
+}
+
+void checkpointThread(void *arg) {
+  Checkpoint *checkpoint = (Checkpoint *)arg;
+  while (!progressWaitClosed(&checkpoint->stop, JOURNAL_SAVE_MS)) {
+    checkpointSave(checkpoint);
+  }
+}
+
+int checkpointStart(Checkpoint *checkpoint, Stream *streams, size_t count, const char *path) {
+  checkpoint->streams = streams;
+  checkpoint->count = count;
+  checkpoint->path = path;
+  if (journalInit(&checkpoint->journal, streams[0].buffer->size) != 0) return ERR_MEM_ALLOC;
+  progressInit(&checkpoint->stop);
+  if (threadCreate(&checkpoint->thread, checkpointThread, checkpoint) != 0) {
+    progressDestroy(&checkpoint->stop);
+    journalFree(&checkpoint->journal);
+    return ERR_MEM_ALLOC;
+  }
+  return 0;
+}
+
+void checkpointStop(Checkpoint *checkpoint) {
+  progressClose(&checkpoint->stop);
+  threadJoin(checkpoint->thread);
+  progressDestroy(&checkpoint->stop);
+  journalFree(&checkpoint->journal);
+}
+
+int receiveFile(Connection *conn, FileBuffer *buffer) {
+  if (conn == NULL || conn->socket == SOCKET_INVALID || buffer == NULL) return ERR_INVALID_ARG;
 
   // Initialize
   Packet packet = {0};
-  int fromlen = sizeof(*from);
+  socklen_t fromlen = sizeof(conn->peer);
   uint8_t received_md5[MD5_LEN] = {0};
-  int md5_position = 0;
-  size_t total_packets = (buffer->size + PACKET_DATA_LEN - 1) / PACKET_DATA_LEN;
-  size_t expected_seq_num = 0;
-  size_t received_packets = 0;
+  uint32_t md5_received = 0; // Bit per received HASH packet
   bool got_name = false;
   bool got_size = false;
   bool got_hash = false;
   bool got_start = false;
-  bool got_stop = false;
+  size_t file_size = 0;
+  bool digest_in_stop = false;
+  bool resume_offered = false;
 
   // Process metadata packets
-  while (!got_name || !got_size || !got_hash || !got_start) {
+  Packet response = {0};
+  while (!got_name || !got_size || !got_start) {
     int retries = 0;
     bool valid_packet = false;
 
     while (!valid_packet && retries < 5) {
-      int received = recvfrom(socket, (char *)&packet, sizeof(packet), 0, (struct sockaddr *)from, &fromlen);
-      if (received == SOCKET_ERROR) {
-        if (WSAGetLastError() == WSAEWOULDBLOCK) continue; // No data to read, expected err
+      int received = recvfrom(conn->socket, (char *)&packet, sizeof(packet), 0, (struct sockaddr *)&conn->peer, &fromlen);
+      if (received < 0) {
+        if (socketWouldBlock()) continue; // No data to read, expected err
         return ERR_SOCKET_RECEIVE;
       }
 
       // Verify CRC
-      uint32_t received_crc = ntohl(packet.crc32);
-      uint32_t calculated_crc;
-      int crc_r = computeCRC32((uint8_t *)packet.data, sizeof(packet.data), &calculated_crc);
-      if (crc_r != 0) return crc_r;
-      //
-      if (received_crc == calculated_crc) {
+      if (verifyPacket(&packet, received)) {
         valid_packet = true;
       } else {
         Packet response = {0};
         strncpy(response.header, PACKET_HEADER_NACK, PACKET_HEADER_LEN - 1);
         response.header[PACKET_HEADER_LEN - 1] = '\0';
         response.offset = packet.offset;
-        sendPacket(socket, &response, from);
+        sendPacket(conn, &response);
+        statsAdd(conn->stats, STAT_NACKS_SENT, 1);
         retries++;
       }
     }
@@ -444,115 +2167,187 @@ int receiveFile(SOCKET socket, struct sockaddr_in *from, FileBuffer *buffer) {
     // Too many retries
     if (!valid_packet) return ERR_PACKET_CRC;
 
-    // Send ACK for valid packet
-    Packet response = {0};
-    strncpy(response.header, PACKET_HEADER_ACK, sizeof(response.header) - 1);
-    response.offset = packet.offset;
-    sendPacket(socket, &response, from);
+    // DATA pipelined behind a lost META is dropped, the sender resends both
+    if (strcmp(packet.header, PACKET_HEADER_DATA) == 0 || strcmp(packet.header, PACKET_HEADER_PARITY) == 0) continue;
 
-    // Process valid packet
-    if (strcmp(packet.header, PACKET_HEADER_NAME) == 0) {
+    // ACK for valid packet, the one that completes the handshake waits for the output file and the stream sockets
+    buildAck(conn, &packet, &response);
+
+    // Process valid packet, META carries everything older senders split across NAME, SIZE, HASH and START
+    if (strcmp(packet.header, PACKET_HEADER_META) == 0) {
+      Meta meta;
+      if (parseMeta(&packet, &meta) != 0) {
+        sendPacket(conn, &response); // Refused in the ACK
+        return ERR_INVALID_ARG;
+      }
+      got_name = got_size = got_start = true;
+      strncpy(buffer->filename, meta.name, sizeof(buffer->filename) - 1);
+      file_size = meta.size;
+      conn->checksum = (meta.flags & META_FLAG_CRC32C) ? CHECKSUM_CRC32C : CHECKSUM_CRC32;
+      conn->fec_k = meta.fec_k;
+      conn->window = meta.window;
+      conn->packet_size = meta.packet_size;
+      conn->streams = meta.streams > 0 ? meta.streams : 1;
+      resume_offered = meta.flags & META_FLAG_RESUME;
+      buffer->archive = meta.flags & META_FLAG_ARCHIVE;
+      conn->compress = (meta.flags & META_FLAG_COMPRESS) ? 1 : 0;
+      digest_in_stop = !(meta.flags & META_FLAG_DIGEST);
+      conn->tree = meta.flags & META_FLAG_TREE;
+      conn->sequence = meta.flags & META_FLAG_SEQUENCE;
+      if (!digest_in_stop) {
+        memcpy(received_md5, meta.md5, MD5_LEN);
+        got_hash = true;
+      }
+    } else if (strcmp(packet.header, PACKET_HEADER_NAME) == 0) {
       got_name = true;
-      strncpy(buffer->filename, packet.data, sizeof(buffer->filename) - 1);
+      snprintf(buffer->filename, sizeof(buffer->filename), "%.*s", (int)sizeof(buffer->filename) - 1, packet.data); // NAME may fill its data
     } else if (strcmp(packet.header, PACKET_HEADER_SIZE) == 0) {
       got_size = true;
-      int fbAlloc_r = reallocateFileBuffer(buffer, atoll(packet.data));
-      if (fbAlloc_r != 0) return fbAlloc_r;
+      file_size = strtoull(packet.data, NULL, 10);
     } else if (strcmp(packet.header, PACKET_HEADER_HASH) == 0) {
-      if (md5_position < MD5_LEN) {
-        received_md5[md5_position++] = atoi(packet.data);
-        got_hash = md5_position == MD5_LEN;
+      // Placed by offset, a resent HASH whose ACK got lost must not shift the rest
+      size_t md5_index = packet.offset - 2;
+      if (md5_index < MD5_LEN && !(md5_received & (1u << md5_index))) {
+        received_md5[md5_index] = atoi(packet.data);
+        md5_received |= 1u << md5_index;
+        got_hash = md5_received == (1u << MD5_LEN) - 1;
       }
     } else if (strcmp(packet.header, PACKET_HEADER_START) == 0) {
       got_start = true;
+      conn->checksum = (ChecksumMode)response.data[0]; // Accepted in the ACK above
+      digest_in_stop = ntohs(packet.length) >= 2 && (packet.data[1] & START_FLAG_DIGEST_IN_STOP);
+      conn->fec_k = (uint8_t)response.data[1];
+      conn->packet_size = PACKET_DEFAULT_SIZE;
+      conn->streams = 1;
+      conn->tree = false; // Only META offers it
     }
+    if (!got_name || !got_size || !got_start) sendPacket(conn, &response);
   }
 
-  // Set socket to non-blocking
-  u_long mode = 1;
-  ioctlsocket(socket, FIONBIO, &mode);
+  statsSetTotal(conn->stats, file_size);
 
-  // Init MD5
-  MD5Context md5_context;
-  md5Init(&md5_context);
+  // Without the flag the sender got every HASH acknowledged before START
+  if (!digest_in_stop && !got_hash) {
+    sendPacket(conn, &response);
+    return ERR_PACKET_MD5;
+  }
 
-  // Process DATA packets
-  while (!got_stop) {
-    int received = recvfrom(socket, (char *)&packet, sizeof(packet), 0, (struct sockaddr *)from, &fromlen);
-    if (received == SOCKET_ERROR) {
-      if (WSAGetLastError() == WSAEWOULDBLOCK) continue; // No data to read, expected err
-      return ERR_SOCKET_RECEIVE;
-    }
+  // Journal of an earlier attempt at the same file lets a sender that offers it skip what is in place
+  char journal_filename[1024];
+  journalFilename(buffer, journal_filename, sizeof(journal_filename));
+  Journal journal;
+  bool is_meta_ack = strcmp(response.header, PACKET_HEADER_ACK) == 0 && ntohs(response.length) == 1;
+  bool resumed = resume_offered && journalLoad(journal_filename, file_size, &journal) == 0;
+  if (!resumed && journalInit(&journal, file_size) != 0) {
+    if (is_meta_ack) response.data[0] = 0; // META refused
+    sendPacket(conn, &response);
+    return ERR_MEM_ALLOC;
+  }
 
-    // Verify CRC
-    uint32_t received_crc = ntohl(packet.crc32);
-    uint32_t calculated_crc;
-    int crc_r = computeCRC32((uint8_t *)packet.data, sizeof(packet.data), &calculated_crc);
-    if (crc_r != 0) return crc_r;
-    //
-    if (received_crc != calculated_crc) {
-      Packet response = {0};
-      strncpy(response.header, PACKET_HEADER_NACK, PACKET_HEADER_LEN - 1);
-      response.header[PACKET_HEADER_LEN - 1] = '\0';
-      response.offset = packet.offset;
-      sendPacket(socket, &response, from);
-      continue;
-    }
+  // Output file is created once both NAME and SIZE are known, each stream binds its socket before META is acknowledged
+  size_t data_len = conn->packet_size - PACKET_OVERHEAD;
+  Stream streams[STREAM_MAX];
+  int create_r = createOutputFile(buffer, file_size, resumed);
+  if (create_r == 0 && resumed && journalVerify(&journal, buffer->data) == 0) resumed = false; // File changed since
+  if (create_r == 0) create_r = streamsInit(conn, buffer, (buffer->size + data_len - 1) / data_len, streams);
+  size_t resume_chunks = resumed ? journalEnd(&journal) : 0;
+  if (create_r != 0 && is_meta_ack) response.data[0] = 0; // META refused
+  if (create_r == 0 && is_meta_ack && resume_offered) {
+    uint32_t chunks = htonl(resume_chunks);
+    memcpy(response.data + 1, &chunks, sizeof(chunks));
+    response.length = htons(1 + sizeof(chunks));
+  }
+  if (create_r == 0 && is_meta_ack && conn->tree) {
+    response.data[META_ACK_FLAGS_OFFSET] = META_FLAG_TREE; // Resume fields stay 0 when not offered
+    response.length = htons(META_ACK_FLAGS_OFFSET + 1);
+  }
+  sendPacket(conn, &response);
+  if (create_r == 0 && resumed) {
+    create_r = receiveResume(conn, &journal, resume_chunks, &response);
+    if (create_r != 0) streamsClose(streams, conn->streams);
+  }
+  if (create_r != 0) {
+    if (resumed) fileUnmap(&buffer->map, false); // Output file and journal stay as they were for the next attempt
+    journalFree(&journal);
+    return create_r;
+  }
 
-    // Send ACK for valid packet
-    Packet response = {0};
-    strncpy(response.header, PACKET_HEADER_ACK, sizeof(response.header) - 1);
-    response.offset = packet.offset;
-    sendPacket(socket, &response, from);
-
-    // Process valid packet
-    if (strcmp(packet.header, PACKET_HEADER_DATA) == 0) {
-      size_t seq_num = packet.offset / PACKET_DATA_LEN;
-      if (seq_num == expected_seq_num && seq_num < total_packets) {
-        received_packets++;
-        expected_seq_num++;
-        size_t data_length = min(sizeof(packet.data), buffer->size - packet.offset);
-        memcpy(buffer->data + packet.offset, packet.data, data_length);
-        md5Update(&md5_context, (unsigned char *)(packet.data), data_length);
-        if (packet.offset + data_length > buffer->length) {
-          buffer->length = packet.offset + data_length;
-        }
-      }
-    } else if (strcmp(packet.header, PACKET_HEADER_STOP) == 0) {
-      got_stop = true;
-    }
+  // MD5 or the tree leaves follow the contiguous prefix of all streams on its own thread
+  Tree tree = {0};
+  HashStream hash;
+  int hash_r = conn->tree && treeInit(&tree, buffer->size) != 0 ? ERR_MEM_ALLOC : 0;
+  if (hash_r == 0) hash_r = hashStreamStart(&hash, buffer, buffer->size, 0, conn->tree ? &tree : NULL);
+  if (hash_r != 0) {
+    streamsClose(streams, conn->streams);
+    journalFree(&journal);
+    treeFree(&tree);
+    return hash_r;
+  }
+  for (size_t i = 0; i < conn->streams; i++) {
+    streams[i].hash = &hash;
+    streams[i].journal = resumed ? &journal : NULL;
+    progressInit(&streams[i].contiguous);
   }
+  streams[0].meta_ack = is_meta_ack ? &response : NULL;
 
-  // Reset socket to blocking mode
-  mode = 0;
-  ioctlsocket(socket, FIONBIO, &mode);
+  // A sender that resumes gets what was flushed before the receiver went away, even without a clean exit
+  Checkpoint checkpoint;
+  bool checkpointing = resume_offered && checkpointStart(&checkpoint, streams, conn->streams, journal_filename) == 0;
 
-  // Check if all packets were received
-  if (received_packets != total_packets) {
-    free(buffer->data);
-    buffer->data = NULL;
-    return ERR_SOCKET_RECEIVE;
+  // Stream 0 runs on this thread, its STOP is the last one and carries the digest
+  int result = 0;
+  size_t started = 1;
+  for (; started < conn->streams; started++) {
+    if (threadCreate(&streams[started].thread, receiveStreamThread, &streams[started]) != 0) {
+      result = ERR_MEM_ALLOC;
+      break;
+    }
   }
+  if (result == 0) result = receiveStreamData(&streams[0]);
+  for (size_t i = 1; i < started; i++) {
+    threadJoin(streams[i].thread);
+    if (result == 0) result = streams[i].result;
+  }
+  if (checkpointing) checkpointStop(&checkpoint);
+  if (digest_in_stop) memcpy(received_md5, streams[0].digest, MD5_LEN);
+  for (size_t i = 0; i < conn->streams; i++) {
+    progressDestroy(&streams[i].contiguous);
+  }
+  streamsClose(streams, conn->streams);
+
+  uint8_t calculated_md5[MD5_LEN];
+  hash_r = hashStreamFinish(&hash, calculated_md5);
+  if (result == 0) result = hash_r;
 
   // Verify MD5
-  md5Finalize(&md5_context);
-  uint8_t *calculated_md5 = md5_context.digest;
   bool md5_match = true;
   //
-  for (int i = 0; i < MD5_LEN; i++) {
+  for (int i = 0; i < MD5_LEN && result == 0; i++) {
     if (calculated_md5[i] != received_md5[i]) {
       md5_match = false;
       break;
     }
   }
   //
-  if (md5_match) {
-    memcpy(buffer->md5, received_md5, MD5_LEN);
+  if (result == 0 && conn->tree) result = checkTree(conn, buffer, &tree, received_md5); // Chunks that differ are repaired
+  else if (result == 0 && !md5_match) result = ERR_PACKET_MD5;
+  treeFree(&tree);
+
+  // What arrived is kept for the next attempt, one whose resumed data still fails the MD5 check starts over
+  if (result != 0 && !(resumed && result == ERR_PACKET_MD5)) {
+    recordJournal(&journal, buffer, streams, conn->streams);
+    keepPartialFile(buffer, &journal);
   } else {
-    free(buffer->data);
-    buffer->data = NULL;
-    return ERR_PACKET_MD5;
+    remove(journal_filename);
+  }
+  for (size_t i = 0; i < conn->streams; i++) {
+    receiveStateFree(&streams[i].state);
   }
+  journalFree(&journal);
+  if (result != 0) return result;
+
+  buffer->length = buffer->size;
+  memcpy(buffer->md5, received_md5, MD5_LEN);
 
   return 0;
 }
\ No newline at end of file
@@ -3,21 +3,61 @@
 
 #include <stdbool.h>
 #include <stdint.h>
-#include <winsock2.h>
+#include "archive.h"
+#include "crc32.h"
+#include "fec.h"
+#include "journal.h"
+#include "lz77.h"
+#include "md5.h"
+#include "platform.h"
+#include "stats.h"
+#include "tree.h"
 
 #define MODE_SENDER 0
 #define MODE_RECEIVER 1
 //
-#define FILE_READ_CHUNK_SIZE (32 * 1024) // 32 KB
-#define CRC32_POLYNOMIAL 0xEDB88320
-#define CRC32_INITIAL 0xFFFFFFFF
 #define MD5_LEN 16
 //
-#define WINDOW_LEN 4
-#define PACKET_MAX_SIZE 1024
+#define WINDOW_DEFAULT_LEN 2048 // Packets in flight at most, --window
+#define WINDOW_MAX_LEN 65536
+#define CC_INITIAL_WINDOW 16
+#define CC_MIN_WINDOW 2
+#define SACK_EVERY 32      // DATA packets covered by one SACK at most
+#define SACK_DUP_THRESH 3  // SACKed packets past a hole before it counts as lost
+#define SACK_BITMAP_OFFSET sizeof(uint32_t) // SACK data starts with the receiver's erasure count
+#define SOCKET_BUFFER_SIZE (8 * 1024 * 1024)
+#define STREAM_MAX 16 // --streams, stream i uses both ports + i
+#define COMPRESS_THREADS_MAX 16 // --compress, LZ77 workers per stream
+#define COMPRESS_GROUP 16       // Packets a worker compresses at a time
+#define COMPRESS_AHEAD 1024     // Compressed payloads ahead of the sender, more than a group and a send batch
+#define PACKET_MAX_SIZE 8972     // Largest datagram in a 9000-byte jumbo frame
+#define PACKET_DEFAULT_SIZE 1024 // When probing gets no answer, and for older senders
+#define PACKET_MIN_SIZE 548      // Fits the 576-byte MTU every IPv4 path has
 #define PACKET_HEADER_LEN 5 // Including \0
-#define PACKET_DATA_LEN (PACKET_MAX_SIZE - PACKET_HEADER_LEN - sizeof(uint32_t) - sizeof(uint32_t))
+#define PACKET_OVERHEAD (PACKET_HEADER_LEN + sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint32_t))
+#define PACKET_DATA_LEN (PACKET_MAX_SIZE - PACKET_OVERHEAD) // Room in a Packet, DATA carries packet size - overhead
+#define UDP_IP_OVERHEAD 28 // IPv4 and UDP headers between the MTU and the datagram
+#define MTU_MIN 576
+#define MTU_MAX 9000
+#define MTU_PROBES {9000, 4096, 1500} // Tried at once, the largest answered one wins
+#define PROBE_ATTEMPTS 3
+#define PROBE_TIMEOUT_MS 250
+#define PACKET_FLAG_CRC32C 0x01 // Checksum is CRC32C instead of CRC32
+#define PACKET_FLAG_COMPRESSED 0x02 // DATA payload is an LZ77 block of the packet's whole share of the file
+#define START_FLAG_DIGEST_IN_STOP 0x01 // STRT data[1], no HASH packets, MD5 comes in STOP
+#define META_VERSION 1
+#define META_FLAG_CRC32C 0x01 // Packets after META use CRC32C
+#define META_FLAG_DIGEST 0x02 // MD5 is in META, otherwise in STOP
+#define META_FLAG_RESUME 0x04 // Sender skips the journal chunks the receiver still holds
+#define META_FLAG_ARCHIVE 0x08 // DATA is an archive of many files, see archive.h
+#define META_FLAG_COMPRESS 0x10 // DATA packets may be compressed, each on its own
+#define META_FLAG_TREE 0x20 // Digest in STOP is a tree root, see tree.h. Echoed in the ACK when the receiver agrees
+#define META_FLAG_SEQUENCE 0x40 // DATA offsets are packet numbers, set for files beyond 32-bit byte offsets only
+#define META_ACK_FLAGS_OFFSET 5 // ACK of META: version, resume chunk count, then the flags the receiver agreed to
+#define META_NAME_OFFSET 34   // Fixed fields come first, the name fills the rest
+#define META_STREAMS_OFFSET 3 // 0 in older senders, means a single stream
 //
+#define PACKET_HEADER_META "META"
 #define PACKET_HEADER_NAME "NAME"
 #define PACKET_HEADER_SIZE "SIZE"
 #define PACKET_HEADER_HASH "HASH"
@@ -26,11 +66,32 @@
 #define PACKET_HEADER_STOP "STOP"
 #define PACKET_HEADER_ACK "ACK"
 #define PACKET_HEADER_NACK "NACK"
+#define PACKET_HEADER_SACK "SACK"
+#define PACKET_HEADER_PARITY "PRTY"
 #define PACKET_HEADER_RESEND "RSND"
 #define PACKET_HEADER_NEXT "NEXT"
+#define PACKET_HEADER_PROBE "PRBE"
+#define PACKET_HEADER_RESUME "RSUM"
+#define PACKET_HEADER_VERIFY "VRFY"
+#define PACKET_HEADER_TREE "TREE"
 //
 #define PACKET_TIMEOUT_SAW_S 1    // Base, can be increased on following attempt
-#define PACKET_TIMEOUT_SR_MS 1000 // 1s
+#define PACKET_TIMEOUT_SR_MS 1000 // Initial RTO before the first RTT sample
+#define RTO_MIN_US 20000          // 20ms
+#define RTO_MAX_US 4000000        // 4s
+#define RTO_VAR_MIN_DIV 4         // RTO is at least SRTT + SRTT / 4
+#define RECEIVE_IDLE_TIMEOUT_MS 30000 // Receiver gives up after 30s without any packet
+#define JOURNAL_SAVE_MS 2000          // Receiver saves its journal this often while DATA arrives
+#define PROGRESS_DEFAULT_MS 1000      // --progress
+#define PACING_GAIN_SLOW_START 2.0  // Pacing rate over cwnd / SRTT, ahead of the window while it doubles
+#define PACING_GAIN 1.25            // Once it grows linearly, room for the RTT to vary
+#define PACING_BURST_US 2000        // Bucket depth in time at the pacing rate, waits are whole milliseconds
+#define PACING_BURST_MIN_PACKETS 2  // Bucket depth at low rates
+#define RATE_MAX_MBIT 1000000       // --rate, 1 Tbit/s
+#define TREE_REPAIR_ROUNDS 3 // Chunks resent after a root mismatch before the transfer fails
+#define TREE_LINGER_MS 3000  // Receiver waits this long after the last VRFY, longer than the sender's first two retries
+#define TIMER_WHEEL_SLOTS 4096 // Ticks in one turn of the retransmission wheel, a multiple of 64
+#define TIMER_TICK_US 1024     // One turn takes about 4.2s, longer than RTO_MAX_US
 
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 
@@ -49,41 +110,314 @@ typedef enum {
   ERR_PACKET_MD5 = 302
 } Error;
 
-// Buffer to store the whole file
+// File mapped into memory, the source file on the sender and the pre-sized output file on the receiver
 typedef struct {
-  char *data;
+  FileMap map;
+  char *data; // Mapped bytes, NULL for an empty file
   char filename[PACKET_DATA_LEN];
   uint8_t md5[MD5_LEN];
   size_t length;
   size_t size;
+  bool archive;   // Session of many files, staged in one file on the receiver
+  Archive session; // Sender of a session, data is NULL and the contents are read through fileBufferRead
 } FileBuffer;
 
-// Packet of max size 1024 bytes
+// Fields in front of the data of every packet
 typedef struct {
   char header[PACKET_HEADER_LEN];
+  uint8_t flags;
+  uint16_t length; // Valid bytes of data, only these are checksummed and sent
   uint32_t offset;
-  uint32_t crc32;
+  uint32_t crc32; // Over everything before it and the valid data
+} PacketHeader;
+
+// Packet of max size PACKET_MAX_SIZE, the fields are reachable directly or as head
+typedef struct {
+  union {
+    PacketHeader head;
+    struct {
+      char header[PACKET_HEADER_LEN];
+      uint8_t flags;
+      uint16_t length;
+      uint32_t offset;
+      uint32_t crc32;
+    };
+  };
   char data[PACKET_DATA_LEN];
 } Packet;
 
+// Command line options
+typedef struct {
+  size_t window;
+  bool md5_upfront; // Hash before sending, the digest goes in META
+  size_t fec_k;     // Data packets per FEC block, 0 without FEC
+  double drop_rate; // Loss injected into the DATA phase for benchmarks
+  size_t mtu;       // 0 probes the path
+  size_t streams;
+  size_t compress; // LZ77 threads per stream, 0 sends DATA raw
+  bool uring;      // DATA phase of the sender on io_uring where the kernel has it
+  uint32_t progress_ms;   // Between progress lines on stderr, 0 for none
+  const char *stats_path; // JSON lines of the telemetry, a file or unix:<path>
+  bool pacing;            // DATA spread over the RTT instead of sent as the window opens
+  double max_rate;        // Bytes per second of the whole transfer, 0 uncapped
+  bool tree;              // Integrity by a tree of chunk hashes instead of MD5 over the file
+} Options;
+
+// Socket with its peer and the checksum agreed on in the handshake
+typedef struct {
+  socket_t socket;
+  struct sockaddr_in peer;
+  ChecksumMode checksum;
+  size_t window; // Max packets in flight on the sender
+  bool md5_upfront;
+  size_t fec_k; // Agreed in the handshake
+  double drop_rate;
+  size_t packet_size; // Datagram size of DATA, 0 until probed
+  bool gso;           // Runs of DATA leave in one segmentation offload send
+  size_t streams;     // Parallel sockets, agreed in META
+  size_t compress;    // LZ77 threads per stream on the sender, nonzero on the receiver when agreed in META
+  bool uring;
+  Uring *ring; // Sends and receives go through it while set
+  Stats *stats; // Shared by every stream, NULL without telemetry
+  size_t index; // Stream number, 0 for the handshake socket
+  bool pacing;     // First sends of DATA go through a Pacer
+  double max_rate; // Bytes per second of this socket, its share of --rate
+  bool tree;       // Offered by the sender, agreed to by the receiver in the META ACK
+  bool sequence;   // DATA offset is the packet number instead of the byte offset
+} Connection;
+
+// Contents of the META packet, the whole handshake in one datagram
+typedef struct {
+  uint8_t version;
+  uint8_t flags;
+  uint8_t fec_k;
+  uint8_t streams;
+  uint64_t size;
+  uint32_t window;
+  uint16_t packet_size; // Largest datagram the sender uses
+  uint8_t md5[MD5_LEN];
+  char name[PACKET_DATA_LEN - META_NAME_OFFSET + 1];
+} Meta;
+
+// MD5 of a growing prefix of a mapped file, or the tree leaves of its whole chunks, computed on its own thread
+typedef struct {
+  const FileBuffer *buffer;
+  size_t size;
+  Progress ready; // Bytes the thread may hash
+  thread_t thread;
+  MD5Context context;
+  Tree *tree; // NULL for MD5
+  bool complete;
+  bool cancelled; // Checked between chunks, set by hashStreamCancel
+} HashStream;
+
+struct Compressor;
+
+// One thread of a Compressor, it takes every thread_count-th group of packets
+typedef struct {
+  struct Compressor *compressor;
+  size_t index;
+  Progress done; // One past the last packet it compressed, counted from the start of the range
+  thread_t thread;
+} CompressWorker;
+
+// DATA payloads of a range compressed on a pool of threads ahead of the sender, into a ring it sends from
+typedef struct Compressor {
+  const FileBuffer *buffer;
+  size_t data_len;
+  size_t first_seq;
+  size_t end_seq;
+  char *ring;        // COMPRESS_AHEAD payloads of data_len bytes
+  uint16_t *lengths; // Per ring slot, 0 when the packet doesn't shrink
+  Progress sent;     // Packets the sender is done with, their slots may be reused
+  size_t thread_count;
+  CompressWorker workers[COMPRESS_THREADS_MAX];
+} Compressor;
+
+// RTT estimate (Jacobson/Karels) and AIMD congestion window of the sender
+typedef struct {
+  uint64_t srtt_us;
+  uint64_t rttvar_us;
+  uint64_t rto_us;
+  bool has_rtt;
+  double cwnd; // In packets
+  double ssthresh;
+  size_t max_window;
+  size_t recovery_seq; // Window is cut at most once per flight, until base passes this
+} CongestionControl;
+
+// Token bucket in front of the DATA sends of one stream, refilled at the pacing rate
+typedef struct {
+  double rate;   // Bytes per second, 0 sends as fast as the window allows
+  double tokens; // Bytes that may leave now, negative after resends that went regardless
+  double depth;  // Most tokens saved up while idle
+  uint64_t last_us;
+} Pacer;
+
+// Parity packets of one incomplete FEC block on the receiver
+typedef struct {
+  size_t count;
+  uint8_t rows[FEC_MAX_PARITY];
+  size_t length; // Longest parity
+  char parity[FEC_MAX_PARITY][PACKET_DATA_LEN];
+} FecBlock;
+
+// Receiver side of the DATA phase
+typedef struct {
+  FileBuffer *buffer;
+  size_t data_len; // Payload of a DATA packet
+  size_t first_seq; // Range of this stream, sequence numbers stay global
+  size_t end_seq;
+  size_t total_packets;
+  uint8_t *received_map; // Bit per sequence number
+  size_t received_packets;
+  size_t expected_seq_num; // Everything below is in place
+  size_t highest_seq;      // One past the highest received
+  size_t fec_k;
+  uint16_t *block_count; // Received data packets per FEC block
+  FecBlock **fec_blocks; // Parity of incomplete blocks, allocated by the first one
+  uint32_t erasures;     // Data packets missing when the first parity of their block arrived
+} ReceiveState;
+
+// One socket's share of a transfer, a contiguous range of DATA packets on its own thread
+typedef struct Stream {
+  Connection conn;
+  FileBuffer *buffer;
+  size_t first_seq;
+  size_t end_seq; // One past the last packet of the range
+  struct Stream *all; // Every stream of the transfer in range order, stream 0 runs on the calling thread
+  size_t count;
+  Journal *journal;        // Chunks the receiver already holds, shared by all streams
+  const Packet *meta_ack;  // Receiver, answer to a resent META
+  ReceiveState state;      // Receiver, kept for the journal once the stream ends
+  HashStream *hash;        // Receiver, fed with the contiguous prefix of the whole file
+  Progress contiguous;     // Receiver, bytes in place from the start of the range
+  uint8_t digest[MD5_LEN]; // Receiver, from STOP
+  Tree *tree;              // Receiver, leaves to answer TREE with while chunks are repaired
+  thread_t thread;
+  int result;
+} Stream;
+
+// Receiver's journal saved on its own thread from the contiguous part of every range, for a receiver that gets killed
+typedef struct {
+  Stream *streams;
+  size_t count;
+  const char *path;
+  Journal journal; // Chunks flushed to the output file
+  Progress stop;
+  thread_t thread;
+} Checkpoint;
+
 // Slot for a packet inside sliding window
 typedef struct {
-  Packet packet;
+  PacketHeader packet; // Data is sent from payload
+  const char *payload; // Points into the mapped file
   bool ack;
-  uint64_t timestamp;
+  bool retransmitted; // No RTT sample from its ACK (Karn)
+  uint64_t timestamp; // Last send, monotonic us
+  size_t seq;
+  bool timer_queued; // In a timer wheel list, its deadline is checked when the list comes up
+  size_t timer_next; // Next slot index in that list
 } WindowSlot;
 
-int InitWinsock();
-int initCRC32Table();
-int computeCRC32(const uint8_t *data, size_t length, uint32_t *result);
-int allocateFileBuffer(FileBuffer *buffer);
-int reallocateFileBuffer(FileBuffer *buffer, int size);
+// Retransmission deadlines of the window slots by tick, replacing a scan of the whole window
+typedef struct {
+  size_t heads[TIMER_WHEEL_SLOTS]; // Lists of window slot indexes, SIZE_MAX ends one
+  uint64_t occupied[TIMER_WHEEL_SLOTS / 64];
+  uint64_t tick; // Next tick to expire, the ones before are done
+} TimerWheel;
+
+int parseOption(const char *name, const char *value, Options *options);
+int packetChecksum(const PacketHeader *packet, const char *payload, uint32_t *result);
+bool verifyPacket(const Packet *packet, size_t received);
 int loadFile(const char *filename, FileBuffer *buffer);
-int sendPacket(SOCKET socket, Packet *packet, const struct sockaddr_in *dest);
-int sendAndWaitForAck(SOCKET socket, Packet *packet, const struct sockaddr_in *dest);
-int sendFileData(SOCKET socket, FileBuffer *buffer, const struct sockaddr_in *dest, size_t *total_packets);
-int sendFile(SOCKET socket, FileBuffer *buffer, const struct sockaddr_in *dest);
-int receiveFile(SOCKET socket, struct sockaddr_in *from, FileBuffer *buffer);
+int loadArchive(char *const *paths, size_t count, FileBuffer *buffer); // Session of files and directories as one buffer
+// Bytes offset to offset + length - 1, in place for a file and copied into out for a session, NULL when unreadable
+const char *fileBufferRead(const FileBuffer *buffer, ArchiveReader *reader, uint64_t offset, size_t length, char *out);
+void outputFilename(const FileBuffer *buffer, char *output_filename, size_t size);
+void journalFilename(const FileBuffer *buffer, char *journal_filename, size_t size);
+int createOutputFile(FileBuffer *buffer, size_t size, bool keep);
+void discardOutputFile(FileBuffer *buffer);
+int keepPartialFile(FileBuffer *buffer, const Journal *journal);
+void hashStreamThread(void *arg);
+int hashStreamStart(HashStream *stream, const FileBuffer *buffer, size_t size, size_t ready, Tree *tree);
+void hashStreamAdvance(HashStream *stream, size_t ready);
+int hashStreamFinish(HashStream *stream, uint8_t *digest);
+void hashStreamCancel(HashStream *stream); // Stops after the chunk at hand, nothing is left to finish
+void compressThread(void *arg);
+int compressorStart(Compressor *compressor, const FileBuffer *buffer, size_t data_len, size_t first_seq, size_t end_seq, size_t threads);
+const char *compressorTake(Compressor *compressor, size_t seq, size_t *length); // Waits for the packet, NULL when it goes raw
+void compressorRelease(Compressor *compressor, size_t next_seq);                // Packets below next_seq are sent
+void compressorStop(Compressor *compressor);
+int connSendBatch(Connection *conn, NetMsg *msgs, size_t count);
+// Responses into packets, ready lists which ones, waiting up to timeout_ms for the first
+int connReceiveBatch(Connection *conn, int timeout_ms, Packet *packets, NetMsg *msgs, size_t *ready);
+int sealPacket(PacketHeader *packet, const char *payload, ChecksumMode mode);
+void packetToMsg(Packet *packet, const struct sockaddr_in *addr, NetMsg *msg);
+void payloadToMsg(PacketHeader *packet, const char *payload, const struct sockaddr_in *addr, NetMsg *msg);
+int sendPacket(Connection *conn, Packet *packet);
+int sendAndWaitForAck(Connection *conn, Packet *packet, Packet *ack);
+size_t probePacketSize(Connection *conn);
+void ccInit(CongestionControl *cc, size_t max_window);
+void ccOnRttSample(CongestionControl *cc, uint64_t rtt_us);
+void ccOnAck(CongestionControl *cc);
+void ccOnLoss(CongestionControl *cc, size_t seq, size_t next_seq);
+size_t ccWindow(const CongestionControl *cc);
+double ccPacingRate(const CongestionControl *cc, size_t packet_size); // Bytes per second, 0 before the first RTT sample
+void pacerInit(Pacer *pacer, uint64_t now);
+void pacerSetRate(Pacer *pacer, double rate, size_t packet_size, uint64_t now);
+bool pacerTake(Pacer *pacer, uint64_t now, size_t bytes);   // False when the bucket is short, nothing is taken then
+void pacerCharge(Pacer *pacer, uint64_t now, size_t bytes); // Taken even into debt, for resends and parity
+uint64_t pacerReadyAt(const Pacer *pacer, size_t bytes);    // When the bucket will hold bytes
+// RTT sample the SACK gave, 0 without one
+uint64_t applySack(const Packet *sack, WindowSlot *window, size_t window_len, size_t base, size_t next_seq_num, CongestionControl *cc,
+                   uint64_t now, size_t *highest_sacked);
+void timerWheelInit(TimerWheel *wheel, uint64_t now);
+void timerWheelAdd(TimerWheel *wheel, WindowSlot *window, size_t index, uint64_t deadline);
+// Slot indexes whose deadline under the current RTO passed, the others go back in at their deadline
+size_t timerWheelExpire(TimerWheel *wheel, WindowSlot *window, uint64_t now, uint64_t rto_us, size_t *due);
+uint64_t timerWheelNext(const TimerWheel *wheel); // When the earliest list comes up, UINT64_MAX when empty
+size_t dataLength(size_t size, size_t data_len, size_t seq);
+size_t fecParityCount(double loss_rate, size_t k);
+int sendParity(Connection *conn, const FileBuffer *buffer, ArchiveReader *reader, char *staged, size_t first_seq, size_t block, size_t end_seq,
+               size_t m, Packet *parity);
+void buildMeta(const Connection *conn, const FileBuffer *buffer, bool with_digest, Packet *packet);
+int parseMeta(const Packet *packet, Meta *meta);
+size_t resumeChunks(const Packet *ack);
+int exchangeJournal(Connection *conn, const FileBuffer *buffer, size_t chunks, Journal *journal);
+bool treeAccepted(const Packet *ack);
+int exchangeTree(Connection *conn, Tree *tree, Journal *journal); // Marks the chunks whose leaf the receiver has as well
+int sendFileData(Connection *conn, FileBuffer *buffer, Packet *meta, Journal *journal, size_t first_seq, size_t end_seq);
+int openStream(const Connection *conn, size_t index, Connection *stream);
+int streamsInit(const Connection *conn, FileBuffer *buffer, size_t total_packets, Stream *streams);
+void streamsClose(Stream *streams, size_t count);
+int sendStop(Connection *conn, size_t offset, const uint8_t *digest);
+int verifyTree(Connection *conn, FileBuffer *buffer, Tree *tree, size_t total_packets); // Repair rounds until the roots match
+void sendStreamThread(void *arg);
+int sendFile(Connection *conn, FileBuffer *buffer);
+void buildAck(const Connection *conn, const Packet *packet, Packet *ack);
+void buildResumeAck(Journal *journal, const Packet *packet, Packet *ack);
+int receiveResume(Connection *conn, Journal *journal, size_t chunks, const Packet *meta_ack);
+void buildTreeAck(const Tree *tree, Journal *journal, const Packet *packet, Packet *ack);
+int receiveRepair(Connection *conn, FileBuffer *buffer, Tree *tree, Journal *good); // DATA of the chunks not in good, up to STOP
+int checkTree(Connection *conn, FileBuffer *buffer, Tree *tree, uint8_t *digest); // Answers VRFY, repairs until the roots match
+int receiveStateInit(ReceiveState *state, FileBuffer *buffer, size_t data_len, size_t fec_k, size_t first_seq, size_t end_seq);
+void receiveStateFree(ReceiveState *state);
+bool isReceived(const ReceiveState *state, size_t seq);
+void markReceived(ReceiveState *state, size_t seq);
+void storeData(ReceiveState *state, size_t seq, const char *payload, size_t length, bool compressed);
+void storeParity(ReceiveState *state, const Packet *packet);
+void fecRecover(ReceiveState *state, size_t block);
+void buildSack(const ReceiveState *state, Packet *sack);
+size_t contiguousPrefix(Stream *streams, size_t count);
+void recordJournal(Journal *journal, const FileBuffer *buffer, Stream *streams, size_t count);
+void checkpointSave(Checkpoint *checkpoint);
+void checkpointThread(void *arg);
+int checkpointStart(Checkpoint *checkpoint, Stream *streams, size_t count, const char *path);
+void checkpointStop(Checkpoint *checkpoint);
+int receiveStreamData(Stream *stream);
+void receiveStreamThread(void *arg);
+int receiveFile(Connection *conn, FileBuffer *buffer);
 int saveFile(FileBuffer *buffer);
 
 #endif /* UDP_H */
\ No newline at end of file
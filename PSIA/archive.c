@@ -0,0 +1,347 @@
+/*
+ * Many files sent as one: a manifest of every entry (type, size, relative path) followed by the file contents in
+ * manifest order, big-endian throughout. Small files share DATA packets and the manifest rides in the first ones,
+ * so a file costs no round trip of its own. A single directory is archived by its contents, several paths each
+ * under their own name. Entries are sorted so the same tree always gives the same archive, which resuming relies on.
+ * The sender only keeps the manifest in memory and reads the contents from each file by their offset in the archive.
+ */
+
+#include "archive.h"
+#include "platform.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Manifest entry with the file it comes from, path is relative with '/' separators
+typedef struct {
+  ArchiveType type;
+  uint64_t size;
+  char *path;
+  char *disk_path;
+} ArchiveEntry;
+
+typedef struct {
+  ArchiveEntry *entries;
+  size_t count;
+  size_t capacity;
+  uint64_t total; // Manifest and contents
+} EntryList;
+
+static int compareNames(const void *a, const void *b) { return strcmp(*(char *const *)a, *(char *const *)b); }
+
+static const char *baseName(const char *path, char *name, size_t size) {
+  // Last component, trailing separators ignored
+  size_t end = strlen(path);
+  while (end > 1 && (path[end - 1] == '/' || path[end - 1] == '\\')) end--;
+  size_t start = end;
+  while (start > 0 && path[start - 1] != '/' && path[start - 1] != '\\') start--;
+  size_t length = end - start < size - 1 ? end - start : size - 1;
+  memcpy(name, path + start, length);
+  name[length] = '\0';
+  return name;
+}
+
+static int addEntry(EntryList *list, ArchiveType type, uint64_t size, const char *path, const char *disk_path) {
+  size_t path_length = strlen(path);
+  if (path_length == 0 || path_length >= ARCHIVE_PATH_MAX) return -1;
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity > 0 ? list->capacity * 2 : 64;
+    ArchiveEntry *entries = (ArchiveEntry *)realloc(list->entries, capacity * sizeof(ArchiveEntry));
+    if (entries == NULL) return -1;
+    list->entries = entries;
+    list->capacity = capacity;
+  }
+
+  ArchiveEntry *entry = &list->entries[list->count];
+  entry->type = type;
+  entry->size = size;
+  entry->path = (char *)malloc(path_length + 1);
+  entry->disk_path = (char *)malloc(strlen(disk_path) + 1);
+  if (entry->path == NULL || entry->disk_path == NULL) {
+    free(entry->path);
+    free(entry->disk_path);
+    return -1;
+  }
+  strcpy(entry->path, path);
+  strcpy(entry->disk_path, disk_path);
+  list->count++;
+  list->total += ARCHIVE_ENTRY_SIZE + path_length + size;
+  return 0;
+}
+
+static void freeEntries(EntryList *list) {
+  for (size_t i = 0; i < list->count; i++) {
+    free(list->entries[i].path);
+    free(list->entries[i].disk_path);
+  }
+  free(list->entries);
+}
+
+static int addPath(EntryList *list, const char *disk_path, const char *path) {
+  PathType type = pathType(disk_path);
+  if (type == PATH_MISSING) return -1;
+  if (type == PATH_FILE) {
+    FileMap map;
+    if (fileMapRead(disk_path, &map) != 0) return -1;
+    size_t size = map.size;
+    fileUnmap(&map, false);
+    return addEntry(list, ARCHIVE_FILE, size, path, disk_path);
+  }
+
+  // Directory first, then its entries in name order
+  if (path[0] != '\0' && addEntry(list, ARCHIVE_DIRECTORY, 0, path, disk_path) != 0) return -1;
+  DirReader reader;
+  if (dirOpen(disk_path, &reader) != 0) return -1;
+  char **names = NULL;
+  size_t count = 0;
+  int result = 0;
+  const char *name;
+  while ((name = dirNext(&reader)) != NULL && result == 0) {
+    char **grown = (char **)realloc(names, (count + 1) * sizeof(char *));
+    char *copy = (char *)malloc(strlen(name) + 1);
+    if (grown != NULL) names = grown;
+    if (grown == NULL || copy == NULL) {
+      free(copy);
+      result = -1;
+      break;
+    }
+    strcpy(copy, name);
+    names[count++] = copy;
+  }
+  dirClose(&reader);
+  if (names != NULL) qsort(names, count, sizeof(char *), compareNames);
+
+  for (size_t i = 0; i < count && result == 0; i++) {
+    char child_disk[ARCHIVE_PATH_MAX * 2];
+    char child[ARCHIVE_PATH_MAX];
+    int disk_length = snprintf(child_disk, sizeof(child_disk), "%s/%s", disk_path, names[i]);
+    int length = path[0] != '\0' ? snprintf(child, sizeof(child), "%s/%s", path, names[i]) : snprintf(child, sizeof(child), "%s", names[i]);
+    if (disk_length >= (int)sizeof(child_disk) || length >= (int)sizeof(child)) result = -1;
+    else result = addPath(list, child_disk, child);
+  }
+  for (size_t i = 0; i < count; i++) {
+    free(names[i]);
+  }
+  free(names);
+  return result;
+}
+
+static void putBE(uint8_t *out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out[i] = (uint8_t)(value >> (8 * (bytes - 1 - i)));
+  }
+}
+
+static uint64_t getBE(const uint8_t *in, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value = (value << 8) | in[i];
+  }
+  return value;
+}
+
+void archiveName(char *const *paths, size_t count, char *name, size_t size) {
+  if (count == 1 && pathType(paths[0]) == PATH_DIRECTORY) {
+    baseName(paths[0], name, size);
+    if (name[0] != '\0' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && strcmp(name, "/") != 0) return;
+  }
+  snprintf(name, size, "%s", ARCHIVE_SESSION_NAME);
+}
+
+int archiveOpen(char *const *paths, size_t count, Archive *archive) {
+  memset(archive, 0, sizeof(*archive));
+  EntryList list = {NULL, 0, 0, ARCHIVE_HEADER_SIZE};
+  int result = 0;
+  bool single_directory = count == 1 && pathType(paths[0]) == PATH_DIRECTORY;
+  for (size_t i = 0; i < count && result == 0; i++) {
+    char name[ARCHIVE_PATH_MAX];
+    result = addPath(&list, paths[i], single_directory ? "" : baseName(paths[i], name, sizeof(name)));
+  }
+  if (result == 0 && (list.total > SIZE_MAX || list.count > UINT32_MAX)) result = -1;
+
+  // Only the manifest is built, files are mapped one at a time as the transfer reaches them
+  size_t manifest_size = ARCHIVE_HEADER_SIZE;
+  size_t files = 0;
+  for (size_t i = 0; i < list.count; i++) {
+    manifest_size += ARCHIVE_ENTRY_SIZE + strlen(list.entries[i].path);
+    if (list.entries[i].type == ARCHIVE_FILE && list.entries[i].size > 0) files++;
+  }
+  if (result == 0) {
+    archive->manifest = (char *)malloc(manifest_size);
+    archive->paths = (char **)calloc(files > 0 ? files : 1, sizeof(char *));
+    archive->offsets = (uint64_t *)malloc((files > 0 ? files : 1) * sizeof(uint64_t));
+    archive->sizes = (uint64_t *)malloc((files > 0 ? files : 1) * sizeof(uint64_t));
+    if (archive->manifest == NULL || archive->paths == NULL || archive->offsets == NULL || archive->sizes == NULL) result = -1;
+  }
+  if (result != 0) {
+    archiveClose(archive);
+    freeEntries(&list);
+    return -1;
+  }
+
+  // Manifest first, so the receiver learns every entry from the first packets
+  uint8_t *out = (uint8_t *)archive->manifest;
+  memcpy(out, ARCHIVE_MAGIC, 4);
+  putBE(out + 4, list.count, 4);
+  out += ARCHIVE_HEADER_SIZE;
+  uint64_t offset = manifest_size;
+  for (size_t i = 0; i < list.count; i++) {
+    ArchiveEntry *entry = &list.entries[i];
+    size_t path_length = strlen(entry->path);
+    out[0] = (uint8_t)entry->type;
+    putBE(out + 1, entry->size, 8);
+    putBE(out + 9, path_length, 2);
+    memcpy(out + ARCHIVE_ENTRY_SIZE, entry->path, path_length);
+    out += ARCHIVE_ENTRY_SIZE + path_length;
+    if (entry->type != ARCHIVE_FILE || entry->size == 0) continue;
+
+    // Contents follow in manifest order, the disk path moves over from the entry
+    archive->paths[archive->count] = entry->disk_path;
+    archive->offsets[archive->count] = offset;
+    archive->sizes[archive->count] = entry->size;
+    entry->disk_path = NULL;
+    archive->count++;
+    offset += entry->size;
+  }
+  freeEntries(&list);
+  archive->manifest_size = manifest_size;
+  archive->size = offset;
+  return 0;
+}
+
+void archiveClose(Archive *archive) {
+  for (size_t i = 0; i < archive->count; i++) {
+    free(archive->paths[i]);
+  }
+  free(archive->manifest);
+  free(archive->paths);
+  free(archive->offsets);
+  free(archive->sizes);
+  memset(archive, 0, sizeof(*archive));
+}
+
+void archiveReaderInit(ArchiveReader *reader, const Archive *archive) {
+  reader->archive = archive;
+  reader->current = archive->count;
+}
+
+void archiveReaderClose(ArchiveReader *reader) {
+  if (reader->current < reader->archive->count) fileUnmap(&reader->map, false);
+  reader->current = reader->archive->count;
+}
+
+int archiveRead(ArchiveReader *reader, uint64_t offset, size_t length, char *out) {
+  const Archive *archive = reader->archive;
+  if (offset > archive->size || length > archive->size - offset) return -1;
+
+  while (length > 0) {
+    size_t piece;
+    if (offset < archive->manifest_size) {
+      piece = (size_t)(archive->manifest_size - offset < length ? archive->manifest_size - offset : length);
+      memcpy(out, archive->manifest + offset, piece);
+    } else {
+      // Last file starting at or before the offset, a read usually stays in the one already mapped
+      size_t file = reader->current;
+      if (file >= archive->count || offset < archive->offsets[file] || offset - archive->offsets[file] >= archive->sizes[file]) {
+        size_t low = 0;
+        size_t high = archive->count;
+        while (high - low > 1) {
+          size_t middle = low + (high - low) / 2;
+          if (archive->offsets[middle] <= offset) low = middle;
+          else high = middle;
+        }
+        file = low;
+      }
+      if (file != reader->current) {
+        // A file that changed size since the walk would shift every offset after it
+        archiveReaderClose(reader);
+        if (fileMapRead(archive->paths[file], &reader->map) != 0) return -1;
+        if (reader->map.size != archive->sizes[file]) {
+          fileUnmap(&reader->map, false);
+          return -1;
+        }
+        reader->current = file;
+      }
+      uint64_t within = offset - archive->offsets[file];
+      piece = (size_t)(archive->sizes[file] - within < length ? archive->sizes[file] - within : length);
+      memcpy(out, reader->map.data + within, piece);
+    }
+    out += piece;
+    offset += piece;
+    length -= piece;
+  }
+  return 0;
+}
+
+static bool safePath(const char *path) {
+  // Relative, no drive, no backslash and no component that climbs out
+  if (path[0] == '\0' || path[0] == '/' || strchr(path, '\\') != NULL || strchr(path, ':') != NULL) return false;
+  const char *component = path;
+  while (component != NULL) {
+    const char *next = strchr(component, '/');
+    size_t length = next != NULL ? (size_t)(next - component) : strlen(component);
+    if (length == 0 || (length == 1 && component[0] == '.') || (length == 2 && strncmp(component, "..", 2) == 0)) return false;
+    component = next != NULL ? next + 1 : NULL;
+  }
+  return true;
+}
+
+static int createParents(char *path, size_t root_length) {
+  // Every directory between the root and the entry, in case the manifest left one out
+  for (char *slash = strchr(path + root_length + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    int create_r = dirCreate(path);
+    *slash = '/';
+    if (create_r != 0) return -1;
+  }
+  return 0;
+}
+
+int archiveExtract(const FileMap *staged, const char *directory) {
+  const uint8_t *in = (const uint8_t *)staged->data;
+  size_t size = staged->size;
+  if (size < ARCHIVE_HEADER_SIZE || memcmp(in, ARCHIVE_MAGIC, 4) != 0) return -1;
+  uint64_t count = getBE(in + 4, 4);
+
+  // Whole manifest is checked before anything is written
+  size_t manifest = ARCHIVE_HEADER_SIZE;
+  uint64_t contents = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    if (size - manifest < ARCHIVE_ENTRY_SIZE) return -1;
+    size_t path_length = (size_t)getBE(in + manifest + 9, 2);
+    if (in[manifest] > ARCHIVE_DIRECTORY || path_length == 0 || path_length >= ARCHIVE_PATH_MAX) return -1;
+    if (size - manifest - ARCHIVE_ENTRY_SIZE < path_length) return -1;
+    char path[ARCHIVE_PATH_MAX];
+    memcpy(path, in + manifest + ARCHIVE_ENTRY_SIZE, path_length);
+    path[path_length] = '\0';
+    if (strlen(path) != path_length || !safePath(path)) return -1;
+    uint64_t entry_size = getBE(in + manifest + 1, 8);
+    if (entry_size > size) return -1;
+    contents += entry_size;
+    manifest += ARCHIVE_ENTRY_SIZE + path_length;
+  }
+  if (contents != size - manifest) return -1;
+
+  if (dirCreate(directory) != 0) return -1;
+  size_t root_length = strlen(directory);
+  uint64_t content = manifest;
+  size_t offset = ARCHIVE_HEADER_SIZE;
+  for (uint64_t i = 0; i < count; i++) {
+    ArchiveType type = (ArchiveType)in[offset];
+    size_t entry_size = (size_t)getBE(in + offset + 1, 8);
+    size_t path_length = (size_t)getBE(in + offset + 9, 2);
+    char path[ARCHIVE_PATH_MAX * 2];
+    snprintf(path, sizeof(path), "%s/%.*s", directory, (int)path_length, (const char *)in + offset + ARCHIVE_ENTRY_SIZE);
+    offset += ARCHIVE_ENTRY_SIZE + path_length;
+    if (createParents(path, root_length) != 0) return -1;
+
+    if (type == ARCHIVE_DIRECTORY) {
+      if (dirCreate(path) != 0) return -1;
+      continue;
+    }
+    // Copied file to file in the kernel, where the file system shares extents nothing is written again
+    if (fileCopyRange(staged, content, entry_size, path) != 0) return -1;
+    content += entry_size;
+  }
+  return 0;
+}
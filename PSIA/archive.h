@@ -0,0 +1,49 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "platform.h"
+
+#define ARCHIVE_MAGIC "PSAR"
+#define ARCHIVE_HEADER_SIZE 8 // Magic, 32-bit entry count
+#define ARCHIVE_ENTRY_SIZE 11 // Type, 64-bit size, 16-bit path length, then the path
+#define ARCHIVE_PATH_MAX 1024
+#define ARCHIVE_SESSION_NAME "session" // Name of a session that isn't a single directory
+
+typedef enum {
+  ARCHIVE_FILE = 0,
+  ARCHIVE_DIRECTORY = 1
+} ArchiveType;
+
+// Session on the sender, only the manifest is in memory and the contents are read from the files where they lie
+typedef struct {
+  char *manifest;
+  size_t manifest_size;
+  char **paths;      // Files with contents in manifest order, empty ones add nothing after the manifest
+  uint64_t *offsets; // Where each of them starts in the archive
+  uint64_t *sizes;
+  size_t count;
+  uint64_t size; // Manifest and contents
+} Archive;
+
+// Reads an Archive by offset with one file mapped at a time, one per thread
+typedef struct {
+  const Archive *archive;
+  size_t current; // File that is mapped, count for none
+  FileMap map;
+} ArchiveReader;
+
+// Manifest of every file and directory under the paths, their contents follow back to back
+int archiveOpen(char *const *paths, size_t count, Archive *archive);
+void archiveClose(Archive *archive);
+void archiveReaderInit(ArchiveReader *reader, const Archive *archive);
+void archiveReaderClose(ArchiveReader *reader);
+// Bytes offset to offset + length - 1 of the archive copied into out, -1 when a file went away or changed size
+int archiveRead(ArchiveReader *reader, uint64_t offset, size_t length, char *out);
+// Entries of a received archive staged in a file written under directory, -1 on a damaged manifest or a path leaving directory
+int archiveExtract(const FileMap *staged, const char *directory);
+void archiveName(char *const *paths, size_t count, char *name, size_t size); // Directory name, or the session name
+
+#endif /* ARCHIVE_H */
@@ -0,0 +1,62 @@
+#!/bin/bash
+
+show_help() {
+    echo "Loopback goodput of ./UDP against injected loss, with and without FEC, CSV on stdout."
+    echo "---"
+    echo "Usage: $0 [-h] [-s BYTES] [-k K] [-r RATES]"
+    echo "  -h    Prints this help message"
+    echo "  -s    Size of the random test file (default 20000000)"
+    echo "  -k    FEC block size passed to --fec (default 32)"
+    echo "  -r    Space separated drop rates (default \"0 0.01 0.02 0.05 0.1\")"
+}
+
+#----------------------
+
+run_transfer() {
+    DROP=$1
+    shift
+    PORT=$((20000 + RANDOM % 20000))
+
+    ./UDP 1 "$PORT" $((PORT + 1)) 127.0.0.1 > /dev/null 2>&1 &
+    RECEIVER=$!
+    sleep 0.2
+
+    START=$(date +%s.%N)
+    ./UDP 0 $((PORT + 1)) "$PORT" 127.0.0.1 "$FILE" --drop "$DROP" "$@" > /dev/null 2>&1
+    SENDER_R=$?
+    wait "$RECEIVER"
+    RECEIVER_R=$?
+    END=$(date +%s.%N)
+
+    if [ $SENDER_R -ne 0 ] || [ $RECEIVER_R -ne 0 ] || ! cmp -s "$FILE" "$FILE.out"; then
+        echo "failed"
+        return
+    fi
+    awk -v s="$START" -v e="$END" -v b="$SIZE" 'BEGIN { printf "%.3f,%.2f", e - s, b / (e - s) / 1e6 }'
+}
+
+#----------------------
+
+SIZE=20000000
+K=32
+RATES="0 0.01 0.02 0.05 0.1"
+
+while getopts "hs:k:r:" OPT; do
+    case $OPT in
+        h) show_help; exit 0 ;;
+        s) SIZE=$OPTARG ;;
+        k) K=$OPTARG ;;
+        r) RATES=$OPTARG ;;
+        *) show_help; exit 1 ;;
+    esac
+done
+
+FILE=$(mktemp bench_fec.XXXXXX)
+trap 'rm -f "$FILE" "$FILE.out"' EXIT
+head -c "$SIZE" /dev/urandom > "$FILE"
+
+echo "drop,fec,bytes,seconds,goodput_MBps"
+for RATE in $RATES; do
+    echo "$RATE,0,$SIZE,$(run_transfer "$RATE")"
+    echo "$RATE,$K,$SIZE,$(run_transfer "$RATE" --fec "$K")"
+done
@@ -0,0 +1,79 @@
+#!/bin/bash
+
+show_help() {
+    echo "Loopback transfers of ./UDP through ./relay under injected impairments, CSV on stdout."
+    echo "---"
+    echo "Usage: $0 [-h] [-s BYTES] [-c SCENARIOS] [-a ARGS]"
+    echo "  -h    Prints this help message"
+    echo "  -s    Size of the random test file (default 20000000)"
+    echo "  -c    Semicolon separated relay options, one scenario each (default sweeps every impairment)"
+    echo "  -a    Extra sender options, e.g. \"--fec 16\" or \"--streams 4\" (--streams is passed to the relay too)"
+}
+
+#----------------------
+
+run_transfer() {
+    PORT=$((20000 + RANDOM % 20000))
+    STATS=$(mktemp bench_net.XXXXXX)
+
+    # Sender -> relay front (PORT + 100), relay back (PORT + 200) -> receiver (PORT)
+    ./relay $((PORT + 100)) $((PORT + 200)) "$PORT" 127.0.0.1 $1 $RELAY_ARGS > "$STATS" 2>&1 &
+    RELAY=$!
+    ./UDP 1 "$PORT" $((PORT + 200)) 127.0.0.1 > /dev/null 2>&1 &
+    RECEIVER=$!
+    sleep 0.2
+
+    START=$(date +%s.%N)
+    timeout "$TIMEOUT" ./UDP 0 $((PORT + 300)) $((PORT + 100)) 127.0.0.1 "$FILE" $ARGS > /dev/null 2>&1
+    SENDER_R=$?
+    wait "$RECEIVER"
+    RECEIVER_R=$?
+    END=$(date +%s.%N)
+    kill "$RELAY"
+    wait "$RELAY"
+
+    # Relay prints key=value pairs on exit
+    field() { tr ' ' '\n' < "$STATS" | awk -F= -v k="$1" '$1 == k { print $2 }'; }
+    RETRANSMITS=$(field retransmits)
+    DATA=$(field data)
+    DROPPED=$(field dropped)
+    CORRUPTED=$(field corrupted)
+    rm -f "$STATS"
+
+    if [ $SENDER_R -ne 0 ] || [ $RECEIVER_R -ne 0 ] || ! cmp -s "$FILE" "$FILE.out"; then
+        echo "failed,,$DATA,$RETRANSMITS,$DROPPED,$CORRUPTED"
+        return
+    fi
+    awk -v s="$START" -v e="$END" -v b="$SIZE" 'BEGIN { printf "%.3f,%.2f", e - s, b / (e - s) / 1e6 }'
+    echo ",$DATA,$RETRANSMITS,$DROPPED,$CORRUPTED"
+}
+
+#----------------------
+
+SIZE=20000000
+SCENARIOS="--loss 0;--loss 0.01;--loss 0.05;--delay 10;--delay 50;--delay 10 --jitter 5;--duplicate 0.05;--reorder 0.01;--reorder 0.05;--corrupt 0.001;--corrupt 0.01;--delay 20 --jitter 2 --loss 0.02 --reorder 0.01 --corrupt 0.001"
+ARGS=""
+TIMEOUT=120
+
+while getopts "hs:c:a:" OPT; do
+    case $OPT in
+        h) show_help; exit 0 ;;
+        s) SIZE=$OPTARG ;;
+        c) SCENARIOS=$OPTARG ;;
+        a) ARGS=$OPTARG ;;
+        *) show_help; exit 1 ;;
+    esac
+done
+
+# Stream sockets sit on consecutive ports, the relay needs as many
+RELAY_ARGS=$(echo "$ARGS" | grep -o -- "--streams [0-9]*")
+
+FILE=$(mktemp bench_net.XXXXXX)
+trap 'rm -f "$FILE" "$FILE.out"' EXIT
+head -c "$SIZE" /dev/urandom > "$FILE"
+
+echo "scenario,bytes,seconds,goodput_MBps,data_packets,retransmits,dropped,corrupted"
+IFS=';' read -ra LIST <<< "$SCENARIOS"
+for SCENARIO in "${LIST[@]}"; do
+    echo "\"$SCENARIO\",$SIZE,$(run_transfer "$SCENARIO")"
+done
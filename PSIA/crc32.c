@@ -0,0 +1,90 @@
+/*
+ * Slicing-by-8 table CRC (8 input bytes per step through 8 lookup tables) for both polynomials,
+ * CRC32C additionally through the SSE4.2 crc32 instruction on x86-64.
+ */
+
+#include "crc32.h"
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC32C_HW
+#include <nmmintrin.h>
+#endif
+
+static uint32_t crc32_tables[2][8][256];
+static bool crc32c_hw = false;
+
+static void buildTables(uint32_t polynomial, uint32_t tables[8][256]) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; j++) {
+      crc = (crc & 1) ? ((crc >> 1) ^ polynomial) : (crc >> 1);
+    }
+    tables[0][i] = crc;
+  }
+
+  // tables[k][i] is the CRC of byte i followed by k zero bytes
+  for (uint32_t i = 0; i < 256; i++) {
+    for (int k = 1; k < 8; k++) {
+      tables[k][i] = (tables[k - 1][i] >> 8) ^ tables[0][tables[k - 1][i] & 0xFF];
+    }
+  }
+}
+
+void crc32Init() {
+  buildTables(CRC32_POLYNOMIAL, crc32_tables[CHECKSUM_CRC32]);
+  buildTables(CRC32C_POLYNOMIAL, crc32_tables[CHECKSUM_CRC32C]);
+
+#ifdef CRC32C_HW
+  __builtin_cpu_init();
+  crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+bool crc32Hardware() { return crc32c_hw; }
+
+static uint32_t updateSlicing8(uint32_t tables[8][256], uint32_t crc, const uint8_t *data, size_t length) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (length >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, data, sizeof(lo));
+    memcpy(&hi, data + 4, sizeof(hi));
+    lo ^= crc;
+    crc = tables[7][lo & 0xFF] ^ tables[6][(lo >> 8) & 0xFF] ^ tables[5][(lo >> 16) & 0xFF] ^ tables[4][lo >> 24] ^
+          tables[3][hi & 0xFF] ^ tables[2][(hi >> 8) & 0xFF] ^ tables[1][(hi >> 16) & 0xFF] ^ tables[0][hi >> 24];
+    data += 8;
+    length -= 8;
+  }
+#endif
+
+  for (size_t i = 0; i < length; ++i) {
+    crc = (crc >> 8) ^ tables[0][(crc ^ data[i]) & 0xFF];
+  }
+  return crc;
+}
+
+#ifdef CRC32C_HW
+__attribute__((target("sse4.2"))) static uint32_t updateCRC32CHardware(uint32_t crc, const uint8_t *data, size_t length) {
+  uint64_t crc64 = crc;
+  while (length >= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    length -= 8;
+  }
+
+  crc = (uint32_t)crc64;
+  while (length--) {
+    crc = _mm_crc32_u8(crc, *data++);
+  }
+  return crc;
+}
+#endif
+
+uint32_t crc32Update(ChecksumMode mode, uint32_t crc, const uint8_t *data, size_t length) {
+#ifdef CRC32C_HW
+  if (mode == CHECKSUM_CRC32C && crc32c_hw) return updateCRC32CHardware(crc, data, length);
+#endif
+  return updateSlicing8(crc32_tables[mode == CHECKSUM_CRC32C], crc, data, length);
+}
@@ -0,0 +1,22 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC32_POLYNOMIAL 0xEDB88320  // IEEE 802.3, reflected
+#define CRC32C_POLYNOMIAL 0x82F63B78 // Castagnoli, reflected
+#define CRC32_INITIAL 0xFFFFFFFF
+
+typedef enum {
+  CHECKSUM_CRC32 = 0,
+  CHECKSUM_CRC32C = 1 // SSE4.2 crc32 instruction when the CPU has it
+} ChecksumMode;
+
+void crc32Init();
+bool crc32Hardware(); // CRC32C runs on the SSE4.2 instruction
+// Raw register update, no initial value or final inversion, so a checksum can be built from parts
+uint32_t crc32Update(ChecksumMode mode, uint32_t crc, const uint8_t *data, size_t length);
+
+#endif /* CRC32_H */
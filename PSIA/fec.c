@@ -0,0 +1,229 @@
+/*
+ * Erasure code over GF(2^8) for blocks of k data packets and up to FEC_MAX_PARITY parity packets.
+ * Parity rows come from the Cauchy matrix 1 / (x_j + y_i) with x_j = k + j and y_i = i, every column scaled
+ * so that row 0 is all ones. Scaling columns keeps every square submatrix invertible, so any k of the
+ * k + m packets rebuild the block, and a single parity packet is a plain XOR.
+ * Region multiply uses split 4-bit tables through pshufb (SSSE3/AVX2), or a full 64 KB table.
+ */
+
+#include "fec.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define GF_SIMD
+#include <immintrin.h>
+#endif
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_mul_table[256][256];
+static void (*mul_add)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t length);
+static bool simd = false;
+
+uint8_t gfMul(uint8_t a, uint8_t b) {
+  if (a == 0 || b == 0) return 0;
+  return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+uint8_t gfInv(uint8_t a) { return a == 0 ? 0 : gf_exp[255 - gf_log[a]]; }
+
+static void mulAddTable(uint8_t *dst, const uint8_t *src, uint8_t c, size_t length) {
+  const uint8_t *row = gf_mul_table[c];
+  for (size_t i = 0; i < length; i++) {
+    dst[i] ^= row[src[i]];
+  }
+}
+
+#ifdef GF_SIMD
+// Products of c with every low nibble and every high nibble
+static void nibbleTables(uint8_t c, uint8_t lo[16], uint8_t hi[16]) {
+  for (int x = 0; x < 16; x++) {
+    lo[x] = gfMul(c, (uint8_t)x);
+    hi[x] = gfMul(c, (uint8_t)(x << 4));
+  }
+}
+
+__attribute__((target("ssse3"))) static void mulAddSSSE3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t length) {
+  uint8_t lo[16], hi[16];
+  nibbleTables(c, lo, hi);
+  __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+  __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+  __m128i mask = _mm_set1_epi8(0x0F);
+
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i l = _mm_shuffle_epi8(tlo, _mm_and_si128(v, mask));
+    __m128i h = _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(v, 4), mask));
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+  }
+  mulAddTable(dst + i, src + i, c, length - i);
+}
+
+__attribute__((target("avx2"))) static void mulAddAVX2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t length) {
+  uint8_t lo[16], hi[16];
+  nibbleTables(c, lo, hi);
+  __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+  __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+  __m256i mask = _mm256_set1_epi8(0x0F);
+
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i l = _mm256_shuffle_epi8(tlo, _mm256_and_si256(v, mask));
+    __m256i h = _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+  }
+  mulAddTable(dst + i, src + i, c, length - i);
+}
+#endif
+
+void fecInit() {
+  // Powers of the generator x, doubled so a product of two logs needs no modulo
+  uint16_t value = 1;
+  for (int i = 0; i < 255; i++) {
+    gf_exp[i] = (uint8_t)value;
+    gf_log[value] = (uint8_t)i;
+    value <<= 1;
+    if (value & 0x100) value ^= GF_POLYNOMIAL;
+  }
+  for (int i = 255; i < 512; i++) {
+    gf_exp[i] = gf_exp[i - 255];
+  }
+
+  for (int a = 0; a < 256; a++) {
+    for (int b = 0; b < 256; b++) {
+      gf_mul_table[a][b] = gfMul((uint8_t)a, (uint8_t)b);
+    }
+  }
+
+  mul_add = mulAddTable;
+#ifdef GF_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    mul_add = mulAddAVX2;
+    simd = true;
+  } else if (__builtin_cpu_supports("ssse3")) {
+    mul_add = mulAddSSSE3;
+    simd = true;
+  }
+#endif
+}
+
+bool fecSimd() { return simd; }
+
+void gfMulAdd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t length) {
+  if (c == 0) return;
+  if (c == 1) {
+    for (size_t i = 0; i < length; i++) {
+      dst[i] ^= src[i];
+    }
+    return;
+  }
+  mul_add(dst, src, c, length);
+}
+
+int gfInvert(uint8_t *matrix, size_t n) {
+  uint8_t *inverse = (uint8_t *)calloc(n * n, 1);
+  if (inverse == NULL) return -1;
+  for (size_t i = 0; i < n; i++) {
+    inverse[i * n + i] = 1;
+  }
+
+  // Gauss-Jordan, addition is XOR
+  int result = 0;
+  for (size_t col = 0; col < n && result == 0; col++) {
+    size_t pivot = col;
+    while (pivot < n && matrix[pivot * n + col] == 0) pivot++;
+    if (pivot == n) {
+      result = -1;
+      break;
+    }
+    if (pivot != col) {
+      for (size_t k = 0; k < n; k++) {
+        uint8_t t = matrix[col * n + k];
+        matrix[col * n + k] = matrix[pivot * n + k];
+        matrix[pivot * n + k] = t;
+        t = inverse[col * n + k];
+        inverse[col * n + k] = inverse[pivot * n + k];
+        inverse[pivot * n + k] = t;
+      }
+    }
+
+    uint8_t scale = gfInv(matrix[col * n + col]);
+    for (size_t k = 0; k < n; k++) {
+      matrix[col * n + k] = gfMul(matrix[col * n + k], scale);
+      inverse[col * n + k] = gfMul(inverse[col * n + k], scale);
+    }
+
+    for (size_t row = 0; row < n; row++) {
+      uint8_t factor = matrix[row * n + col];
+      if (row == col || factor == 0) continue;
+      for (size_t k = 0; k < n; k++) {
+        matrix[row * n + k] ^= gfMul(factor, matrix[col * n + k]);
+        inverse[row * n + k] ^= gfMul(factor, inverse[col * n + k]);
+      }
+    }
+  }
+
+  if (result == 0) memcpy(matrix, inverse, n * n);
+  free(inverse);
+  return result;
+}
+
+uint8_t fecCoefficient(size_t k, size_t j, size_t i) {
+  uint8_t cauchy = gfInv((uint8_t)((k + j) ^ i));
+  return gfMul(cauchy, (uint8_t)(k ^ i)); // Column scale is 1 / cauchy of row 0
+}
+
+void fecEncode(size_t k, size_t m, const uint8_t *const *data, const size_t *lengths, uint8_t *const *parity, size_t length) {
+  for (size_t j = 0; j < m; j++) {
+    memset(parity[j], 0, length);
+    for (size_t i = 0; i < k; i++) {
+      gfMulAdd(parity[j], data[i], fecCoefficient(k, j, i), lengths[i] < length ? lengths[i] : length);
+    }
+  }
+}
+
+int fecDecode(size_t k, uint8_t *const *data, const size_t *lengths, const bool *present, uint8_t *const *parity, const uint8_t *rows,
+              size_t parity_count, size_t length) {
+  size_t missing[FEC_MAX_PARITY];
+  size_t e = 0;
+  for (size_t i = 0; i < k; i++) {
+    if (present[i]) continue;
+    if (e == parity_count || e == FEC_MAX_PARITY) return -1; // More erasures than parity
+    missing[e++] = i;
+  }
+  if (e == 0) return 0;
+
+  // Known data out of the parity leaves a combination of the missing packets only
+  for (size_t r = 0; r < e; r++) {
+    for (size_t i = 0; i < k; i++) {
+      if (present[i]) gfMulAdd(parity[r], data[i], fecCoefficient(k, rows[r], i), lengths[i] < length ? lengths[i] : length);
+    }
+  }
+
+  uint8_t matrix[FEC_MAX_PARITY * FEC_MAX_PARITY];
+  for (size_t r = 0; r < e; r++) {
+    for (size_t c = 0; c < e; c++) {
+      matrix[r * e + c] = fecCoefficient(k, rows[r], missing[c]);
+    }
+  }
+  if (gfInvert(matrix, e) != 0) return -1;
+
+  uint8_t *scratch = (uint8_t *)malloc(length);
+  if (scratch == NULL) return -1;
+  for (size_t c = 0; c < e; c++) {
+    memset(scratch, 0, length);
+    for (size_t r = 0; r < e; r++) {
+      gfMulAdd(scratch, parity[r], matrix[c * e + r], length);
+    }
+    memcpy(data[missing[c]], scratch, lengths[missing[c]] < length ? lengths[missing[c]] : length);
+  }
+  free(scratch);
+
+  return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define GF_POLYNOMIAL 0x11D // x^8 + x^4 + x^3 + x^2 + 1
+#define FEC_MAX_DATA 128    // Data packets per block (K)
+#define FEC_MAX_PARITY 16   // Parity packets per block (M), K + M stays within the 256 field elements
+
+void fecInit();
+bool fecSimd(); // Region multiply runs on SSSE3 or AVX2
+uint8_t gfMul(uint8_t a, uint8_t b);
+uint8_t gfInv(uint8_t a);
+void gfMulAdd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t length); // dst ^= c * src
+int gfInvert(uint8_t *matrix, size_t n);                                  // n x n in place, -1 when singular
+
+// Coefficient of data packet i in parity packet j of a k-packet block, parity 0 is a plain XOR
+uint8_t fecCoefficient(size_t k, size_t j, size_t i);
+// parity[j] = sum of coefficient * data[i] over zero-padded data, for j < m, each parity is length bytes
+void fecEncode(size_t k, size_t m, const uint8_t *const *data, const size_t *lengths, uint8_t *const *parity, size_t length);
+// Rebuilds the data packets not present from as many parity packets (rows says which), parity is overwritten
+int fecDecode(size_t k, uint8_t *const *data, const size_t *lengths, const bool *present, uint8_t *const *parity, const uint8_t *rows,
+              size_t parity_count, size_t length);
+
+#endif /* FEC_H */
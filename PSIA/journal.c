@@ -0,0 +1,158 @@
+/*
+ * Progress journal of a partial output file, written next to it when a transfer fails.
+ * Layout: magic, file size (64-bit) and chunk size (32-bit), then the bitmap, then a CRC32C per chunk, all big-endian.
+ * Chunks are a fixed size rather than DATA packets, so a resumed transfer may use another packet size.
+ */
+
+#include "journal.h"
+#include "crc32.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void putBE(uint8_t *out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out[i] = (uint8_t)(value >> (8 * (bytes - 1 - i)));
+  }
+}
+
+static uint64_t getBE(const uint8_t *in, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value = (value << 8) | in[i];
+  }
+  return value;
+}
+
+int journalInit(Journal *journal, uint64_t size) {
+  memset(journal, 0, sizeof(*journal));
+  journal->size = size;
+  journal->chunk_count = (size_t)((size + JOURNAL_CHUNK_SIZE - 1) / JOURNAL_CHUNK_SIZE);
+  journal->bitmap = (uint8_t *)calloc(journal->chunk_count / 8 + 1, 1);
+  journal->crc = (uint32_t *)calloc(journal->chunk_count + 1, sizeof(uint32_t));
+  if (journal->bitmap == NULL || journal->crc == NULL) {
+    journalFree(journal);
+    return -1;
+  }
+  return 0;
+}
+
+void journalFree(Journal *journal) {
+  free(journal->bitmap);
+  free(journal->crc);
+  journal->bitmap = NULL;
+  journal->crc = NULL;
+}
+
+int journalLoad(const char *path, uint64_t size, Journal *journal) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) return -1;
+
+  uint8_t header[JOURNAL_HEADER_SIZE];
+  bool valid = fread(header, 1, sizeof(header), file) == sizeof(header) && memcmp(header, JOURNAL_MAGIC, 4) == 0 &&
+               getBE(header + 4, 8) == size && getBE(header + 12, 4) == JOURNAL_CHUNK_SIZE;
+  if (!valid || journalInit(journal, size) != 0) {
+    fclose(file);
+    return -1;
+  }
+
+  size_t bitmap_len = (journal->chunk_count + 7) / 8;
+  valid = fread(journal->bitmap, 1, bitmap_len, file) == bitmap_len;
+  for (size_t i = 0; i < journal->chunk_count && valid; i++) {
+    uint8_t crc[4];
+    valid = fread(crc, 1, sizeof(crc), file) == sizeof(crc);
+    journal->crc[i] = (uint32_t)getBE(crc, 4);
+  }
+  fclose(file);
+
+  if (!valid) {
+    journalFree(journal);
+    return -1;
+  }
+  return 0;
+}
+
+int journalSave(const char *path, const Journal *journal) {
+  // Written aside and renamed over, a receiver killed mid-save keeps the previous journal
+  char temp[1040];
+  if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp)) return -1;
+  FILE *file = fopen(temp, "wb");
+  if (file == NULL) return -1;
+
+  uint8_t header[JOURNAL_HEADER_SIZE];
+  memcpy(header, JOURNAL_MAGIC, 4);
+  putBE(header + 4, journal->size, 8);
+  putBE(header + 12, JOURNAL_CHUNK_SIZE, 4);
+  bool written = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+
+  size_t bitmap_len = (journal->chunk_count + 7) / 8;
+  written = written && fwrite(journal->bitmap, 1, bitmap_len, file) == bitmap_len;
+  for (size_t i = 0; i < journal->chunk_count && written; i++) {
+    uint8_t crc[4];
+    putBE(crc, journal->crc[i], 4);
+    written = fwrite(crc, 1, sizeof(crc), file) == sizeof(crc);
+  }
+
+  if (fclose(file) != 0) written = false;
+#ifdef _WIN32
+  if (written) remove(path); // rename does not replace an existing file here
+#endif
+  if (written && rename(temp, path) != 0) written = false;
+  if (!written) remove(temp);
+  return written ? 0 : -1;
+}
+
+bool journalHas(const Journal *journal, size_t chunk) {
+  return chunk < journal->chunk_count && (journal->bitmap[chunk / 8] & (1 << (chunk % 8)));
+}
+
+void journalMark(Journal *journal, size_t chunk, uint32_t crc) {
+  if (chunk >= journal->chunk_count) return;
+  journal->bitmap[chunk / 8] |= 1 << (chunk % 8);
+  journal->crc[chunk] = crc;
+}
+
+void journalClear(Journal *journal, size_t chunk) {
+  if (chunk < journal->chunk_count) journal->bitmap[chunk / 8] &= (uint8_t)~(1 << (chunk % 8));
+}
+
+static size_t journalChunkLength(const Journal *journal, size_t chunk) {
+  uint64_t offset = (uint64_t)chunk * JOURNAL_CHUNK_SIZE;
+  return (size_t)(journal->size - offset < JOURNAL_CHUNK_SIZE ? journal->size - offset : JOURNAL_CHUNK_SIZE);
+}
+
+uint32_t journalChunkChecksum(const char *chunk_data, size_t length) {
+  return ~crc32Update(CHECKSUM_CRC32C, CRC32_INITIAL, (const uint8_t *)chunk_data, length);
+}
+
+uint32_t journalChecksum(const Journal *journal, const char *data, size_t chunk) {
+  return journalChunkChecksum(data + (uint64_t)chunk * JOURNAL_CHUNK_SIZE, journalChunkLength(journal, chunk));
+}
+
+bool journalCovers(const Journal *journal, uint64_t offset, size_t length) {
+  if (length == 0 || offset + length > journal->size) return false;
+  for (size_t chunk = offset / JOURNAL_CHUNK_SIZE; chunk <= (offset + length - 1) / JOURNAL_CHUNK_SIZE; chunk++) {
+    if (!journalHas(journal, chunk)) return false;
+  }
+  return true;
+}
+
+size_t journalVerify(Journal *journal, const char *data) {
+  size_t kept = 0;
+  for (size_t chunk = 0; chunk < journal->chunk_count; chunk++) {
+    if (!journalHas(journal, chunk)) continue;
+    if (journalChecksum(journal, data, chunk) == journal->crc[chunk]) {
+      kept++;
+    } else {
+      journalClear(journal, chunk);
+    }
+  }
+  return kept;
+}
+
+size_t journalEnd(const Journal *journal) {
+  for (size_t chunk = journal->chunk_count; chunk > 0; chunk--) {
+    if (journalHas(journal, chunk - 1)) return chunk;
+  }
+  return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JOURNAL_CHUNK_SIZE 65536 // Bytes per bitmap bit, independent of the packet size
+#define JOURNAL_MAGIC "PSIJ"
+#define JOURNAL_HEADER_SIZE 16 // Magic, 64-bit file size, 32-bit chunk size
+
+// Chunks of a partial output file that are in place, with the CRC32C each had when it was recorded
+typedef struct {
+  uint64_t size;
+  size_t chunk_count;
+  uint8_t *bitmap; // Bit per chunk
+  uint32_t *crc;
+} Journal;
+
+int journalInit(Journal *journal, uint64_t size); // Empty, every chunk missing
+void journalFree(Journal *journal);
+int journalLoad(const char *path, uint64_t size, Journal *journal); // -1 when missing, damaged or for another file size
+int journalSave(const char *path, const Journal *journal);
+bool journalHas(const Journal *journal, size_t chunk);
+void journalMark(Journal *journal, size_t chunk, uint32_t crc);
+void journalClear(Journal *journal, size_t chunk);
+uint32_t journalChunkChecksum(const char *chunk_data, size_t length); // CRC32C of one chunk, read from wherever it lies
+uint32_t journalChecksum(const Journal *journal, const char *data, size_t chunk); // CRC32C of the chunk in a mapped file
+bool journalCovers(const Journal *journal, uint64_t offset, size_t length);     // Every chunk under the byte range is present
+size_t journalVerify(Journal *journal, const char *data); // Drops chunks the file no longer matches, returns how many stay
+size_t journalEnd(const Journal *journal);                // One past the last present chunk, 0 when empty
+
+#endif /* JOURNAL_H */
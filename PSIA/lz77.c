@@ -0,0 +1,125 @@
+/*
+ * Byte-oriented LZ77 in the LZ4 block layout, every block decodes on its own.
+ * Sequence: token (literal count << 4 | match length - 4), count extension, literals, 16-bit little-endian offset,
+ * length extension. A nibble of 15 continues in extension bytes of 255 until a smaller one. The last sequence has
+ * literals only, the block ends after them.
+ */
+
+#include "lz77.h"
+#include <string.h>
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static size_t min15(size_t value) { return value < 15 ? value : 15; }
+
+static uint32_t lzHash(uint32_t sequence) { return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS); }
+
+static size_t putLength(uint8_t *dst, size_t out, size_t capacity, size_t length) {
+  // Rest of a count past the nibble, 0 on overflow
+  for (; length >= 255; length -= 255) {
+    if (out >= capacity) return 0;
+    dst[out++] = 255;
+  }
+  if (out >= capacity) return 0;
+  dst[out++] = (uint8_t)length;
+  return out;
+}
+
+static size_t putSequence(uint8_t *dst, size_t out, size_t capacity, const uint8_t *literals, size_t literal_count, size_t offset,
+                          size_t match_length) {
+  if (out >= capacity) return 0;
+  size_t token = out++;
+  size_t match_code = match_length >= LZ_MIN_MATCH ? match_length - LZ_MIN_MATCH : 0;
+  dst[token] = (uint8_t)((min15(literal_count) << 4) | min15(match_code));
+  if (literal_count >= 15 && (out = putLength(dst, out, capacity, literal_count - 15)) == 0) return 0;
+  if (literal_count > capacity - out) return 0;
+  memcpy(dst + out, literals, literal_count);
+  out += literal_count;
+  if (match_length == 0) return out; // Last sequence
+
+  if (capacity - out < 2) return 0;
+  dst[out++] = (uint8_t)offset;
+  dst[out++] = (uint8_t)(offset >> 8);
+  if (match_code >= 15 && (out = putLength(dst, out, capacity, match_code - 15)) == 0) return 0;
+  return out;
+}
+
+size_t lzCompress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity) {
+  if (length > LZ_MAX_INPUT) return 0;
+
+  // Last position of each 4-byte hash, plus one so 0 is empty
+  uint16_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+  size_t out = 0;
+  size_t anchor = 0;
+  size_t pos = 0;
+  while (pos + LZ_MIN_MATCH <= length) {
+    uint32_t sequence = read32(src + pos);
+    uint32_t hash = lzHash(sequence);
+    size_t candidate = table[hash];
+    table[hash] = (uint16_t)(pos + 1);
+    if (candidate == 0 || read32(src + candidate - 1) != sequence) {
+      // Runs of literals are stepped over faster, incompressible data costs little
+      pos += 1 + ((pos - anchor) >> 5);
+      continue;
+    }
+
+    size_t match = candidate - 1;
+    size_t match_length = LZ_MIN_MATCH;
+    while (pos + match_length < length && src[match + match_length] == src[pos + match_length]) match_length++;
+    out = putSequence(dst, out, capacity, src + anchor, pos - anchor, pos - match, match_length);
+    if (out == 0) return 0;
+    pos += match_length;
+    anchor = pos;
+  }
+  return putSequence(dst, out, capacity, src + anchor, length - anchor, 0, 0);
+}
+
+static int getLength(const uint8_t *src, size_t length, size_t *in, size_t *value) {
+  uint8_t byte;
+  do {
+    if (*in >= length) return -1;
+    byte = src[(*in)++];
+    *value += byte;
+  } while (byte == 255);
+  return 0;
+}
+
+int lzDecompress(const uint8_t *src, size_t length, uint8_t *dst, size_t size) {
+  size_t in = 0;
+  size_t out = 0;
+  while (in < length) {
+    uint8_t token = src[in++];
+    size_t literal_count = token >> 4;
+    if (literal_count == 15 && getLength(src, length, &in, &literal_count) != 0) return -1;
+    if (literal_count > length - in || literal_count > size - out) return -1;
+    memcpy(dst + out, src + in, literal_count);
+    in += literal_count;
+    out += literal_count;
+    if (in == length) break; // Last sequence
+
+    if (length - in < 2) return -1;
+    size_t offset = src[in] | (size_t)src[in + 1] << 8;
+    in += 2;
+    size_t match_length = token & 15;
+    if (match_length == 15 && getLength(src, length, &in, &match_length) != 0) return -1;
+    match_length += LZ_MIN_MATCH;
+    if (offset == 0 || offset > out || match_length > size - out) return -1;
+
+    // A match closer than its length overlaps the bytes it produces, those go byte by byte
+    const uint8_t *match = dst + out - offset;
+    if (offset >= match_length) {
+      memcpy(dst + out, match, match_length);
+    } else {
+      for (size_t i = 0; i < match_length; i++) {
+        dst[out + i] = match[i];
+      }
+    }
+    out += match_length;
+  }
+  return out == size ? 0 : -1;
+}
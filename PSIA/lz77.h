@@ -0,0 +1,16 @@
+#ifndef LZ77_H
+#define LZ77_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_INPUT 65535 // Offsets are 16-bit, a DATA payload always fits
+
+// Compressed size of a block, 0 when it doesn't fit in capacity, so capacity below length means it must shrink
+size_t lzCompress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity);
+// Exactly size bytes from one compressed block, -1 on a damaged block
+int lzDecompress(const uint8_t *src, size_t length, uint8_t *dst, size_t size);
+
+#endif /* LZ77_H */
@@ -1,6 +1,6 @@
 /*
  * Derived from the RSA Data Security, Inc. MD5 Message-Digest Algorithm
- * and modified slightly to be functionally identical but condensed into control structures.
+ * and modified slightly to be functionally identical, with the rounds unrolled.
  */
 
 #include "md5.h"
@@ -13,28 +13,6 @@
 #define C 0x98badcfe
 #define D 0x10325476
 
-static uint32_t S[] = {7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
-                       5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
-                       4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
-                       6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
-
-static uint32_t K[] = {0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
-                       0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
-                       0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
-                       0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
-                       0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
-                       0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
-                       0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
-                       0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
-                       0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
-                       0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
-                       0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
-                       0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
-                       0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
-                       0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
-                       0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
-                       0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
-
 /*
  * Padding used to make the size (in bits) of the input congruent to 448 mod 512
  */
@@ -48,20 +26,40 @@ static uint8_t PADDING[] = {0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
                             0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 
 /*
- * Bit-manipulation functions defined by the MD5 algorithm
+ * Bit-manipulation functions defined by the MD5 algorithm, F and G rewritten with one operation less
  */
-#define F(X, Y, Z) ((X & Y) | (~X & Z))
-#define G(X, Y, Z) ((X & Z) | (Y & ~Z))
+#define F(X, Y, Z) (Z ^ (X & (Y ^ Z)))
+#define G(X, Y, Z) (Y ^ (Z & (X ^ Y)))
 #define H(X, Y, Z) (X ^ Y ^ Z)
 #define I(X, Y, Z) (Y ^ (X | ~Z))
 
+/*
+ * One of the 64 operations: a = b + ((a + f(b, c, d) + x + k) <<< s)
+ */
+#define STEP(f, a, b, c, d, x, k, s) \
+    a += f(b, c, d) + x + k; \
+    a = rotateLeft(a, s) + b
+
 /*
  * Rotates a 32-bit word left by n bits
  */
-uint32_t rotateLeft(uint32_t x, uint32_t n){
+static uint32_t rotateLeft(uint32_t x, uint32_t n){
     return (x << n) | (x >> (32 - n));
 }
 
+/*
+ * Reads a little-endian 32-bit word from anywhere in a buffer
+ */
+static uint32_t load32(const uint8_t *p){
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+#else
+    return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | (uint32_t)p[0];
+#endif
+}
+
 
 /*
  * Initialize a context
@@ -75,39 +73,44 @@ void md5Init(MD5Context *ctx){
     ctx->buffer[3] = (uint32_t)D;
 }
 
+/*
+ * Step on every 64-byte block of data, read in place
+ */
+static void md5Blocks(uint32_t *buffer, const uint8_t *data, size_t blocks){
+    uint32_t input[16];
+
+    for(size_t i = 0; i < blocks; ++i){
+        for(unsigned int j = 0; j < 16; ++j){
+            input[j] = load32(data + (i * 64) + (j * 4));
+        }
+        md5Step(buffer, input);
+    }
+}
+
 /*
  * Add some amount of input to the context
  *
- * If the input fills out a block of 512 bits, apply the algorithm (md5Step)
- * and save the result in the buffer. Also updates the overall size.
+ * Whole 512-bit blocks are hashed straight from input_buffer, only a partial block
+ * is kept in the context until the next call fills it. Also updates the overall size.
  */
 void md5Update(MD5Context *ctx, uint8_t *input_buffer, size_t input_len){
-    uint32_t input[16];
     unsigned int offset = ctx->size % 64;
     ctx->size += (uint64_t)input_len;
 
-    // Copy each byte in input_buffer into the next space in our context input
-    for(unsigned int i = 0; i < input_len; ++i){
-        ctx->input[offset++] = (uint8_t)*(input_buffer + i);
-
-        // If we've filled our context input, copy it into our local array input
-        // then reset the offset to 0 and fill in a new buffer.
-        // Every time we fill out a chunk, we run it through the algorithm
-        // to enable some back and forth between cpu and i/o
-        if(offset % 64 == 0){
-            for(unsigned int j = 0; j < 16; ++j){
-                // Convert to little-endian
-                // The local variable `input` our 512-bit chunk separated into 32-bit words
-                // we can use in calculations
-                input[j] = (uint32_t)(ctx->input[(j * 4) + 3]) << 24 |
-                           (uint32_t)(ctx->input[(j * 4) + 2]) << 16 |
-                           (uint32_t)(ctx->input[(j * 4) + 1]) <<  8 |
-                           (uint32_t)(ctx->input[(j * 4)]);
-            }
-            md5Step(ctx->buffer, input);
-            offset = 0;
+    // Top up the block left over from the last call first
+    if(offset > 0){
+        size_t fill = 64 - offset < input_len ? 64 - offset : input_len;
+        memcpy(ctx->input + offset, input_buffer, fill);
+        input_buffer += fill;
+        input_len -= fill;
+        if(offset + fill < 64){
+            return;
         }
+        md5Blocks(ctx->buffer, ctx->input, 1);
     }
+
+    md5Blocks(ctx->buffer, input_buffer, input_len / 64);
+    memcpy(ctx->input, input_buffer + (input_len / 64) * 64, input_len % 64);
 }
 
 /*
@@ -126,10 +129,7 @@ void md5Finalize(MD5Context *ctx){
     // Do a final update (internal to this function)
     // Last two 32-bit words are the two halves of the size (converted from bytes to bits)
     for(unsigned int j = 0; j < 14; ++j){
-        input[j] = (uint32_t)(ctx->input[(j * 4) + 3]) << 24 |
-                   (uint32_t)(ctx->input[(j * 4) + 2]) << 16 |
-                   (uint32_t)(ctx->input[(j * 4) + 1]) <<  8 |
-                   (uint32_t)(ctx->input[(j * 4)]);
+        input[j] = load32(ctx->input + (j * 4));
     }
     input[14] = (uint32_t)(ctx->size * 8);
     input[15] = (uint32_t)((ctx->size * 8) >> 32);
@@ -147,43 +147,88 @@ void md5Finalize(MD5Context *ctx){
 
 /*
  * Step on 512 bits of input with the main MD5 algorithm.
+ *
+ * Fully unrolled, round by round, with the word order, shifts and constants
+ * of every operation as RFC 1321 lists them.
  */
 void md5Step(uint32_t *buffer, uint32_t *input){
     uint32_t AA = buffer[0];
     uint32_t BB = buffer[1];
     uint32_t CC = buffer[2];
     uint32_t DD = buffer[3];
-
-    uint32_t E;
-
-    unsigned int j;
-
-    for(unsigned int i = 0; i < 64; ++i){
-        switch(i / 16){
-            case 0:
-                E = F(BB, CC, DD);
-                j = i;
-                break;
-            case 1:
-                E = G(BB, CC, DD);
-                j = ((i * 5) + 1) % 16;
-                break;
-            case 2:
-                E = H(BB, CC, DD);
-                j = ((i * 3) + 5) % 16;
-                break;
-            default:
-                E = I(BB, CC, DD);
-                j = (i * 7) % 16;
-                break;
-        }
-
-        uint32_t temp = DD;
-        DD = CC;
-        CC = BB;
-        BB = BB + rotateLeft(AA + E + K[i] + input[j], S[i]);
-        AA = temp;
-    }
+    const uint32_t *x = input;
+
+    // Round 1, words in order
+    STEP(F, AA, BB, CC, DD, x[ 0], 0xd76aa478,  7);
+    STEP(F, DD, AA, BB, CC, x[ 1], 0xe8c7b756, 12);
+    STEP(F, CC, DD, AA, BB, x[ 2], 0x242070db, 17);
+    STEP(F, BB, CC, DD, AA, x[ 3], 0xc1bdceee, 22);
+    STEP(F, AA, BB, CC, DD, x[ 4], 0xf57c0faf,  7);
+    STEP(F, DD, AA, BB, CC, x[ 5], 0x4787c62a, 12);
+    STEP(F, CC, DD, AA, BB, x[ 6], 0xa8304613, 17);
+    STEP(F, BB, CC, DD, AA, x[ 7], 0xfd469501, 22);
+    STEP(F, AA, BB, CC, DD, x[ 8], 0x698098d8,  7);
+    STEP(F, DD, AA, BB, CC, x[ 9], 0x8b44f7af, 12);
+    STEP(F, CC, DD, AA, BB, x[10], 0xffff5bb1, 17);
+    STEP(F, BB, CC, DD, AA, x[11], 0x895cd7be, 22);
+    STEP(F, AA, BB, CC, DD, x[12], 0x6b901122,  7);
+    STEP(F, DD, AA, BB, CC, x[13], 0xfd987193, 12);
+    STEP(F, CC, DD, AA, BB, x[14], 0xa679438e, 17);
+    STEP(F, BB, CC, DD, AA, x[15], 0x49b40821, 22);
+
+    // Round 2, word (5i + 1) % 16
+    STEP(G, AA, BB, CC, DD, x[ 1], 0xf61e2562,  5);
+    STEP(G, DD, AA, BB, CC, x[ 6], 0xc040b340,  9);
+    STEP(G, CC, DD, AA, BB, x[11], 0x265e5a51, 14);
+    STEP(G, BB, CC, DD, AA, x[ 0], 0xe9b6c7aa, 20);
+    STEP(G, AA, BB, CC, DD, x[ 5], 0xd62f105d,  5);
+    STEP(G, DD, AA, BB, CC, x[10], 0x02441453,  9);
+    STEP(G, CC, DD, AA, BB, x[15], 0xd8a1e681, 14);
+    STEP(G, BB, CC, DD, AA, x[ 4], 0xe7d3fbc8, 20);
+    STEP(G, AA, BB, CC, DD, x[ 9], 0x21e1cde6,  5);
+    STEP(G, DD, AA, BB, CC, x[14], 0xc33707d6,  9);
+    STEP(G, CC, DD, AA, BB, x[ 3], 0xf4d50d87, 14);
+    STEP(G, BB, CC, DD, AA, x[ 8], 0x455a14ed, 20);
+    STEP(G, AA, BB, CC, DD, x[13], 0xa9e3e905,  5);
+    STEP(G, DD, AA, BB, CC, x[ 2], 0xfcefa3f8,  9);
+    STEP(G, CC, DD, AA, BB, x[ 7], 0x676f02d9, 14);
+    STEP(G, BB, CC, DD, AA, x[12], 0x8d2a4c8a, 20);
+
+    // Round 3, word (3i + 5) % 16
+    STEP(H, AA, BB, CC, DD, x[ 5], 0xfffa3942,  4);
+    STEP(H, DD, AA, BB, CC, x[ 8], 0x8771f681, 11);
+    STEP(H, CC, DD, AA, BB, x[11], 0x6d9d6122, 16);
+    STEP(H, BB, CC, DD, AA, x[14], 0xfde5380c, 23);
+    STEP(H, AA, BB, CC, DD, x[ 1], 0xa4beea44,  4);
+    STEP(H, DD, AA, BB, CC, x[ 4], 0x4bdecfa9, 11);
+    STEP(H, CC, DD, AA, BB, x[ 7], 0xf6bb4b60, 16);
+    STEP(H, BB, CC, DD, AA, x[10], 0xbebfbc70, 23);
+    STEP(H, AA, BB, CC, DD, x[13], 0x289b7ec6,  4);
+    STEP(H, DD, AA, BB, CC, x[ 0], 0xeaa127fa, 11);
+    STEP(H, CC, DD, AA, BB, x[ 3], 0xd4ef3085, 16);
+    STEP(H, BB, CC, DD, AA, x[ 6], 0x04881d05, 23);
+    STEP(H, AA, BB, CC, DD, x[ 9], 0xd9d4d039,  4);
+    STEP(H, DD, AA, BB, CC, x[12], 0xe6db99e5, 11);
+    STEP(H, CC, DD, AA, BB, x[15], 0x1fa27cf8, 16);
+    STEP(H, BB, CC, DD, AA, x[ 2], 0xc4ac5665, 23);
+
+    // Round 4, word 7i % 16
+    STEP(I, AA, BB, CC, DD, x[ 0], 0xf4292244,  6);
+    STEP(I, DD, AA, BB, CC, x[ 7], 0x432aff97, 10);
+    STEP(I, CC, DD, AA, BB, x[14], 0xab9423a7, 15);
+    STEP(I, BB, CC, DD, AA, x[ 5], 0xfc93a039, 21);
+    STEP(I, AA, BB, CC, DD, x[12], 0x655b59c3,  6);
+    STEP(I, DD, AA, BB, CC, x[ 3], 0x8f0ccc92, 10);
+    STEP(I, CC, DD, AA, BB, x[10], 0xffeff47d, 15);
+    STEP(I, BB, CC, DD, AA, x[ 1], 0x85845dd1, 21);
+    STEP(I, AA, BB, CC, DD, x[ 8], 0x6fa87e4f,  6);
+    STEP(I, DD, AA, BB, CC, x[15], 0xfe2ce6e0, 10);
+    STEP(I, CC, DD, AA, BB, x[ 6], 0xa3014314, 15);
+    STEP(I, BB, CC, DD, AA, x[13], 0x4e0811a1, 21);
+    STEP(I, AA, BB, CC, DD, x[ 4], 0xf7537e82,  6);
+    STEP(I, DD, AA, BB, CC, x[11], 0xbd3af235, 10);
+    STEP(I, CC, DD, AA, BB, x[ 2], 0x2ad7d2bb, 15);
+    STEP(I, BB, CC, DD, AA, x[ 9], 0xeb86d391, 21);
 
     buffer[0] += AA;
     buffer[1] += BB;
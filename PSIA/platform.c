@@ -0,0 +1,1131 @@
+#ifndef _WIN32
+#define _GNU_SOURCE // sendmmsg, recvmmsg, copy_file_range
+#endif
+
+#include "platform.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+int netInit() {
+  WSADATA wsaData;
+  if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) return -1;
+  return 0;
+}
+
+void netCleanup() { WSACleanup(); }
+
+int netParseAddress(const char *ip, uint16_t port, struct sockaddr_in *addr) {
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(port);
+  return InetPton(AF_INET, ip, &addr->sin_addr.s_addr) == 1 ? 0 : -1;
+}
+
+int socketClose(socket_t socket) { return closesocket(socket); }
+
+int socketSetNonBlocking(socket_t socket, bool enabled) {
+  u_long mode = enabled ? 1 : 0;
+  return ioctlsocket(socket, FIONBIO, &mode) == 0 ? 0 : -1;
+}
+
+int socketSetRecvTimeout(socket_t socket, uint32_t timeout_ms) {
+  DWORD timeout = timeout_ms; // Winsock takes plain milliseconds, not a timeval
+  return setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof timeout) == 0 ? 0 : -1;
+}
+
+int socketWaitReadable(socket_t socket, int timeout_ms) {
+  fd_set readfds;
+  FD_ZERO(&readfds);
+  FD_SET(socket, &readfds);
+  struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+  int r = select(0, &readfds, NULL, NULL, timeout_ms < 0 ? NULL : &tv);
+  return r == SOCKET_ERROR ? -1 : (r > 0);
+}
+
+bool socketWouldBlock() { return WSAGetLastError() == WSAEWOULDBLOCK; }
+
+static void socketWaitWritable(socket_t socket) {
+  fd_set writefds;
+  FD_ZERO(&writefds);
+  FD_SET(socket, &writefds);
+  select(0, NULL, &writefds, NULL, NULL);
+}
+
+int socketSendBatch(socket_t socket, NetMsg *msgs, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    WSABUF bufs[NET_MSG_MAX_BUFS];
+    for (size_t b = 0; b < msgs[i].buf_count; b++) {
+      bufs[b].buf = (char *)msgs[i].bufs[b].base;
+      bufs[b].len = (ULONG)msgs[i].bufs[b].len;
+    }
+    DWORD sent;
+    if (WSASendTo(socket, bufs, (DWORD)msgs[i].buf_count, &sent, 0, (const struct sockaddr *)&msgs[i].addr,
+                  sizeof(msgs[i].addr), NULL, NULL) == SOCKET_ERROR) {
+      if (!socketWouldBlock()) return -1;
+      socketWaitWritable(socket);
+      i--;
+    }
+  }
+  return 0;
+}
+
+int socketSendSegments(socket_t socket, NetMsg *msgs, size_t count, size_t segment_size) {
+  (void)segment_size; // No segmentation offload through Winsock, datagrams go one by one
+  return socketSendBatch(socket, msgs, count);
+}
+
+// Socket has to be in non-blocking mode, Winsock has no per-call flag for it
+int socketRecvBatch(socket_t socket, NetMsg *msgs, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    int fromlen = sizeof(msgs[i].addr);
+    int r = recvfrom(socket, (char *)msgs[i].bufs[0].base, (int)msgs[i].bufs[0].len, 0, (struct sockaddr *)&msgs[i].addr,
+                     &fromlen);
+    if (r == SOCKET_ERROR) {
+      if (socketWouldBlock() || WSAGetLastError() == WSAECONNRESET) return (int)i;
+      return i > 0 ? (int)i : -1;
+    }
+    msgs[i].length = (size_t)r;
+  }
+  return (int)count;
+}
+
+
+int uringInit(Uring *ring, socket_t socket, NetMsg *msgs, size_t count) {
+  (void)socket; // io_uring is Linux only
+  (void)msgs;
+  (void)count;
+  ring->fd = -1;
+  ring->state = NULL;
+  return -1;
+}
+
+void uringFree(Uring *ring) { (void)ring; }
+
+int uringSend(Uring *ring, NetMsg *msgs, size_t count, size_t segment_size) {
+  (void)ring;
+  (void)msgs;
+  (void)count;
+  (void)segment_size;
+  return -1;
+}
+
+int uringWait(Uring *ring, int timeout_ms, size_t *ready) {
+  (void)ring;
+  (void)timeout_ms;
+  (void)ready;
+  return -1;
+}
+
+int socketSetDontFragment(socket_t socket, bool enabled) {
+  DWORD value = enabled ? 1 : 0;
+  return setsockopt(socket, IPPROTO_IP, IP_DONTFRAGMENT, (const char *)&value, sizeof value) == 0 ? 0 : -1;
+}
+
+socket_t socketConnectUnix(const char *path) {
+  (void)path; // Not every Winsock has AF_UNIX
+  return SOCKET_INVALID;
+}
+
+int socketSetPacingRate(socket_t socket, uint64_t bytes_per_s) {
+  (void)socket;
+  (void)bytes_per_s;
+  return -1;
+}
+
+int socketSetBufferSize(socket_t socket, int bytes) {
+  int r = setsockopt(socket, SOL_SOCKET, SO_RCVBUF, (const char *)&bytes, sizeof bytes);
+  r |= setsockopt(socket, SOL_SOCKET, SO_SNDBUF, (const char *)&bytes, sizeof bytes);
+  return r == 0 ? 0 : -1;
+}
+
+uint64_t timeNowUs() {
+  static LARGE_INTEGER frequency;
+  if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return (uint64_t)(now.QuadPart / frequency.QuadPart) * 1000000 + (uint64_t)(now.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+uint64_t processCpuUs() {
+  // FILETIMEs count 100ns units
+  FILETIME created, exited, kernel, user;
+  if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) return 0;
+  uint64_t kernel_units = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+  uint64_t user_units = ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+  return (kernel_units + user_units) / 10;
+}
+
+// CreateThread wants its own signature
+typedef struct {
+  void (*fn)(void *arg);
+  void *arg;
+} ThreadStart;
+
+static DWORD WINAPI threadTrampoline(LPVOID param) {
+  ThreadStart start = *(ThreadStart *)param;
+  free(param);
+  start.fn(start.arg);
+  return 0;
+}
+
+int threadCreate(thread_t *thread, void (*fn)(void *arg), void *arg) {
+  ThreadStart *start = (ThreadStart *)malloc(sizeof(ThreadStart));
+  if (start == NULL) return -1;
+  start->fn = fn;
+  start->arg = arg;
+  *thread = CreateThread(NULL, 0, threadTrampoline, start, 0, NULL);
+  if (*thread == NULL) {
+    free(start);
+    return -1;
+  }
+  return 0;
+}
+
+int threadJoin(thread_t thread) {
+  DWORD r = WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+  return r == WAIT_OBJECT_0 ? 0 : -1;
+}
+
+void progressInit(Progress *progress) {
+  InitializeSRWLock(&progress->lock);
+  InitializeConditionVariable(&progress->changed);
+  progress->value = 0;
+  progress->closed = false;
+}
+
+void progressDestroy(Progress *progress) { (void)progress; }
+
+void progressSet(Progress *progress, uint64_t value) {
+  AcquireSRWLockExclusive(&progress->lock);
+  if (value > progress->value) progress->value = value;
+  ReleaseSRWLockExclusive(&progress->lock);
+  WakeAllConditionVariable(&progress->changed);
+}
+
+void progressClose(Progress *progress) {
+  AcquireSRWLockExclusive(&progress->lock);
+  progress->closed = true;
+  ReleaseSRWLockExclusive(&progress->lock);
+  WakeAllConditionVariable(&progress->changed);
+}
+
+uint64_t progressGet(Progress *progress) {
+  AcquireSRWLockShared(&progress->lock);
+  uint64_t value = progress->value;
+  ReleaseSRWLockShared(&progress->lock);
+  return value;
+}
+
+uint64_t progressWait(Progress *progress, uint64_t seen) {
+  AcquireSRWLockExclusive(&progress->lock);
+  while (progress->value <= seen && !progress->closed) {
+    SleepConditionVariableSRW(&progress->changed, &progress->lock, INFINITE, 0);
+  }
+  uint64_t value = progress->value;
+  ReleaseSRWLockExclusive(&progress->lock);
+  return value;
+}
+
+bool progressWaitClosed(Progress *progress, uint32_t timeout_ms) {
+  ULONGLONG deadline = GetTickCount64() + timeout_ms;
+  AcquireSRWLockExclusive(&progress->lock);
+  while (!progress->closed) {
+    ULONGLONG now = GetTickCount64();
+    if (now >= deadline) break;
+    SleepConditionVariableSRW(&progress->changed, &progress->lock, (DWORD)(deadline - now), 0);
+  }
+  bool closed = progress->closed;
+  ReleaseSRWLockExclusive(&progress->lock);
+  return closed;
+}
+
+int fileMapRead(const char *path, FileMap *map) {
+  memset(map, 0, sizeof(*map));
+  map->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (map->file == INVALID_HANDLE_VALUE) return -1;
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(map->file, &size)) {
+    CloseHandle(map->file);
+    return -1;
+  }
+  map->size = (size_t)size.QuadPart;
+  if (map->size == 0) return 0; // Empty file can't be mapped
+
+  map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (map->mapping != NULL) map->data = (char *)MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+  if (map->data == NULL) {
+    fileUnmap(map, false);
+    return -1;
+  }
+  return 0;
+}
+
+int fileMapCreate(const char *path, size_t size, bool keep, FileMap *map) {
+  memset(map, 0, sizeof(*map));
+  map->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, keep ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (map->file == INVALID_HANDLE_VALUE) return -1;
+  map->size = size;
+  if (size == 0) return 0;
+
+  // Mapping extends the file to its size
+  map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+  if (map->mapping != NULL) map->data = (char *)MapViewOfFile(map->mapping, FILE_MAP_WRITE, 0, 0, 0);
+  if (map->data == NULL) {
+    fileUnmap(map, false);
+    return -1;
+  }
+  return 0;
+}
+
+int fileUnmap(FileMap *map, bool flush) {
+  int r = 0;
+  if (map->data != NULL) {
+    if (flush && !FlushViewOfFile(map->data, 0)) r = -1;
+    UnmapViewOfFile(map->data);
+  }
+  if (map->mapping != NULL) CloseHandle(map->mapping);
+  if (map->file != NULL && map->file != INVALID_HANDLE_VALUE) CloseHandle(map->file);
+  memset(map, 0, sizeof(*map));
+  return r;
+}
+
+int fileFlush(const FileMap *map, uint64_t offset, uint64_t length) {
+  if (map->data == NULL || length == 0) return 0;
+  return FlushViewOfFile(map->data + offset, (SIZE_T)length) ? 0 : -1;
+}
+
+int fileCopyRange(const FileMap *source, uint64_t offset, uint64_t size, const char *path) {
+  FileMap out;
+  if (fileMapCreate(path, (size_t)size, false, &out) != 0) return -1;
+  if (size > 0) memcpy(out.data, source->data + offset, (size_t)size);
+  return fileUnmap(&out, true);
+}
+
+PathType pathType(const char *path) {
+  DWORD attributes = GetFileAttributesA(path);
+  if (attributes == INVALID_FILE_ATTRIBUTES) return PATH_MISSING;
+  return (attributes & FILE_ATTRIBUTE_DIRECTORY) ? PATH_DIRECTORY : PATH_FILE;
+}
+
+int dirCreate(const char *path) {
+  if (CreateDirectoryA(path, NULL)) return 0;
+  return (GetLastError() == ERROR_ALREADY_EXISTS && pathType(path) == PATH_DIRECTORY) ? 0 : -1;
+}
+
+int dirOpen(const char *path, DirReader *reader) {
+  char pattern[MAX_PATH];
+  if (snprintf(pattern, sizeof(pattern), "%s\\*", path) >= (int)sizeof(pattern)) return -1;
+  reader->find = FindFirstFileA(pattern, &reader->entry);
+  if (reader->find == INVALID_HANDLE_VALUE) return -1;
+  reader->pending = true;
+  return 0;
+}
+
+const char *dirNext(DirReader *reader) {
+  // FindFirstFileA already returned the first entry
+  while (reader->pending || FindNextFileA(reader->find, &reader->entry)) {
+    reader->pending = false;
+    const char *name = reader->entry.cFileName;
+    if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) return name;
+  }
+  return NULL;
+}
+
+void dirClose(DirReader *reader) {
+  if (reader->find != INVALID_HANDLE_VALUE) FindClose(reader->find);
+  reader->find = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef PLATFORM_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+int netInit() { return 0; }
+
+void netCleanup() {}
+
+int netParseAddress(const char *ip, uint16_t port, struct sockaddr_in *addr) {
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(port);
+  return inet_pton(AF_INET, ip, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+int socketClose(socket_t socket) { return close(socket); }
+
+int socketSetNonBlocking(socket_t socket, bool enabled) {
+  int flags = fcntl(socket, F_GETFL, 0);
+  if (flags == -1) return -1;
+  flags = enabled ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+  return fcntl(socket, F_SETFL, flags) == 0 ? 0 : -1;
+}
+
+int socketSetRecvTimeout(socket_t socket, uint32_t timeout_ms) {
+  struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+  return setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) == 0 ? 0 : -1;
+}
+
+int socketWaitReadable(socket_t socket, int timeout_ms) {
+  struct pollfd pfd = {socket, POLLIN, 0};
+  int r;
+  do {
+    r = poll(&pfd, 1, timeout_ms);
+  } while (r == -1 && errno == EINTR);
+  return r < 0 ? -1 : (r > 0);
+}
+
+bool socketWouldBlock() { return errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR; }
+
+static void socketWaitWritable(socket_t socket) {
+  struct pollfd pfd = {socket, POLLOUT, 0};
+  poll(&pfd, 1, -1);
+}
+
+static void toMsghdr(NetMsg *msg, struct msghdr *hdr, struct iovec *iov) {
+  for (size_t b = 0; b < msg->buf_count; b++) {
+    iov[b].iov_base = msg->bufs[b].base;
+    iov[b].iov_len = msg->bufs[b].len;
+  }
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->msg_name = &msg->addr;
+  hdr->msg_namelen = sizeof(msg->addr);
+  hdr->msg_iov = iov;
+  hdr->msg_iovlen = msg->buf_count;
+}
+
+#ifdef __linux__
+
+int socketSendBatch(socket_t socket, NetMsg *msgs, size_t count) {
+  struct mmsghdr hdrs[NET_BATCH_MAX];
+  struct iovec iov[NET_BATCH_MAX][NET_MSG_MAX_BUFS];
+
+  size_t done = 0;
+  while (done < count) {
+    size_t n = count - done < NET_BATCH_MAX ? count - done : NET_BATCH_MAX;
+    for (size_t i = 0; i < n; i++) {
+      toMsghdr(&msgs[done + i], &hdrs[i].msg_hdr, iov[i]);
+    }
+
+    int r = sendmmsg(socket, hdrs, n, 0);
+    if (r < 0) {
+      if (!socketWouldBlock()) return -1;
+      socketWaitWritable(socket); // Full send buffer on a non-blocking socket
+      continue;
+    }
+    done += (size_t)r;
+  }
+  return 0;
+}
+
+// Control message room for one UDP_SEGMENT size
+typedef union {
+  char buf[CMSG_SPACE(sizeof(uint16_t))];
+  size_t align; // cmsghdr starts with a size_t
+} SegmentControl;
+
+// Consecutive full-size datagrams to one address become one message, only the last of a run may be shorter.
+// first[i] is the datagram message i starts with, first[n] one past the last one taken. segment_size 0 keeps them apart
+static size_t buildSegments(NetMsg *msgs, size_t count, size_t segment_size, struct mmsghdr *hdrs, struct iovec *iov, size_t iov_max,
+                            SegmentControl *control, size_t *first) {
+  size_t n = 0, iov_len = 0, next = 0;
+  while (next < count && n < NET_BATCH_MAX && iov_len + msgs[next].buf_count <= iov_max) {
+    first[n] = next;
+    struct msghdr *hdr = &hdrs[n].msg_hdr;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_name = &msgs[next].addr;
+    hdr->msg_namelen = sizeof(msgs[next].addr);
+    hdr->msg_iov = &iov[iov_len];
+
+    size_t segments = 0, bytes = 0;
+    while (next < count && segments < NET_GSO_MAX_SEGMENTS && iov_len + msgs[next].buf_count <= iov_max) {
+      size_t length = 0;
+      for (size_t b = 0; b < msgs[next].buf_count; b++) {
+        length += msgs[next].bufs[b].len;
+      }
+      bool same_peer = memcmp(&msgs[next].addr, &msgs[first[n]].addr, sizeof(msgs[next].addr)) == 0;
+      if (segments > 0 && (!same_peer || length > segment_size || bytes + length > NET_GSO_MAX_BYTES)) break;
+
+      for (size_t b = 0; b < msgs[next].buf_count; b++) {
+        iov[iov_len].iov_base = msgs[next].bufs[b].base;
+        iov[iov_len++].iov_len = msgs[next].bufs[b].len;
+      }
+      hdr->msg_iovlen += msgs[next].buf_count;
+      segments++;
+      bytes += length;
+      next++;
+      if (length != segment_size) break;
+    }
+
+#ifdef UDP_SEGMENT
+    // Kernel splits the buffer into segment_size datagrams
+    if (segments > 1) {
+      hdr->msg_control = control[n].buf;
+      hdr->msg_controllen = sizeof(control[n].buf);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      uint16_t size = (uint16_t)segment_size;
+      memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+    }
+#else
+    (void)control;
+#endif
+    n++;
+  }
+  first[n] = next;
+  return n;
+}
+
+#ifdef UDP_SEGMENT
+
+int socketSendSegments(socket_t socket, NetMsg *msgs, size_t count, size_t segment_size) {
+  struct mmsghdr hdrs[NET_BATCH_MAX];
+  struct iovec iov[NET_BATCH_MAX * NET_MSG_MAX_BUFS];
+  SegmentControl control[NET_BATCH_MAX];
+  size_t first[NET_BATCH_MAX + 1];
+
+  size_t done = 0;
+  while (done < count) {
+    size_t n = buildSegments(msgs + done, count - done, segment_size, hdrs, iov, sizeof(iov) / sizeof(iov[0]), control, first);
+    int r = sendmmsg(socket, hdrs, n, 0);
+    if (r < 0) {
+      if (!socketWouldBlock()) return -1;
+      socketWaitWritable(socket); // Full send buffer on a non-blocking socket
+      continue;
+    }
+    done += first[r];
+  }
+  return 0;
+}
+
+#else
+
+int socketSendSegments(socket_t socket, NetMsg *msgs, size_t count, size_t segment_size) {
+  (void)segment_size; // Kernel headers without UDP_SEGMENT
+  return socketSendBatch(socket, msgs, count);
+}
+
+#endif
+
+int socketRecvBatch(socket_t socket, NetMsg *msgs, size_t count) {
+  struct mmsghdr hdrs[NET_BATCH_MAX];
+  struct iovec iov[NET_BATCH_MAX][NET_MSG_MAX_BUFS];
+
+  size_t n = count < NET_BATCH_MAX ? count : NET_BATCH_MAX;
+  for (size_t i = 0; i < n; i++) {
+    toMsghdr(&msgs[i], &hdrs[i].msg_hdr, iov[i]);
+  }
+
+  int r = recvmmsg(socket, hdrs, n, MSG_DONTWAIT, NULL);
+  if (r < 0) return (socketWouldBlock() || errno == ECONNREFUSED) ? 0 : -1;
+
+  for (int i = 0; i < r; i++) {
+    msgs[i].length = hdrs[i].msg_len;
+  }
+  return r;
+}
+
+#else
+
+int socketSendBatch(socket_t socket, NetMsg *msgs, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    struct msghdr hdr;
+    struct iovec iov[NET_MSG_MAX_BUFS];
+    toMsghdr(&msgs[i], &hdr, iov);
+    if (sendmsg(socket, &hdr, 0) < 0) {
+      if (!socketWouldBlock()) return -1;
+      socketWaitWritable(socket);
+      i--;
+    }
+  }
+  return 0;
+}
+
+int socketSendSegments(socket_t socket, NetMsg *msgs, size_t count, size_t segment_size) {
+  (void)segment_size; // Segmentation offload is Linux only
+  return socketSendBatch(socket, msgs, count);
+}
+
+int socketRecvBatch(socket_t socket, NetMsg *msgs, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    struct msghdr hdr;
+    struct iovec iov[NET_MSG_MAX_BUFS];
+    toMsghdr(&msgs[i], &hdr, iov);
+    ssize_t r = recvmsg(socket, &hdr, MSG_DONTWAIT);
+    if (r < 0) return (i > 0 || socketWouldBlock() || errno == ECONNREFUSED) ? (int)i : -1;
+    msgs[i].length = (size_t)r;
+  }
+  return (int)count;
+}
+
+#endif
+
+#ifdef PLATFORM_URING
+
+#define URING_SEND_TAG (1ull << 63)   // user_data of sends, receives carry their index alone
+#define URING_CANCEL_TAG (1ull << 62) // user_data of the cancellation on teardown
+
+struct UringState {
+  socket_t socket;
+  void *rings; // Submission and completion rings share one mapping
+  size_t rings_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+  unsigned *cq_head, *cq_tail, cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned sq_local; // Tail of the entries queued but not yet handed to the kernel
+
+  NetMsg *recv_msgs;
+  size_t recv_count;
+  size_t posted; // Receives the kernel holds
+  struct msghdr recv_hdrs[NET_BATCH_MAX];
+  struct iovec recv_iov[NET_BATCH_MAX][NET_MSG_MAX_BUFS];
+  size_t ready[NET_BATCH_MAX]; // Completed, not handed out yet
+  size_t ready_count;
+  size_t idle[NET_BATCH_MAX]; // Handed out or failed, posted again by the next wait
+  size_t idle_count;
+
+  struct mmsghdr send_hdrs[NET_BATCH_MAX];
+  struct iovec send_iov[NET_BATCH_MAX * NET_MSG_MAX_BUFS];
+  SegmentControl send_control[NET_BATCH_MAX];
+  int send_results[NET_BATCH_MAX];
+  size_t sends_pending;
+};
+
+static int uringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static struct io_uring_sqe *uringQueue(struct UringState *state, uint8_t opcode, void *addr, uint64_t user_data) {
+  // Never full in practice, every send waits for its completion and receives are bounded
+  if (state->sq_local - __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE) >= state->sq_entries) return NULL;
+  unsigned index = state->sq_local & state->sq_mask;
+  struct io_uring_sqe *sqe = &state->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = 0; // The socket, registered as fixed file 0
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->addr = (uint64_t)(uintptr_t)addr;
+  sqe->len = 1;
+  sqe->user_data = user_data;
+  state->sq_array[index] = index;
+  state->sq_local++;
+  return sqe;
+}
+
+static unsigned uringPublish(struct UringState *state) {
+  unsigned to_submit = state->sq_local - *state->sq_tail;
+  __atomic_store_n(state->sq_tail, state->sq_local, __ATOMIC_RELEASE);
+  return to_submit;
+}
+
+static void uringPostReceive(struct UringState *state, size_t index) {
+  if (uringQueue(state, IORING_OP_RECVMSG, &state->recv_hdrs[index], index) != NULL) state->posted++;
+  else state->idle[state->idle_count++] = index;
+}
+
+static void uringReap(struct UringState *state) {
+  unsigned head = *state->cq_head;
+  unsigned tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    const struct io_uring_cqe *cqe = &state->cqes[head & state->cq_mask];
+    if (cqe->user_data & URING_CANCEL_TAG) continue;
+    if (cqe->user_data & URING_SEND_TAG) {
+      state->send_results[cqe->user_data & ~URING_SEND_TAG] = cqe->res;
+      state->sends_pending--;
+      continue;
+    }
+
+    // Failed receives (ICMP errors, cancellation) go back to the kernel with the next wait
+    size_t index = (size_t)cqe->user_data;
+    state->posted--;
+    if (cqe->res >= 0) {
+      state->recv_msgs[index].length = (size_t)cqe->res;
+      state->ready[state->ready_count++] = index;
+    } else {
+      state->idle[state->idle_count++] = index;
+    }
+  }
+  __atomic_store_n(state->cq_head, head, __ATOMIC_RELEASE);
+}
+
+int uringInit(Uring *ring, socket_t socket, NetMsg *msgs, size_t count) {
+  ring->fd = -1;
+  ring->state = NULL;
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (fd < 0) return -1;
+
+  // Kernels without one mapping for both rings or a timeout on enter (before 5.11) stay on poll
+  struct UringState *state = (struct UringState *)calloc(1, sizeof(struct UringState));
+  if (state == NULL || !(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+    free(state);
+    close(fd);
+    return -1;
+  }
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  state->rings_size = sq_size > cq_size ? sq_size : cq_size;
+  state->rings = mmap(NULL, state->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  state->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  state->sqes = (struct io_uring_sqe *)mmap(NULL, state->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+  // Socket as a fixed file spares the kernel a descriptor lookup per operation
+  int files[1] = {socket};
+  if (state->rings == MAP_FAILED || state->sqes == MAP_FAILED || syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, files, 1) < 0) {
+    if (state->rings != MAP_FAILED) munmap(state->rings, state->rings_size);
+    if (state->sqes != MAP_FAILED) munmap(state->sqes, state->sqes_size);
+    free(state);
+    close(fd);
+    return -1;
+  }
+  char *base = (char *)state->rings;
+  state->sq_head = (unsigned *)(base + params.sq_off.head);
+  state->sq_tail = (unsigned *)(base + params.sq_off.tail);
+  state->sq_array = (unsigned *)(base + params.sq_off.array);
+  state->sq_mask = *(unsigned *)(base + params.sq_off.ring_mask);
+  state->sq_entries = params.sq_entries;
+  state->sq_local = *state->sq_tail;
+  state->cq_head = (unsigned *)(base + params.cq_off.head);
+  state->cq_tail = (unsigned *)(base + params.cq_off.tail);
+  state->cq_mask = *(unsigned *)(base + params.cq_off.ring_mask);
+  state->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+  state->socket = socket;
+  ring->fd = fd;
+  ring->state = state;
+
+  // Every buffer is posted at once, datagrams land in them without a receive call each
+  state->recv_msgs = msgs;
+  state->recv_count = count < NET_BATCH_MAX ? count : NET_BATCH_MAX;
+  for (size_t i = 0; i < state->recv_count; i++) {
+    toMsghdr(&msgs[i], &state->recv_hdrs[i], state->recv_iov[i]);
+    uringPostReceive(state, i);
+  }
+  if (uringEnter(fd, uringPublish(state), 0, 0, NULL, 0) < 0) {
+    uringFree(ring);
+    return -1;
+  }
+  return 0;
+}
+
+void uringFree(Uring *ring) {
+  struct UringState *state = ring->state;
+  if (state != NULL) {
+    // Posted receives are cancelled and awaited, their buffers belong to the caller again afterwards
+    if (state->posted > 0) {
+      struct io_uring_sqe *sqe = uringQueue(state, IORING_OP_ASYNC_CANCEL, NULL, URING_CANCEL_TAG);
+      if (sqe != NULL) {
+        sqe->flags = 0;
+        sqe->len = 0;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+      }
+      uringEnter(ring->fd, uringPublish(state), 0, 0, NULL, 0);
+      for (int attempts = 0; attempts < 100 && state->posted > 0; attempts++) {
+        uringReap(state);
+        if (state->posted > 0) uringEnter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      }
+    }
+    munmap(state->rings, state->rings_size);
+    munmap(state->sqes, state->sqes_size);
+    free(state);
+  }
+  if (ring->fd >= 0) close(ring->fd);
+  ring->fd = -1;
+  ring->state = NULL;
+}
+
+int uringSend(Uring *ring, NetMsg *msgs, size_t count, size_t segment_size) {
+  struct UringState *state = ring->state;
+  size_t first[NET_BATCH_MAX + 1];
+
+  size_t done = 0;
+  while (done < count) {
+    size_t n = buildSegments(msgs + done, count - done, segment_size, state->send_hdrs, state->send_iov,
+                             sizeof(state->send_iov) / sizeof(state->send_iov[0]), state->send_control, first);
+
+    // Linked in order, the first failure cancels the rest so what went out is a prefix
+    size_t queued = 0;
+    for (size_t i = 0; i < n; i++) {
+      struct io_uring_sqe *sqe = uringQueue(state, IORING_OP_SENDMSG, &state->send_hdrs[i].msg_hdr, URING_SEND_TAG | i);
+      if (sqe == NULL) break;
+      if (i + 1 < n) sqe->flags |= IOSQE_IO_LINK;
+      state->send_results[i] = 0;
+      queued++;
+    }
+    if (queued == 0) return -1;
+    if (queued < n) state->sqes[(state->sq_local - 1) & state->sq_mask].flags &= ~IOSQE_IO_LINK;
+    state->sends_pending += queued;
+
+    // Packets are reused once this returns, so their sends are waited for, completed receives are kept for the next wait
+    unsigned to_submit = uringPublish(state);
+    while (state->sends_pending > 0) {
+      if (uringEnter(ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) return -1;
+      to_submit = 0;
+      uringReap(state);
+    }
+
+    size_t sent = queued;
+    for (size_t i = 0; i < queued && sent == queued; i++) {
+      if (state->send_results[i] >= 0) continue;
+      if (state->send_results[i] != -EAGAIN && state->send_results[i] != -ECANCELED) return -1;
+      sent = i;
+    }
+    if (sent < queued) socketWaitWritable(state->socket); // Full send buffer on a non-blocking socket
+    done += first[sent];
+  }
+  return 0;
+}
+
+int uringWait(Uring *ring, int timeout_ms, size_t *ready) {
+  struct UringState *state = ring->state;
+
+  // What the caller had since the last call goes back to the kernel
+  size_t idle_count = state->idle_count;
+  state->idle_count = 0;
+  for (size_t i = 0; i < idle_count; i++) {
+    uringPostReceive(state, state->idle[i]);
+  }
+  uringReap(state);
+
+  // One call submits and waits, the timeout rides along instead of a timer request
+  unsigned to_submit = uringPublish(state);
+  if (state->ready_count == 0 && timeout_ms > 0) {
+    struct __kernel_timespec timeout = {timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1000000};
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&timeout;
+    int r = uringEnter(ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (r < 0 && errno != ETIME && errno != EINTR) return -1;
+  } else if (to_submit > 0 && uringEnter(ring->fd, to_submit, 0, 0, NULL, 0) < 0) {
+    return -1;
+  }
+  uringReap(state);
+
+  size_t count = state->ready_count;
+  for (size_t i = 0; i < count; i++) {
+    ready[i] = state->ready[i];
+    state->idle[state->idle_count++] = state->ready[i];
+  }
+  state->ready_count = 0;
+  return (int)count;
+}
+
+#else
+
+int uringInit(Uring *ring, socket_t socket, NetMsg *msgs, size_t count) {
+  (void)socket; // Kernel headers without io_uring
+  (void)msgs;
+  (void)count;
+  ring->fd = -1;
+  ring->state = NULL;
+  return -1;
+}
+
+void uringFree(Uring *ring) { (void)ring; }
+
+int uringSend(Uring *ring, NetMsg *msgs, size_t count, size_t segment_size) {
+  (void)ring;
+  (void)msgs;
+  (void)count;
+  (void)segment_size;
+  return -1;
+}
+
+int uringWait(Uring *ring, int timeout_ms, size_t *ready) {
+  (void)ring;
+  (void)timeout_ms;
+  (void)ready;
+  return -1;
+}
+
+#endif
+
+int socketSetDontFragment(socket_t socket, bool enabled) {
+#if defined(IP_MTU_DISCOVER)
+  // PROBE sets DF regardless of the path MTU the kernel has cached, WANT is the default
+  int value = enabled ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+  return setsockopt(socket, IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof value) == 0 ? 0 : -1;
+#elif defined(IP_DONTFRAG)
+  int value = enabled ? 1 : 0;
+  return setsockopt(socket, IPPROTO_IP, IP_DONTFRAG, &value, sizeof value) == 0 ? 0 : -1;
+#else
+  (void)socket;
+  (void)enabled;
+  return -1;
+#endif
+}
+
+int socketSetBufferSize(socket_t socket, int bytes) {
+  int r = setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof bytes);
+  r |= setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof bytes);
+  return r == 0 ? 0 : -1;
+}
+
+int socketSetPacingRate(socket_t socket, uint64_t bytes_per_s) {
+#if defined(SO_MAX_PACING_RATE)
+  // 64-bit since Linux 4.19, older kernels take a 32-bit value and cap it there. 0 lifts the cap
+  uint64_t rate = bytes_per_s > 0 ? bytes_per_s : UINT64_MAX;
+  if (setsockopt(socket, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof rate) == 0) return 0;
+  uint32_t rate32 = rate > UINT32_MAX ? UINT32_MAX : (uint32_t)rate;
+  return setsockopt(socket, SOL_SOCKET, SO_MAX_PACING_RATE, &rate32, sizeof rate32) == 0 ? 0 : -1;
+#else
+  (void)socket;
+  (void)bytes_per_s;
+  return -1;
+#endif
+}
+
+socket_t socketConnectUnix(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) return SOCKET_INVALID;
+  strcpy(addr.sun_path, path);
+
+  socket_t socket_handle = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socket_handle == SOCKET_INVALID) return SOCKET_INVALID;
+  if (connect(socket_handle, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(socket_handle);
+    return SOCKET_INVALID;
+  }
+  return socket_handle;
+}
+
+uint64_t timeNowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+uint64_t processCpuUs() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+  return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + (uint64_t)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+// pthread wants a result pointer
+typedef struct {
+  void (*fn)(void *arg);
+  void *arg;
+} ThreadStart;
+
+static void *threadTrampoline(void *param) {
+  ThreadStart start = *(ThreadStart *)param;
+  free(param);
+  start.fn(start.arg);
+  return NULL;
+}
+
+int threadCreate(thread_t *thread, void (*fn)(void *arg), void *arg) {
+  ThreadStart *start = (ThreadStart *)malloc(sizeof(ThreadStart));
+  if (start == NULL) return -1;
+  start->fn = fn;
+  start->arg = arg;
+  if (pthread_create(thread, NULL, threadTrampoline, start) != 0) {
+    free(start);
+    return -1;
+  }
+  return 0;
+}
+
+int threadJoin(thread_t thread) { return pthread_join(thread, NULL) == 0 ? 0 : -1; }
+
+void progressInit(Progress *progress) {
+  pthread_mutex_init(&progress->lock, NULL);
+  pthread_cond_init(&progress->changed, NULL);
+  progress->value = 0;
+  progress->closed = false;
+}
+
+void progressDestroy(Progress *progress) {
+  pthread_cond_destroy(&progress->changed);
+  pthread_mutex_destroy(&progress->lock);
+}
+
+void progressSet(Progress *progress, uint64_t value) {
+  pthread_mutex_lock(&progress->lock);
+  if (value > progress->value) progress->value = value;
+  pthread_cond_broadcast(&progress->changed);
+  pthread_mutex_unlock(&progress->lock);
+}
+
+void progressClose(Progress *progress) {
+  pthread_mutex_lock(&progress->lock);
+  progress->closed = true;
+  pthread_cond_broadcast(&progress->changed);
+  pthread_mutex_unlock(&progress->lock);
+}
+
+uint64_t progressGet(Progress *progress) {
+  pthread_mutex_lock(&progress->lock);
+  uint64_t value = progress->value;
+  pthread_mutex_unlock(&progress->lock);
+  return value;
+}
+
+uint64_t progressWait(Progress *progress, uint64_t seen) {
+  pthread_mutex_lock(&progress->lock);
+  while (progress->value <= seen && !progress->closed) {
+    pthread_cond_wait(&progress->changed, &progress->lock);
+  }
+  uint64_t value = progress->value;
+  pthread_mutex_unlock(&progress->lock);
+  return value;
+}
+
+bool progressWaitClosed(Progress *progress, uint32_t timeout_ms) {
+  // Condition variables time out on the wall clock
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  pthread_mutex_lock(&progress->lock);
+  while (!progress->closed && pthread_cond_timedwait(&progress->changed, &progress->lock, &deadline) == 0) {
+  }
+  bool closed = progress->closed;
+  pthread_mutex_unlock(&progress->lock);
+  return closed;
+}
+
+int fileMapRead(const char *path, FileMap *map) {
+  memset(map, 0, sizeof(*map));
+  map->fd = open(path, O_RDONLY);
+  if (map->fd == -1) return -1;
+
+  struct stat st;
+  if (fstat(map->fd, &st) != 0) {
+    fileUnmap(map, false);
+    return -1;
+  }
+  map->size = (size_t)st.st_size;
+  if (map->size == 0) return 0; // Empty file can't be mapped
+
+  void *data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, map->fd, 0);
+  if (data == MAP_FAILED) {
+    fileUnmap(map, false);
+    return -1;
+  }
+  map->data = (char *)data;
+  madvise(data, map->size, MADV_SEQUENTIAL);
+  return 0;
+}
+
+int fileMapCreate(const char *path, size_t size, bool keep, FileMap *map) {
+  memset(map, 0, sizeof(*map));
+  map->fd = open(path, O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC), 0644);
+  if (map->fd == -1) return -1;
+  map->size = size;
+  if (size == 0) return 0;
+
+  if (ftruncate(map->fd, (off_t)size) != 0) {
+    fileUnmap(map, false);
+    return -1;
+  }
+  void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+  if (data == MAP_FAILED) {
+    fileUnmap(map, false);
+    return -1;
+  }
+  map->data = (char *)data;
+  return 0;
+}
+
+int fileUnmap(FileMap *map, bool flush) {
+  int r = 0;
+  if (map->data != NULL) {
+    if (flush && msync(map->data, map->size, MS_SYNC) != 0) r = -1;
+    munmap(map->data, map->size);
+  }
+  if (map->fd >= 0) close(map->fd);
+  memset(map, 0, sizeof(*map));
+  map->fd = -1;
+  return r;
+}
+
+int fileFlush(const FileMap *map, uint64_t offset, uint64_t length) {
+  if (map->data == NULL || length == 0) return 0;
+  // msync wants a page aligned start
+  uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+  uint64_t start = offset - offset % page;
+  return msync(map->data + start, (size_t)(offset + length - start), MS_SYNC) == 0 ? 0 : -1;
+}
+
+int fileCopyRange(const FileMap *source, uint64_t offset, uint64_t size, const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) return -1;
+
+  // Kernel copies file to file and shares extents where the file system can, what it refuses comes from the mapping
+  uint64_t done = 0;
+#ifdef __linux__
+  while (done < size) {
+    loff_t from = (loff_t)(offset + done);
+    ssize_t n = copy_file_range(source->fd, &from, fd, NULL, (size_t)(size - done), 0);
+    if (n <= 0) break;
+    done += (uint64_t)n;
+  }
+#endif
+  while (done < size) {
+    ssize_t n = write(fd, source->data + offset + done, (size_t)(size - done));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    done += (uint64_t)n;
+  }
+  int r = (done == size && fsync(fd) == 0) ? 0 : -1;
+  close(fd);
+  return r;
+}
+
+PathType pathType(const char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0) return PATH_MISSING;
+  return S_ISDIR(st.st_mode) ? PATH_DIRECTORY : PATH_FILE;
+}
+
+int dirCreate(const char *path) {
+  if (mkdir(path, 0755) == 0) return 0;
+  return (errno == EEXIST && pathType(path) == PATH_DIRECTORY) ? 0 : -1;
+}
+
+int dirOpen(const char *path, DirReader *reader) {
+  reader->dir = opendir(path);
+  return reader->dir != NULL ? 0 : -1;
+}
+
+const char *dirNext(DirReader *reader) {
+  struct dirent *entry;
+  while ((entry = readdir(reader->dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) return entry->d_name;
+  }
+  return NULL;
+}
+
+void dirClose(DirReader *reader) {
+  if (reader->dir != NULL) closedir(reader->dir);
+  reader->dir = NULL;
+}
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+typedef SOCKET socket_t;
+#define SOCKET_INVALID INVALID_SOCKET
+typedef HANDLE thread_t;
+#else
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+typedef int socket_t;
+#define SOCKET_INVALID (-1)
+typedef pthread_t thread_t;
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define PLATFORM_URING // Raw io_uring syscalls, liburing isn't needed
+#endif
+#endif
+#endif
+
+#define NET_MSG_MAX_BUFS 2 // Scatter/gather parts of one datagram
+#define NET_BATCH_MAX 64   // Datagrams per sendmmsg/recvmmsg call
+#define NET_GSO_MAX_SEGMENTS 64  // Datagrams in one segmentation offload send
+#define NET_GSO_MAX_BYTES 65507  // Largest UDP payload over IPv4
+#define URING_ENTRIES 256        // Submission queue, room for the posted receives and a batch of sends
+
+typedef struct {
+  void *base;
+  size_t len;
+} NetBuf;
+
+// One datagram of a batch, addr is the destination when sending and the source when receiving
+typedef struct {
+  NetBuf bufs[NET_MSG_MAX_BUFS];
+  size_t buf_count;
+  struct sockaddr_in addr;
+  size_t length; // Received bytes
+} NetMsg;
+
+// Whole file mapped into memory, data is NULL for an empty file
+typedef struct {
+  char *data;
+  size_t size;
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#else
+  int fd;
+#endif
+} FileMap;
+
+// io_uring of one socket, receives stay posted in the kernel and one call submits sends and reaps what completed
+typedef struct {
+  int fd;                   // -1 when the kernel has none, callers stay on the socket calls
+  struct UringState *state; // Rings and messages in flight, Linux only
+} Uring;
+
+// Names in one directory, without . and ..
+typedef struct {
+#ifdef _WIN32
+  HANDLE find;
+  WIN32_FIND_DATAA entry;
+  bool pending; // entry holds a name not returned yet
+#else
+  DIR *dir;
+#endif
+} DirReader;
+
+typedef enum {
+  PATH_MISSING = -1,
+  PATH_FILE = 0,
+  PATH_DIRECTORY = 1
+} PathType;
+
+// Value that only grows, raised by one thread and awaited by another
+typedef struct {
+#ifdef _WIN32
+  SRWLOCK lock;
+  CONDITION_VARIABLE changed;
+#else
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+#endif
+  uint64_t value;
+  bool closed;
+} Progress;
+
+// Socket layer init/cleanup, no-op outside of Winsock
+int netInit();
+void netCleanup();
+int netParseAddress(const char *ip, uint16_t port, struct sockaddr_in *addr);
+
+int socketClose(socket_t socket);
+int socketSetNonBlocking(socket_t socket, bool enabled);
+int socketSetRecvTimeout(socket_t socket, uint32_t timeout_ms);
+int socketWaitReadable(socket_t socket, int timeout_ms); // 1 readable, 0 timeout, -1 error
+bool socketWouldBlock(); // Last operation failed only because there was no data
+int socketSendBatch(socket_t socket, NetMsg *msgs, size_t count); // 0 when all were sent, -1 on error
+int socketRecvBatch(socket_t socket, NetMsg *msgs, size_t count); // Received count, never waits, -1 on error
+// Like socketSendBatch, runs of segment_size datagrams go out in one UDP_SEGMENT send where the kernel has it
+int socketSendSegments(socket_t socket, NetMsg *msgs, size_t count, size_t segment_size);
+int socketSetDontFragment(socket_t socket, bool enabled); // DF on every datagram, for probing the path MTU
+// Receives into the buffers of msgs stay posted from here on, -1 without io_uring
+int uringInit(Uring *ring, socket_t socket, NetMsg *msgs, size_t count);
+void uringFree(Uring *ring);
+// Like socketSendSegments, submitted together and done once it returns
+int uringSend(Uring *ring, NetMsg *msgs, size_t count, size_t segment_size);
+// Indexes of msgs that received a datagram, waiting up to timeout_ms for the first, -1 on error.
+// They are the caller's until the next call, which posts them again
+int uringWait(Uring *ring, int timeout_ms, size_t *ready);
+
+int socketSetBufferSize(socket_t socket, int bytes); // Send and receive buffers, the OS may cap it
+int socketSetPacingRate(socket_t socket, uint64_t bytes_per_s); // Kernel pacing cap, Linux with the fq qdisc, -1 elsewhere
+socket_t socketConnectUnix(const char *path); // Stream socket to a listening Unix socket, SOCKET_INVALID without one
+uint64_t timeNowUs(); // Monotonic clock in microseconds
+uint64_t processCpuUs(); // User and system time of every thread so far
+
+int threadCreate(thread_t *thread, void (*fn)(void *arg), void *arg);
+int threadJoin(thread_t thread);
+void progressInit(Progress *progress);
+void progressDestroy(Progress *progress);
+void progressSet(Progress *progress, uint64_t value);
+void progressClose(Progress *progress);                  // Wakes waiters for good
+uint64_t progressGet(Progress *progress);
+uint64_t progressWait(Progress *progress, uint64_t seen); // Blocks until above seen, returns seen only once closed
+bool progressWaitClosed(Progress *progress, uint32_t timeout_ms); // False when timeout_ms passed first
+
+int fileMapRead(const char *path, FileMap *map);                           // Existing file, read-only and read ahead sequentially
+int fileMapCreate(const char *path, size_t size, bool keep, FileMap *map); // Writable at the given size, keep spares existing data
+int fileUnmap(FileMap *map, bool flush);                                   // Flush writes a writable mapping back before closing
+int fileFlush(const FileMap *map, uint64_t offset, uint64_t length);      // Writes a range of a writable mapping back, mapping stays
+int fileCopyRange(const FileMap *source, uint64_t offset, uint64_t size, const char *path); // New file of size bytes of source, flushed
+PathType pathType(const char *path);
+int dirCreate(const char *path); // 0 also when it already exists
+int dirOpen(const char *path, DirReader *reader);
+const char *dirNext(DirReader *reader); // Next name in no particular order, NULL at the end
+void dirClose(DirReader *reader);
+
+#endif /* PLATFORM_H */
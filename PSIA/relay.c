@@ -0,0 +1,346 @@
+/*
+ * Loopback relay between a sender and a receiver that makes the path worse on purpose: loss, delay and jitter,
+ * duplication, reordering and flipped bits, for every datagram in both directions. The sender targets the front
+ * ports, the relay sends on from the back ports and the receiver answers those. DATA offsets going through are counted,
+ * so the statistics printed on exit show the retransmissions the sender made. Linux only, a test tool.
+ */
+
+#include "relay.h"
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static volatile sig_atomic_t stopping = 0;
+
+static void onSignal(int signal_number) {
+  (void)signal_number;
+  stopping = 1;
+}
+
+int main(int argc, char *argv[]) {
+  // Options may come anywhere, everything else is positional
+  RelayOptions options = {0, 0, 0, 0, 0, 0, RELAY_GAP_DEFAULT_US, 1, 1};
+  char **args = argv + 1;
+  int arg_count = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--", 2) == 0) {
+      if (i + 1 >= argc || parseRelayOption(argv[i], argv[i + 1], &options) != 0) {
+        printf("Error: Invalid option %s\n", argv[i]);
+        return ERR_INVALID_ARG;
+      }
+      i++;
+    } else {
+      args[arg_count++] = argv[i];
+    }
+  }
+
+  if (arg_count < 4) {
+    printf("Usage: %s <front_port> <back_port> <target_port> <target_ip> [--loss <rate>] [--delay <ms>] [--jitter <ms>] [--duplicate <rate>] [--reorder <rate>] [--gap <ms>] [--corrupt <rate>] [--streams <n>] [--seed <n>]\n", argv[0]);
+    return ERR_INVALID_ARG;
+  }
+  int front_port = atoi(args[0]);
+  int back_port = atoi(args[1]);
+  int target_port = atoi(args[2]);
+  int last = (int)options.streams - 1; // Stream ports go up from the given ones
+  if (front_port <= 0 || front_port + last > 65535 || back_port <= 0 || back_port + last > 65535 || target_port <= 0 ||
+      target_port + last > 65535) {
+    printf("Error: Port numbers must be between 1 and 65535\n");
+    return ERR_INVALID_ARG;
+  }
+
+  srand(options.seed);
+  if (netInit() != 0) return ERR_SOCKET_INIT;
+  Relay relay;
+  relay.options = options;
+  int open_r = relayOpen(&relay, (uint16_t)front_port, (uint16_t)back_port, args[3], (uint16_t)target_port);
+  if (open_r != 0) {
+    netCleanup();
+    return open_r;
+  }
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  int run_r = relayRun(&relay);
+  relayPrintStats(&relay);
+  relayClose(&relay);
+  netCleanup();
+
+  return run_r;
+}
+
+int parseRelayOption(const char *name, const char *value, RelayOptions *options) {
+  if (name == NULL || value == NULL || options == NULL) return ERR_INVALID_ARG;
+
+  // Rates are shares of the datagrams, times in milliseconds
+  double number = atof(value);
+  if (strcmp(name, "--streams") == 0) {
+    long streams = atol(value);
+    if (streams < 1 || streams > STREAM_MAX) return ERR_INVALID_ARG;
+    options->streams = (size_t)streams;
+  } else if (strcmp(name, "--seed") == 0) {
+    options->seed = (unsigned)strtoul(value, NULL, 10);
+  } else if (strcmp(name, "--delay") == 0 || strcmp(name, "--jitter") == 0 || strcmp(name, "--gap") == 0) {
+    if (number < 0 || number > 60000) return ERR_INVALID_ARG;
+    uint64_t us = (uint64_t)(number * 1000);
+    if (strcmp(name, "--delay") == 0) options->delay_us = us;
+    else if (strcmp(name, "--jitter") == 0) options->jitter_us = us;
+    else options->gap_us = us;
+  } else {
+    if (number < 0 || number >= 1) return ERR_INVALID_ARG;
+    if (strcmp(name, "--loss") == 0) options->loss = number;
+    else if (strcmp(name, "--duplicate") == 0) options->duplicate = number;
+    else if (strcmp(name, "--reorder") == 0) options->reorder = number;
+    else if (strcmp(name, "--corrupt") == 0) options->corrupt = number;
+    else return ERR_INVALID_ARG;
+  }
+
+  return 0;
+}
+
+static socket_t bindLocal(uint16_t port) {
+  socket_t socket_handle = socket(AF_INET, SOCK_DGRAM, 0);
+  if (socket_handle == SOCKET_INVALID) return SOCKET_INVALID;
+
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  local.sin_port = htons(port);
+  if (bind(socket_handle, (struct sockaddr *)&local, sizeof(local)) != 0) {
+    socketClose(socket_handle);
+    return SOCKET_INVALID;
+  }
+  socketSetBufferSize(socket_handle, SOCKET_BUFFER_SIZE);
+  socketSetNonBlocking(socket_handle, true);
+  return socket_handle;
+}
+
+int relayOpen(Relay *relay, uint16_t front_port, uint16_t back_port, const char *target_ip, uint16_t target_port) {
+  RelayOptions options = relay->options;
+  memset(relay, 0, sizeof(*relay));
+  relay->options = options;
+  for (size_t i = 0; i < STREAM_MAX; i++) {
+    relay->front[i] = SOCKET_INVALID;
+    relay->back[i] = SOCKET_INVALID;
+  }
+
+  relay->held = (Held *)malloc(RELAY_HELD_MAX * sizeof(Held));
+  if (relay->held == NULL) return ERR_MEM_ALLOC;
+  for (size_t i = 0; i < options.streams; i++) {
+    if (netParseAddress(target_ip, (uint16_t)(target_port + i), &relay->receiver[i]) != 0) {
+      relayClose(relay);
+      return ERR_INVALID_ARG;
+    }
+    relay->front[i] = bindLocal((uint16_t)(front_port + i));
+    relay->back[i] = bindLocal((uint16_t)(back_port + i));
+    if (relay->front[i] == SOCKET_INVALID || relay->back[i] == SOCKET_INVALID) {
+      relayClose(relay);
+      return ERR_SOCKET_BIND;
+    }
+  }
+  return 0;
+}
+
+void relayClose(Relay *relay) {
+  for (size_t i = 0; i < STREAM_MAX; i++) {
+    if (relay->front[i] != SOCKET_INVALID) socketClose(relay->front[i]);
+    if (relay->back[i] != SOCKET_INVALID) socketClose(relay->back[i]);
+    relay->front[i] = SOCKET_INVALID;
+    relay->back[i] = SOCKET_INVALID;
+  }
+  for (size_t i = 0; i < relay->held_count; i++) {
+    free(relay->held[i].data);
+  }
+  free(relay->held);
+  free(relay->seen.keys);
+  relay->held = NULL;
+  relay->held_count = 0;
+  relay->seen.keys = NULL;
+}
+
+static size_t offsetHash(uint64_t key, size_t capacity) {
+  // Offsets are multiples of the payload size, the high bits of the product are the mixed ones
+  uint64_t hash = key * 0x9E3779B97F4A7C15ull;
+  return (size_t)(hash ^ (hash >> 32)) & (capacity - 1);
+}
+
+bool offsetSetInsert(OffsetSet *set, uint64_t key) {
+  // Grown at half full, keys are offset + 1 so none is 0
+  if (set->count * 2 >= set->capacity) {
+    size_t capacity = set->capacity > 0 ? set->capacity * 2 : 4096;
+    uint64_t *keys = (uint64_t *)calloc(capacity, sizeof(uint64_t));
+    if (keys == NULL) return true; // Counted as new, statistics only
+    for (size_t i = 0; i < set->capacity; i++) {
+      if (set->keys[i] == 0) continue;
+      size_t j = offsetHash(set->keys[i], capacity);
+      while (keys[j] != 0) j = (j + 1) & (capacity - 1);
+      keys[j] = set->keys[i];
+    }
+    free(set->keys);
+    set->keys = keys;
+    set->capacity = capacity;
+  }
+
+  size_t i = offsetHash(key, set->capacity);
+  while (set->keys[i] != 0) {
+    if (set->keys[i] == key) return false;
+    i = (i + 1) & (set->capacity - 1);
+  }
+  set->keys[i] = key;
+  set->count++;
+  return true;
+}
+
+static double chance() { return (double)rand() / ((double)RAND_MAX + 1); }
+
+static bool heldBefore(const Held *a, const Held *b) { return a->release < b->release || (a->release == b->release && a->order < b->order); }
+
+static void heldPush(Relay *relay, Held item) {
+  size_t i = relay->held_count++;
+  while (i > 0 && heldBefore(&item, &relay->held[(i - 1) / 2])) {
+    relay->held[i] = relay->held[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  relay->held[i] = item;
+}
+
+static Held heldPop(Relay *relay) {
+  Held top = relay->held[0];
+  Held item = relay->held[--relay->held_count];
+  size_t i = 0;
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= relay->held_count) break;
+    if (child + 1 < relay->held_count && heldBefore(&relay->held[child + 1], &relay->held[child])) child++;
+    if (!heldBefore(&relay->held[child], &item)) break;
+    relay->held[i] = relay->held[child];
+    i = child;
+  }
+  if (relay->held_count > 0) relay->held[i] = item;
+  return top;
+}
+
+void relayInput(Relay *relay, size_t stream, int direction, const char *data, size_t length, uint64_t now) {
+  const RelayOptions *options = &relay->options;
+  RelayStats *stats = &relay->stats;
+  stats->received[direction]++;
+
+  // What the sender sent is counted before anything is lost on the way
+  if (direction == RELAY_FORWARD && length >= sizeof(PacketHeader) && memcmp(data, PACKET_HEADER_DATA, PACKET_HEADER_LEN) == 0) {
+    uint32_t offset;
+    memcpy(&offset, data + offsetof(PacketHeader, offset), sizeof(offset));
+    stats->data++;
+    if (!offsetSetInsert(&relay->seen, ((uint64_t)stream << 32 | offset) + 1)) stats->retransmits++;
+  }
+
+  if (chance() < options->loss) {
+    stats->dropped++;
+    return;
+  }
+  int copies = 1;
+  if (chance() < options->duplicate) {
+    stats->duplicated++;
+    copies = 2;
+  }
+
+  for (int copy = 0; copy < copies; copy++) {
+    if (relay->held_count == RELAY_HELD_MAX) {
+      stats->overflow++;
+      return;
+    }
+    Held item = {now + options->delay_us, relay->order++, stream, direction, length, (char *)malloc(length > 0 ? length : 1)};
+    if (item.data == NULL) return;
+    memcpy(item.data, data, length);
+
+    // Jitter is uniform around the delay, a reordered datagram waits the gap on top
+    if (options->jitter_us > 0) {
+      uint64_t spread = (uint64_t)(chance() * (2 * options->jitter_us + 1));
+      item.release = item.release + spread > options->jitter_us ? item.release + spread - options->jitter_us : 0;
+    }
+    if (chance() < options->reorder) {
+      item.release += options->gap_us;
+      stats->reordered++;
+    }
+    if (length > 0 && chance() < options->corrupt) {
+      size_t bit = (size_t)(chance() * (double)(length * 8));
+      item.data[bit / 8] ^= (char)(1 << (bit % 8));
+      stats->corrupted++;
+    }
+    heldPush(relay, item);
+  }
+}
+
+void relayRelease(Relay *relay, uint64_t now) {
+  while (relay->held_count > 0 && relay->held[0].release <= now) {
+    Held item = heldPop(relay);
+    size_t i = item.stream;
+
+    // Back out to the receiver, or to wherever the sender last sent from
+    socket_t out = item.direction == RELAY_FORWARD ? relay->back[i] : relay->front[i];
+    const struct sockaddr_in *to = item.direction == RELAY_FORWARD ? &relay->receiver[i] : &relay->sender[i];
+    if (sendto(out, item.data, item.length, 0, (const struct sockaddr *)to, sizeof(*to)) >= 0) {
+      relay->stats.forwarded[item.direction]++;
+    } else {
+      relay->stats.overflow++; // Socket buffer full, lost like on a real link
+    }
+    free(item.data);
+  }
+}
+
+int relayRun(Relay *relay) {
+  size_t streams = relay->options.streams;
+  struct pollfd fds[2 * STREAM_MAX];
+  for (size_t i = 0; i < streams; i++) {
+    fds[2 * i].fd = relay->front[i];
+    fds[2 * i + 1].fd = relay->back[i];
+    fds[2 * i].events = fds[2 * i + 1].events = POLLIN;
+  }
+
+  char *buffer = (char *)malloc(RELAY_DATAGRAM_MAX);
+  if (buffer == NULL) return ERR_MEM_ALLOC;
+  while (!stopping) {
+    // Until the next held datagram is due
+    uint64_t now = timeNowUs();
+    int timeout_ms = RELAY_IDLE_POLL_MS;
+    if (relay->held_count > 0) timeout_ms = relay->held[0].release > now ? (int)((relay->held[0].release - now + 999) / 1000) : 0;
+    if (poll(fds, 2 * streams, timeout_ms) < 0) continue; // Interrupted, maybe to stop
+
+    for (size_t s = 0; s < 2 * streams; s++) {
+      if (!(fds[s].revents & POLLIN)) continue;
+      size_t stream = s / 2;
+      int direction = s % 2 == 0 ? RELAY_FORWARD : RELAY_REVERSE;
+
+      // Drained, the kernel's buffer is the only queue not counted
+      for (;;) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int received = recvfrom(fds[s].fd, buffer, RELAY_DATAGRAM_MAX, 0, (struct sockaddr *)&from, &from_len);
+        if (received < 0) break;
+        if (direction == RELAY_FORWARD) {
+          relay->sender[stream] = from;
+          relay->sender_known[stream] = true;
+        } else if (!relay->sender_known[stream]) {
+          continue; // Nowhere to go yet
+        }
+        relayInput(relay, stream, direction, buffer, (size_t)received, timeNowUs());
+      }
+    }
+    relayRelease(relay, timeNowUs());
+  }
+  free(buffer);
+  return 0;
+}
+
+void relayPrintStats(const Relay *relay) {
+  const RelayStats *stats = &relay->stats;
+  printf("forward_in=%llu forward_out=%llu reverse_in=%llu reverse_out=%llu dropped=%llu duplicated=%llu reordered=%llu "
+         "corrupted=%llu overflow=%llu data=%llu retransmits=%llu\n",
+         (unsigned long long)stats->received[RELAY_FORWARD], (unsigned long long)stats->forwarded[RELAY_FORWARD],
+         (unsigned long long)stats->received[RELAY_REVERSE], (unsigned long long)stats->forwarded[RELAY_REVERSE],
+         (unsigned long long)stats->dropped, (unsigned long long)stats->duplicated, (unsigned long long)stats->reordered,
+         (unsigned long long)stats->corrupted, (unsigned long long)stats->overflow, (unsigned long long)stats->data,
+         (unsigned long long)stats->retransmits);
+  fflush(stdout);
+}
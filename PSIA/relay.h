@@ -0,0 +1,82 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "UDP.h"
+#include "platform.h"
+
+#define RELAY_DATAGRAM_MAX 65536
+#define RELAY_HELD_MAX 65536       // Datagrams waiting for their delay, later ones are dropped
+#define RELAY_GAP_DEFAULT_US 5000  // Extra delay of a reordered datagram, --gap
+#define RELAY_IDLE_POLL_MS 1000    // Wait when nothing is held, a stop signal is noticed by then
+#define RELAY_FORWARD 0 // Sender to receiver
+#define RELAY_REVERSE 1 // Receiver to sender
+
+// Command line options, rates are per datagram and apply to both directions
+typedef struct {
+  double loss;
+  double duplicate;
+  double reorder;
+  double corrupt;   // One flipped bit
+  uint64_t delay_us;
+  uint64_t jitter_us; // Delay varies by up to this much either way
+  uint64_t gap_us;    // Added to the delay of a reordered datagram, so later ones overtake it
+  size_t streams;     // Socket pairs, stream i uses every port + i like UDP --streams
+  unsigned seed;
+} RelayOptions;
+
+// Datagram on its way, released once its delay is over
+typedef struct {
+  uint64_t release;
+  uint64_t order; // Arrival, keeps equal release times in order
+  size_t stream;
+  int direction;
+  size_t length;
+  char *data;
+} Held;
+
+typedef struct {
+  uint64_t received[2];
+  uint64_t forwarded[2];
+  uint64_t dropped;
+  uint64_t duplicated;
+  uint64_t reordered;
+  uint64_t corrupted;
+  uint64_t overflow; // Dropped because too many were held
+  uint64_t data;        // DATA datagrams from the sender
+  uint64_t retransmits; // DATA datagrams with an offset sent before
+} RelayStats;
+
+// Offsets of DATA seen per stream, open addressing, 0 marks a free slot
+typedef struct {
+  uint64_t *keys;
+  size_t capacity;
+  size_t count;
+} OffsetSet;
+
+typedef struct {
+  RelayOptions options;
+  socket_t front[STREAM_MAX]; // Sender side, the sender targets these
+  socket_t back[STREAM_MAX];  // Receiver side, the receiver answers these
+  struct sockaddr_in sender[STREAM_MAX]; // Learned from the first datagram of each stream
+  bool sender_known[STREAM_MAX];
+  struct sockaddr_in receiver[STREAM_MAX];
+  Held *held; // Min-heap on release time
+  size_t held_count;
+  uint64_t order;
+  OffsetSet seen;
+  RelayStats stats;
+} Relay;
+
+int parseRelayOption(const char *name, const char *value, RelayOptions *options);
+int relayOpen(Relay *relay, uint16_t front_port, uint16_t back_port, const char *target_ip, uint16_t target_port);
+void relayClose(Relay *relay);
+void relayInput(Relay *relay, size_t stream, int direction, const char *data, size_t length, uint64_t now);
+void relayRelease(Relay *relay, uint64_t now); // Sends every held datagram that is due
+int relayRun(Relay *relay);                     // Until SIGINT or SIGTERM
+void relayPrintStats(const Relay *relay);
+bool offsetSetInsert(OffsetSet *set, uint64_t key); // False when it was there already
+
+#endif /* RELAY_H */
@@ -0,0 +1,180 @@
+/*
+ * Telemetry of one transfer. Stream threads bump relaxed atomic counters, a reporter thread reads them every interval
+ * for a progress line on stderr and a JSON line per report to a file or a Unix socket. Nothing here takes a lock on
+ * the data path, a report may mix values from slightly different moments.
+ */
+
+#include "stats.h"
+#include <string.h>
+
+static const char *const counter_names[STAT_COUNTERS] = {
+    "data_sent",      "bytes_sent",    "parity_sent", "resend_timeout",  "resend_hole",     "resend_meta",
+    "resend_control", "rto_events",    "sacks_received", "data_received", "parity_received", "duplicates",
+    "fec_recovered",  "crc_errors",    "sacks_sent",  "nacks_sent",      "bytes_done"};
+static const char *const gauge_names[STAT_GAUGES] = {"cwnd", "in_flight", "srtt_us", "rto_us", "pacing_Bps"};
+
+#ifdef MSG_NOSIGNAL
+#define STATS_SEND_FLAGS MSG_NOSIGNAL // A closed listener must not kill the transfer with SIGPIPE
+#else
+#define STATS_SEND_FLAGS 0
+#endif
+
+static uint64_t load(const uint64_t *value) { return __atomic_load_n(value, __ATOMIC_RELAXED); }
+
+int statsOpen(Stats *stats, const char *role, uint32_t interval_ms, const char *export_path) {
+  memset(stats, 0, sizeof(*stats));
+  stats->role = role;
+  stats->interval_ms = interval_ms;
+  stats->socket = SOCKET_INVALID;
+  stats->start_us = stats->last_us = timeNowUs();
+
+  if (export_path != NULL && strncmp(export_path, STATS_UNIX_PREFIX, strlen(STATS_UNIX_PREFIX)) == 0) {
+    stats->socket = socketConnectUnix(export_path + strlen(STATS_UNIX_PREFIX));
+    if (stats->socket == SOCKET_INVALID) return -1;
+  } else if (export_path != NULL) {
+    stats->file = fopen(export_path, "a");
+    if (stats->file == NULL) return -1;
+  }
+
+  // Reports come from their own thread, so a stalled transfer still shows up
+  if (interval_ms == 0 && export_path == NULL) return 0;
+  stats->period_ms = interval_ms > 0 ? interval_ms : STATS_EXPORT_PERIOD_MS;
+  progressInit(&stats->stop);
+  stats->running = threadCreate(&stats->thread, statsThread, stats) == 0;
+  if (!stats->running) progressDestroy(&stats->stop);
+  return 0;
+}
+
+void statsThread(void *arg) {
+  Stats *stats = (Stats *)arg;
+  while (!progressWaitClosed(&stats->stop, stats->period_ms)) {
+    statsReport(stats, false);
+  }
+}
+
+void statsClose(Stats *stats) {
+  if (stats->running) {
+    progressClose(&stats->stop);
+    threadJoin(stats->thread);
+    progressDestroy(&stats->stop);
+    stats->running = false;
+  }
+  statsReport(stats, true);
+  if (stats->file != NULL) fclose(stats->file);
+  if (stats->socket != SOCKET_INVALID) socketClose(stats->socket);
+  stats->file = NULL;
+  stats->socket = SOCKET_INVALID;
+}
+
+void statsAdd(Stats *stats, StatCounter counter, uint64_t value) {
+  if (stats != NULL) __atomic_fetch_add(&stats->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+void statsSet(Stats *stats, size_t stream, StatGauge gauge, uint64_t value) {
+  if (stats != NULL && stream < STATS_STREAMS) __atomic_store_n(&stats->gauges[stream][gauge], value, __ATOMIC_RELAXED);
+}
+
+void statsRtt(Stats *stats, uint64_t rtt_us) {
+  if (stats == NULL) return;
+  size_t bucket = 0;
+  while (bucket + 1 < STATS_RTT_BUCKETS && rtt_us >> (bucket + 1) != 0) bucket++;
+  __atomic_fetch_add(&stats->rtt_us[bucket], 1, __ATOMIC_RELAXED);
+}
+
+void statsSetTotal(Stats *stats, uint64_t total) {
+  if (stats != NULL) __atomic_store_n(&stats->total, total, __ATOMIC_RELAXED);
+}
+
+static uint64_t rttPercentile(const uint64_t *buckets, double share) {
+  // Upper bound of the bucket the share falls into
+  uint64_t count = 0;
+  for (size_t i = 0; i < STATS_RTT_BUCKETS; i++) {
+    count += buckets[i];
+  }
+  if (count == 0) return 0;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < STATS_RTT_BUCKETS; i++) {
+    seen += buckets[i];
+    if ((double)seen >= share * (double)count) return (2ull << i) - 1;
+  }
+  return 0;
+}
+
+void statsReport(Stats *stats, bool final) {
+  // Snapshot first, everything below works on it
+  uint64_t now = timeNowUs();
+  uint64_t counters[STAT_COUNTERS];
+  uint64_t rtt[STATS_RTT_BUCKETS];
+  uint64_t gauges[STAT_GAUGES] = {0};
+  for (size_t i = 0; i < STAT_COUNTERS; i++) {
+    counters[i] = load(&stats->counters[i]);
+  }
+  for (size_t i = 0; i < STATS_RTT_BUCKETS; i++) {
+    rtt[i] = load(&stats->rtt_us[i]);
+  }
+  for (size_t s = 0; s < STATS_STREAMS; s++) {
+    gauges[GAUGE_CWND] += load(&stats->gauges[s][GAUGE_CWND]);
+    gauges[GAUGE_IN_FLIGHT] += load(&stats->gauges[s][GAUGE_IN_FLIGHT]);
+    gauges[GAUGE_PACING_BPS] += load(&stats->gauges[s][GAUGE_PACING_BPS]);
+    uint64_t srtt = load(&stats->gauges[s][GAUGE_SRTT_US]);
+    uint64_t rto = load(&stats->gauges[s][GAUGE_RTO_US]);
+    if (srtt > gauges[GAUGE_SRTT_US]) gauges[GAUGE_SRTT_US] = srtt;
+    if (rto > gauges[GAUGE_RTO_US]) gauges[GAUGE_RTO_US] = rto;
+  }
+  uint64_t total = load(&stats->total);
+  uint64_t done = counters[STAT_BYTES_DONE] < total ? counters[STAT_BYTES_DONE] : total;
+  counters[STAT_BYTES_DONE] = done; // Receiver counts whole packets, the last one may be short
+  double elapsed = (double)(now - stats->start_us) / 1e6;
+  double interval = (double)(now - stats->last_us) / 1e6;
+  double rate = interval > 0 && done > stats->last_done ? (double)(done - stats->last_done) / interval : 0; // Since the last report
+  double goodput = elapsed > 0 ? (double)done / elapsed : 0;
+  double cpu = elapsed > 0 ? (double)processCpuUs() / 1e6 / elapsed : 0; // 1.0 is one core busy
+  stats->last_us = now;
+  stats->last_done = done;
+
+  // Progress line, the reasons behind a slow transfer side by side
+  if (stats->interval_ms > 0) {
+    uint64_t resent = counters[STAT_RESEND_TIMEOUT] + counters[STAT_RESEND_HOLE] + counters[STAT_RESEND_META] + counters[STAT_RESEND_CONTROL];
+    fprintf(stderr, "[%7.1fs] %s %.1f/%.1f MB %3.0f%% %.1f MB/s", elapsed, stats->role, done / 1e6, total / 1e6,
+            total > 0 ? 100.0 * done / total : 0.0, (final ? goodput : rate) / 1e6);
+    if (strcmp(stats->role, "sender") == 0) {
+      fprintf(stderr, " | rtt %.1f ms rto %.0f ms cwnd %llu flight %llu pace %.0f Mbit/s | resent %llu (rto %llu, hole %llu) rto-events %llu",
+              gauges[GAUGE_SRTT_US] / 1e3, gauges[GAUGE_RTO_US] / 1e3, (unsigned long long)gauges[GAUGE_CWND],
+              (unsigned long long)gauges[GAUGE_IN_FLIGHT], gauges[GAUGE_PACING_BPS] * 8 / 1e6, (unsigned long long)resent, (unsigned long long)counters[STAT_RESEND_TIMEOUT],
+              (unsigned long long)counters[STAT_RESEND_HOLE], (unsigned long long)counters[STAT_RTO_EVENTS]);
+    } else {
+      fprintf(stderr, " | dup %llu crc %llu fec %llu sacks %llu", (unsigned long long)counters[STAT_DUPLICATES],
+              (unsigned long long)counters[STAT_CRC_ERRORS], (unsigned long long)counters[STAT_FEC_RECOVERED],
+              (unsigned long long)counters[STAT_SACKS_SENT]);
+    }
+    fprintf(stderr, " | cpu %.0f%%%s\n", 100 * cpu, final ? " | done" : "");
+  }
+
+  // JSON line with everything, histogram bucket i counts RTTs from 2^i us
+  if (stats->file == NULL && stats->socket == SOCKET_INVALID) return;
+  char line[2048];
+  int length = snprintf(line, sizeof(line), "{\"role\":\"%s\",\"final\":%s,\"time_s\":%.3f,\"total\":%llu,\"rate_Bps\":%.0f,"
+                        "\"goodput_Bps\":%.0f,\"cpu\":%.3f", stats->role, final ? "true" : "false", elapsed,
+                        (unsigned long long)total, rate, goodput, cpu);
+  for (size_t i = 0; i < STAT_COUNTERS; i++) {
+    length += snprintf(line + length, sizeof(line) - length, ",\"%s\":%llu", counter_names[i], (unsigned long long)counters[i]);
+  }
+  for (size_t i = 0; i < STAT_GAUGES; i++) {
+    length += snprintf(line + length, sizeof(line) - length, ",\"%s\":%llu", gauge_names[i], (unsigned long long)gauges[i]);
+  }
+  length += snprintf(line + length, sizeof(line) - length, ",\"rtt_p50_us\":%llu,\"rtt_p99_us\":%llu,\"rtt_us_log2\":[",
+                     (unsigned long long)rttPercentile(rtt, 0.5), (unsigned long long)rttPercentile(rtt, 0.99));
+  for (size_t i = 0; i < STATS_RTT_BUCKETS; i++) {
+    length += snprintf(line + length, sizeof(line) - length, "%s%llu", i > 0 ? "," : "", (unsigned long long)rtt[i]);
+  }
+  length += snprintf(line + length, sizeof(line) - length, "]}\n");
+
+  if (stats->file != NULL) {
+    fputs(line, stats->file);
+    fflush(stats->file);
+  }
+  if (stats->socket != SOCKET_INVALID && send(stats->socket, line, length, STATS_SEND_FLAGS) != length) {
+    socketClose(stats->socket); // Listener went away, the transfer goes on without it
+    stats->socket = SOCKET_INVALID;
+  }
+}
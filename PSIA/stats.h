@@ -0,0 +1,76 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "platform.h"
+
+#define STATS_RTT_BUCKETS 24 // Bucket i holds RTTs of 2^i to 2^(i+1) - 1 us, the last one everything above
+#define STATS_STREAMS 16     // Gauges per stream, as many as STREAM_MAX
+#define STATS_UNIX_PREFIX "unix:"
+#define STATS_EXPORT_PERIOD_MS 1000 // Between JSON lines when there are no progress lines
+
+// Counters of one transfer, summed over its streams
+typedef enum {
+  STAT_DATA_SENT,       // DATA packets, first sends only
+  STAT_BYTES_SENT,      // DATA payload on the wire, compressed where it was
+  STAT_PARITY_SENT,
+  STAT_RESEND_TIMEOUT,  // RTO expired
+  STAT_RESEND_HOLE,     // Later packets were SACKed
+  STAT_RESEND_META,     // META unanswered within an RTO
+  STAT_RESEND_CONTROL,  // Stop-and-wait packets, STOP and RSUM among them
+  STAT_RTO_EVENTS,      // Rounds that resent anything on RTO
+  STAT_SACKS_RECEIVED,
+  STAT_DATA_RECEIVED,
+  STAT_PARITY_RECEIVED,
+  STAT_DUPLICATES,      // DATA that was in place already
+  STAT_FEC_RECOVERED,   // DATA rebuilt from parity
+  STAT_CRC_ERRORS,      // Datagrams dropped on a bad checksum
+  STAT_SACKS_SENT,
+  STAT_NACKS_SENT,
+  STAT_BYTES_DONE,      // Sender: acknowledged or held from an earlier attempt. Receiver: written to the file
+  STAT_COUNTERS
+} StatCounter;
+
+// Latest value per stream, windows and rates are summed and times take the slowest stream
+typedef enum {
+  GAUGE_CWND,
+  GAUGE_IN_FLIGHT,
+  GAUGE_SRTT_US,
+  GAUGE_RTO_US,
+  GAUGE_PACING_BPS, // 0 while unpaced
+  STAT_GAUGES
+} StatGauge;
+
+// Live telemetry: counters updated by every stream thread, a reporter thread prints them and exports JSON lines
+typedef struct {
+  uint64_t counters[STAT_COUNTERS];
+  uint64_t rtt_us[STATS_RTT_BUCKETS];
+  uint64_t gauges[STATS_STREAMS][STAT_GAUGES];
+  uint64_t total; // Bytes of the transfer, 0 until known
+  const char *role;
+  uint64_t start_us;
+  uint64_t last_us;   // Previous report, for the rate since then
+  uint64_t last_done;
+  uint32_t interval_ms; // Progress lines on stderr, 0 for none
+  uint32_t period_ms;   // Between reports
+  FILE *file;           // JSON lines, or NULL
+  socket_t socket;      // JSON lines to a Unix socket, or SOCKET_INVALID
+  Progress stop;
+  thread_t thread;
+  bool running;
+} Stats;
+
+// Export is a file appended to, or unix:<path> of a listening socket, NULL for none. -1 when it can't be opened
+int statsOpen(Stats *stats, const char *role, uint32_t interval_ms, const char *export_path);
+void statsClose(Stats *stats); // Final report, then the export is closed
+void statsThread(void *arg);
+void statsReport(Stats *stats, bool final);
+// All of these take NULL for a transfer without telemetry
+void statsAdd(Stats *stats, StatCounter counter, uint64_t value);
+void statsSet(Stats *stats, size_t stream, StatGauge gauge, uint64_t value);
+void statsRtt(Stats *stats, uint64_t rtt_us);
+void statsSetTotal(Stats *stats, uint64_t total);
+
+#endif /* STATS_H */
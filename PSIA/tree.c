@@ -0,0 +1,159 @@
+/*
+ * Integrity tree of a file. Every 64 KB chunk is hashed with XXH64 on its own, so chunks can be checked in any order and
+ * one that differs is found without hashing the file again. Pairs of hashes are hashed up to a single root, which is
+ * what the two sides compare first.
+ */
+
+#include "tree.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ull
+#define PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define PRIME64_3 0x165667B19E3779F9ull
+#define PRIME64_4 0x85EBCA77C2B2AE63ull
+#define PRIME64_5 0x27D4EB2F165667C5ull
+
+static uint64_t rotl64(uint64_t x, int n) { return (x << n) | (x >> (64 - n)); }
+
+// Input is read little-endian whatever the host, as XXH64 defines it
+static uint64_t read64(const uint8_t *p) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+#else
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+#endif
+}
+
+static uint32_t read32(const uint8_t *p) { return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24; }
+
+static uint64_t xxhRound(uint64_t acc, uint64_t input) {
+  acc += input * PRIME64_2;
+  return rotl64(acc, 31) * PRIME64_1;
+}
+
+static uint64_t xxhMerge(uint64_t acc, uint64_t value) {
+  acc ^= xxhRound(0, value);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t xxh64(const void *data, size_t length, uint64_t seed) {
+  const uint8_t *p = (const uint8_t *)data;
+  const uint8_t *end = p + length;
+  uint64_t hash;
+
+  // Four lanes over 32-byte stripes, merged into one
+  if (length >= 32) {
+    uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+    uint64_t v2 = seed + PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME64_1;
+    for (; p + 32 <= end; p += 32) {
+      v1 = xxhRound(v1, read64(p));
+      v2 = xxhRound(v2, read64(p + 8));
+      v3 = xxhRound(v3, read64(p + 16));
+      v4 = xxhRound(v4, read64(p + 24));
+    }
+    hash = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    hash = xxhMerge(hash, v1);
+    hash = xxhMerge(hash, v2);
+    hash = xxhMerge(hash, v3);
+    hash = xxhMerge(hash, v4);
+  } else {
+    hash = seed + PRIME64_5;
+  }
+  hash += (uint64_t)length;
+
+  // Tail in 8, 4 and 1 byte steps
+  for (; p + 8 <= end; p += 8) {
+    hash ^= xxhRound(0, read64(p));
+    hash = rotl64(hash, 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (p + 4 <= end) {
+    hash ^= (uint64_t)read32(p) * PRIME64_1;
+    hash = rotl64(hash, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    hash ^= *p * PRIME64_5;
+    hash = rotl64(hash, 11) * PRIME64_1;
+  }
+
+  // Final avalanche
+  hash ^= hash >> 33;
+  hash *= PRIME64_2;
+  hash ^= hash >> 29;
+  hash *= PRIME64_3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+int treeInit(Tree *tree, uint64_t size) {
+  memset(tree, 0, sizeof(*tree));
+  tree->size = size;
+  tree->leaf_count = (size_t)((size + TREE_CHUNK_SIZE - 1) / TREE_CHUNK_SIZE);
+  tree->leaves = (uint64_t *)calloc(tree->leaf_count + 1, sizeof(uint64_t));
+  tree->nodes = (uint64_t *)calloc(tree->leaf_count + 1, sizeof(uint64_t));
+  if (tree->leaves == NULL || tree->nodes == NULL) {
+    treeFree(tree);
+    return -1;
+  }
+  return 0;
+}
+
+void treeFree(Tree *tree) {
+  free(tree->leaves);
+  free(tree->nodes);
+  tree->leaves = NULL;
+  tree->nodes = NULL;
+}
+
+static size_t treeChunkLength(const Tree *tree, size_t chunk) {
+  uint64_t start = (uint64_t)chunk * TREE_CHUNK_SIZE;
+  return (size_t)(start + TREE_CHUNK_SIZE < tree->size ? TREE_CHUNK_SIZE : tree->size - start);
+}
+
+void treeHashLeaf(Tree *tree, size_t chunk, const char *chunk_data) {
+  if (chunk < tree->leaf_count) tree->leaves[chunk] = xxh64(chunk_data, treeChunkLength(tree, chunk), TREE_LEAF_SEED);
+}
+
+void treeHashLeaves(Tree *tree, const char *data, size_t first, size_t end) {
+  for (size_t chunk = first; chunk < end && chunk < tree->leaf_count; chunk++) {
+    treeHashLeaf(tree, chunk, data + (uint64_t)chunk * TREE_CHUNK_SIZE);
+  }
+}
+
+uint64_t treeRoot(Tree *tree) {
+  if (tree->leaf_count == 0) return xxh64(NULL, 0, TREE_LEAF_SEED); // Empty file
+
+  // Each level halves the one below, children are hashed as 16 little-endian bytes
+  memcpy(tree->nodes, tree->leaves, tree->leaf_count * sizeof(uint64_t));
+  size_t count = tree->leaf_count;
+  while (count > 1) {
+    size_t next = 0;
+    for (size_t i = 0; i + 1 < count; i += 2) {
+      uint8_t pair[16];
+      for (int b = 0; b < 8; b++) {
+        pair[b] = (uint8_t)(tree->nodes[i] >> (8 * b));
+        pair[8 + b] = (uint8_t)(tree->nodes[i + 1] >> (8 * b));
+      }
+      tree->nodes[next++] = xxh64(pair, sizeof(pair), TREE_NODE_SEED);
+    }
+    if (count % 2 == 1) tree->nodes[next++] = tree->nodes[count - 1];
+    count = next;
+  }
+  return tree->nodes[0];
+}
+
+void treeDigest(Tree *tree, uint8_t *digest) {
+  uint64_t root = treeRoot(tree);
+  for (int i = 0; i < TREE_ROOT_LEN; i++) {
+    digest[i] = (uint8_t)(root >> (56 - 8 * i));
+  }
+}
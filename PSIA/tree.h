@@ -0,0 +1,29 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "journal.h"
+
+#define TREE_CHUNK_SIZE JOURNAL_CHUNK_SIZE // Leaves line up with journal chunks, so a bad one is resent like a missing one
+#define TREE_ROOT_LEN 8
+#define TREE_LEAF_SEED 0 // Leaves and inner nodes hash with different seeds, a pair of leaves never passes for a chunk
+#define TREE_NODE_SEED 1
+
+// Merkle tree over the fixed-size chunks of a file, the leaves are XXH64 of each chunk
+typedef struct {
+  uint64_t size;
+  size_t leaf_count;
+  uint64_t *leaves;
+  uint64_t *nodes; // Scratch for one level at a time
+} Tree;
+
+uint64_t xxh64(const void *data, size_t length, uint64_t seed);
+int treeInit(Tree *tree, uint64_t size); // Leaves all 0, -1 when out of memory
+void treeFree(Tree *tree);
+void treeHashLeaf(Tree *tree, size_t chunk, const char *chunk_data); // One chunk, read from wherever it lies
+void treeHashLeaves(Tree *tree, const char *data, size_t first, size_t end); // Chunks first to end - 1 of a mapped file
+uint64_t treeRoot(Tree *tree); // Pairs hashed level by level, an odd node moves up as it is
+void treeDigest(Tree *tree, uint8_t *digest); // Root big-endian into TREE_ROOT_LEN bytes
+
+#endif /* TREE_H */